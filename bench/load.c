@@ -0,0 +1,694 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * A load generator for WServer
+ *
+ * Every thread drives its own share of the connections with poll(),
+ * sends GET requests and waits for the complete responses. Modes:
+ *
+ *   keepalive  one request at a time per connection
+ *   pipeline   --depth requests at a time per connection
+ *   connect    a new connection for every request
+ *   halfclose  the same, shutting down writing after the request;
+ *              a response cut short counts as an error
+ *
+ * --slow adds connections that trickle their requests in one byte
+ * at a time, they hold on to the server while the measured ones run.
+ *
+ * The summary goes to stderr, one JSON object with the results to
+ * stdout.
+ */
+
+typedef enum {
+	MODE_KEEPALIVE,
+	MODE_PIPELINE,
+	MODE_CONNECT,
+	MODE_HALFCLOSE,
+} Mode;
+
+static const char *mode_names[] = {
+	[MODE_KEEPALIVE] = "keepalive",
+	[MODE_PIPELINE]  = "pipeline",
+	[MODE_CONNECT]   = "connect",
+	[MODE_HALFCLOSE] = "halfclose",
+};
+
+static struct {
+	const char *host;
+	int port;
+	const char *path;
+	Mode mode;
+	int connections;
+	int depth;
+	int threads;
+	int slow;
+	int slow_interval_ms;
+	double duration;
+	double warmup;
+	const char *label;
+} opts = {
+	.host             = "127.0.0.1",
+	.port             = 8080,
+	.path             = "/index.html",
+	.mode             = MODE_KEEPALIVE,
+	.connections      = 64,
+	.depth            = 16,
+	.threads          = 1,
+	.slow             = 0,
+	.slow_interval_ms = 10,
+	.duration         = 5,
+	.warmup           = 1,
+	.label            = NULL,
+};
+
+static struct sockaddr_in target;
+
+/*
+ * Latency histogram, in nanoseconds: every power of two is split
+ * into HIST_SUB linear buckets (~3% resolution).
+ */
+#define HIST_SUB_BITS (5)
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_GROUPS   (40)
+#define HIST_BUCKETS  ((HIST_GROUPS + 1) * HIST_SUB)
+
+typedef struct {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t max;
+	uint64_t sum;
+} Hist;
+
+static inline size_t hist_bucket(uint64_t ns)
+{
+	if (ns < HIST_SUB)
+		return (size_t) ns;
+
+	int mag = 63 - __builtin_clzll(ns);
+	size_t group = (size_t) (mag - HIST_SUB_BITS + 1);
+	if (group > HIST_GROUPS)
+		return HIST_BUCKETS - 1;
+	return group * HIST_SUB + (size_t) (ns >> (mag - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+static inline uint64_t hist_bucket_end(size_t bucket)
+{
+	size_t group = bucket / HIST_SUB;
+	size_t sub = bucket % HIST_SUB;
+
+	if (group == 0)
+		return sub + 1;
+	return (uint64_t) (HIST_SUB + sub + 1) << (group - 1);
+}
+
+static inline void hist_add(Hist *hist, uint64_t ns)
+{
+	hist->counts[hist_bucket(ns)]++;
+	hist->sum += ns;
+	if (ns > hist->max)
+		hist->max = ns;
+}
+
+static uint64_t hist_count(const Hist *hist)
+{
+	uint64_t count = 0;
+	for (size_t i = 0; i < HIST_BUCKETS; i++)
+		count += hist->counts[i];
+	return count;
+}
+
+static uint64_t hist_quantile(const Hist *hist, double q)
+{
+	uint64_t count = hist_count(hist);
+	if (!count)
+		return 0;
+
+	uint64_t rank = (uint64_t) (q * (double) count);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist->counts[i];
+		if (seen > rank) {
+			uint64_t end = hist_bucket_end(i);
+			return (end < hist->max) ? end : hist->max;
+		}
+	}
+	return hist->max;
+}
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * The request, repeated --depth times for pipelining.
+ */
+static char *request;
+static size_t request_len;
+static size_t batch_len;
+
+#define HEADER_MAX (8192)
+
+typedef enum {
+	CONN_CONNECTING,
+	CONN_SENDING,
+	CONN_WAITING,
+} ConnState;
+
+typedef struct {
+	int fd;
+	ConnState state;
+	int slow;
+
+	/* Bytes of the batch sent so far */
+	size_t sent;
+	size_t batch;
+
+	/* Responses the connection still waits for */
+	int outstanding;
+	uint64_t sent_at;
+	uint64_t next_byte_at;
+
+	/* The response being read */
+	char header[HEADER_MAX];
+	size_t header_len;
+	uint64_t body_left;
+	int in_body;
+} Conn;
+
+typedef struct {
+	pthread_t thread;
+	int id;
+
+	Conn *conns;
+	int nconns;
+
+	Hist hist;
+	uint64_t requests;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t non_200;
+	uint64_t slow_requests;
+} Thread;
+
+static uint64_t start_at;
+static uint64_t measure_at;
+static uint64_t stop_at;
+
+static int conn_open(Conn *conn)
+{
+	conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (conn->fd < 0)
+		return -1;
+
+	int one = 1;
+	(void) setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	conn->state = CONN_CONNECTING;
+	conn->header_len = 0;
+	conn->in_body = 0;
+	conn->outstanding = 0;
+
+	if (connect(conn->fd, (struct sockaddr *) &target, sizeof(target)) < 0 && errno != EINPROGRESS) {
+		close(conn->fd);
+		conn->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void conn_start_batch(Conn *conn)
+{
+	conn->state = CONN_SENDING;
+	conn->sent = 0;
+	conn->batch = conn->slow ? request_len : batch_len;
+	conn->outstanding = conn->slow ? 1 : ((opts.mode == MODE_PIPELINE) ? opts.depth : 1);
+	conn->sent_at = now_ns();
+	conn->next_byte_at = conn->sent_at;
+}
+
+static void conn_reset(Thread *thread, Conn *conn, int error)
+{
+	if (error)
+		thread->errors++;
+	if (conn->fd >= 0)
+		close(conn->fd);
+	conn->fd = -1;
+
+	if (now_ns() < stop_at)
+		(void) conn_open(conn);
+}
+
+/*
+ * Send what the socket takes of the batch, a single byte when slow.
+ * Returns -1 on error.
+ */
+static int conn_send(Conn *conn)
+{
+	while (conn->sent < conn->batch) {
+		size_t len = conn->batch - conn->sent;
+		if (conn->slow) {
+			if (now_ns() < conn->next_byte_at)
+				return 0;
+			len = 1;
+		}
+
+		ssize_t n = send(conn->fd, request + conn->sent, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		conn->sent += (size_t) n;
+		if (conn->slow)
+			conn->next_byte_at = now_ns() + (uint64_t) opts.slow_interval_ms * 1000000;
+	}
+
+	/* The server still has to answer all of it */
+	if (opts.mode == MODE_HALFCLOSE && !conn->slow && shutdown(conn->fd, SHUT_WR) < 0)
+		return -1;
+
+	conn->state = CONN_WAITING;
+	return 0;
+}
+
+static uint64_t parse_content_length(const char *header, size_t len)
+{
+	static const char name[] = "\r\ncontent-length:";
+	const size_t name_len = sizeof(name) - 1;
+
+	for (size_t i = 0; i + name_len <= len; i++) {
+		if (strncasecmp(header + i, name, name_len))
+			continue;
+		return strtoull(header + i + name_len, NULL, 10);
+	}
+	return 0;
+}
+
+/*
+ * A whole response came in.
+ */
+static void conn_response(Thread *thread, Conn *conn, int ok)
+{
+	uint64_t now = now_ns();
+	conn->outstanding--;
+
+	if (now >= measure_at) {
+		if (conn->slow) {
+			thread->slow_requests++;
+		} else {
+			thread->requests++;
+			hist_add(&thread->hist, now - conn->sent_at);
+			if (!ok)
+				thread->non_200++;
+		}
+	}
+}
+
+/*
+ * Read and split up responses. Returns -1 if the connection
+ * has to be reset, 1 if it's ready for the next batch.
+ */
+static int conn_recv(Thread *thread, Conn *conn, char *buf, size_t size)
+{
+	for ( ;; ) {
+		ssize_t n = recv(conn->fd, buf, size, 0);
+		if (n == 0)
+			return -1;
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (now_ns() >= measure_at)
+			thread->bytes += (uint64_t) n;
+
+		char *p = buf;
+		char *end = buf + n;
+
+		while (p < end) {
+			if (conn->in_body) {
+				uint64_t take = (uint64_t) (end - p);
+				take = (take < conn->body_left) ? take : conn->body_left;
+				p += take;
+				conn->body_left -= take;
+			} else {
+				/* Only the headers are kept, up to their end */
+				size_t room = HEADER_MAX - conn->header_len;
+				size_t take = (size_t) (end - p);
+				take = (take < room) ? take : room;
+				if (!take)
+					return -1;
+
+				(void) memcpy(conn->header + conn->header_len, p, take);
+				size_t scan_from = (conn->header_len >= 3) ? conn->header_len - 3 : 0;
+				conn->header_len += take;
+
+				char *hend = memmem(conn->header + scan_from, conn->header_len - scan_from, "\r\n\r\n", 4);
+				if (!hend) {
+					p += take;
+					continue;
+				}
+
+				size_t used = (size_t) (hend + 4 - conn->header) - (conn->header_len - take);
+				p += used;
+				conn->header_len = (size_t) (hend + 4 - conn->header);
+				conn->body_left = parse_content_length(conn->header, conn->header_len);
+				conn->in_body = 1;
+			}
+
+			if (conn->in_body && conn->body_left == 0) {
+				int ok = conn->header_len > 12 && !memcmp(conn->header + 9, "200", 3);
+				conn->in_body = 0;
+				conn->header_len = 0;
+				conn_response(thread, conn, ok);
+
+				if (conn->outstanding == 0)
+					return (p == end) ? 1 : -1;
+			}
+		}
+	}
+}
+
+static void *thread_main(void *arg)
+{
+	Thread *thread = arg;
+
+	struct pollfd *fds = calloc(thread->nconns, sizeof(struct pollfd));
+	char *buf = malloc(65536);
+	if (!fds || !buf) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < thread->nconns; i++) {
+		if (conn_open(&thread->conns[i]) < 0)
+			thread->errors++;
+	}
+
+	for ( ;; ) {
+		uint64_t now = now_ns();
+		if (now >= stop_at)
+			break;
+
+		int timeout = (int) ((stop_at - now) / 1000000) + 1;
+		if (opts.slow && timeout > opts.slow_interval_ms)
+			timeout = opts.slow_interval_ms;
+
+		for (int i = 0; i < thread->nconns; i++) {
+			Conn *conn = &thread->conns[i];
+			fds[i].fd = conn->fd;
+			fds[i].events = (conn->state == CONN_WAITING) ? POLLIN : POLLOUT;
+			if (conn->slow && conn->state == CONN_SENDING && now < conn->next_byte_at)
+				fds[i].events = 0;
+			fds[i].revents = 0;
+		}
+
+		if (poll(fds, thread->nconns, timeout) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+
+		for (int i = 0; i < thread->nconns; i++) {
+			Conn *conn = &thread->conns[i];
+			if (conn->fd < 0) {
+				if (now_ns() < stop_at && conn_open(conn) < 0)
+					thread->errors++;
+				continue;
+			}
+
+			short revents = fds[i].revents;
+			if (conn->slow && conn->state == CONN_SENDING && !revents)
+				revents = POLLOUT;
+			if (!revents)
+				continue;
+
+			if (revents & (POLLERR | POLLNVAL)) {
+				conn_reset(thread, conn, 1);
+				continue;
+			}
+
+			if (conn->state == CONN_CONNECTING) {
+				int err = 0;
+				socklen_t len = sizeof(err);
+				(void) getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err) {
+					conn_reset(thread, conn, 1);
+					continue;
+				}
+				conn_start_batch(conn);
+			}
+
+			if (conn->state == CONN_SENDING && conn_send(conn) < 0) {
+				conn_reset(thread, conn, 1);
+				continue;
+			}
+
+			if (conn->state != CONN_WAITING || !(revents & (POLLIN | POLLHUP)))
+				continue;
+
+			int ret = conn_recv(thread, conn, buf, 65536);
+			if (ret < 0) {
+				conn_reset(thread, conn, conn->outstanding > 0);
+			} else if (ret > 0) {
+				if ((opts.mode == MODE_CONNECT || opts.mode == MODE_HALFCLOSE) && !conn->slow)
+					conn_reset(thread, conn, 0);
+				else
+					conn_start_batch(conn);
+			}
+		}
+	}
+
+	for (int i = 0; i < thread->nconns; i++) {
+		if (thread->conns[i].fd >= 0)
+			close(thread->conns[i].fd);
+	}
+	free(fds);
+	free(buf);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n\n"
+		"  -H, --host ADDR         server address (127.0.0.1)\n"
+		"  -p, --port N            server port (8080)\n"
+		"  -u, --path PATH         path to request (/index.html)\n"
+		"  -m, --mode MODE         keepalive, pipeline, connect or halfclose (keepalive)\n"
+		"  -c, --connections N     measured connections (64)\n"
+		"  -P, --depth N           requests in flight per connection when pipelining (16)\n"
+		"  -t, --threads N         client threads (1)\n"
+		"  -s, --slow N            extra connections trickling their requests (0)\n"
+		"  -i, --slow-interval MS  time between the bytes of a slow client (10)\n"
+		"  -d, --duration S        seconds to measure (5)\n"
+		"  -w, --warmup S          seconds to run before measuring (1)\n"
+		"  -l, --label NAME        name of the run in the results\n",
+		prog);
+}
+
+static int parse_args(int argc, char **argv)
+{
+	static const struct option long_opts[] = {
+		{ "host",          required_argument, NULL, 'H' },
+		{ "port",          required_argument, NULL, 'p' },
+		{ "path",          required_argument, NULL, 'u' },
+		{ "mode",          required_argument, NULL, 'm' },
+		{ "connections",   required_argument, NULL, 'c' },
+		{ "depth",         required_argument, NULL, 'P' },
+		{ "threads",       required_argument, NULL, 't' },
+		{ "slow",          required_argument, NULL, 's' },
+		{ "slow-interval", required_argument, NULL, 'i' },
+		{ "duration",      required_argument, NULL, 'd' },
+		{ "warmup",        required_argument, NULL, 'w' },
+		{ "label",         required_argument, NULL, 'l' },
+		{ "help",          no_argument,       NULL, 'h' },
+		{ 0 },
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "H:p:u:m:c:P:t:s:i:d:w:l:h", long_opts, NULL)) != -1) {
+		switch (opt) {
+			case 'H': opts.host = optarg; break;
+			case 'p': opts.port = atoi(optarg); break;
+			case 'u': opts.path = optarg; break;
+			case 'c': opts.connections = atoi(optarg); break;
+			case 'P': opts.depth = atoi(optarg); break;
+			case 't': opts.threads = atoi(optarg); break;
+			case 's': opts.slow = atoi(optarg); break;
+			case 'i': opts.slow_interval_ms = atoi(optarg); break;
+			case 'd': opts.duration = atof(optarg); break;
+			case 'w': opts.warmup = atof(optarg); break;
+			case 'l': opts.label = optarg; break;
+			case 'm': {
+				int found = 0;
+				for (size_t i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++) {
+					if (!strcmp(optarg, mode_names[i])) {
+						opts.mode = (Mode) i;
+						found = 1;
+					}
+				}
+				if (!found) {
+					fprintf(stderr, "unknown mode %s\n", optarg);
+					return -1;
+				}
+				break;
+			}
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if (opts.connections < 1 || opts.threads < 1 || opts.depth < 1 || opts.slow < 0 ||
+			opts.duration <= 0 || opts.warmup < 0 || opts.port < 1 || opts.port > 65535) {
+		fprintf(stderr, "invalid options\n");
+		return -1;
+	}
+	if (opts.mode != MODE_PIPELINE)
+		opts.depth = 1;
+	if (opts.threads > opts.connections)
+		opts.threads = opts.connections;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (parse_args(argc, argv) < 0)
+		return 2;
+
+	(void) memset(&target, 0, sizeof(target));
+	target.sin_family = AF_INET;
+	target.sin_port = htons((uint16_t) opts.port);
+	if (inet_pton(AF_INET, opts.host, &target.sin_addr) != 1) {
+		fprintf(stderr, "invalid address %s\n", opts.host);
+		return 2;
+	}
+
+	int len = snprintf(NULL, 0, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", opts.path, opts.host);
+	request_len = (size_t) len;
+	batch_len = request_len * (size_t) opts.depth;
+	request = malloc(batch_len + 1);
+	if (!request)
+		return 1;
+	for (int i = 0; i < opts.depth; i++)
+		(void) snprintf(request + i * request_len, request_len + 1,
+				"GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", opts.path, opts.host);
+
+	int total = opts.connections + opts.slow;
+	Conn *conns = calloc(total, sizeof(Conn));
+	Thread *threads = calloc(opts.threads, sizeof(Thread));
+	if (!conns || !threads)
+		return 1;
+
+	/* Slow clients go at the end, spread over the threads like the rest */
+	for (int i = 0; i < total; i++) {
+		conns[i].fd = -1;
+		conns[i].slow = (i >= opts.connections);
+	}
+
+	int per_thread = total / opts.threads;
+	int extra = total % opts.threads;
+	Conn *next = conns;
+	for (int i = 0; i < opts.threads; i++) {
+		threads[i].id = i;
+		threads[i].conns = next;
+		threads[i].nconns = per_thread + (i < extra);
+		next += threads[i].nconns;
+	}
+
+	start_at   = now_ns();
+	measure_at = start_at + (uint64_t) (opts.warmup * 1e9);
+	stop_at    = measure_at + (uint64_t) (opts.duration * 1e9);
+
+	for (int i = 0; i < opts.threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, thread_main, &threads[i])) {
+			fprintf(stderr, "failed to start a thread\n");
+			return 1;
+		}
+	}
+
+	Hist *hist = calloc(1, sizeof(Hist));
+	if (!hist)
+		return 1;
+	uint64_t requests = 0, bytes = 0, errors = 0, non_200 = 0, slow_requests = 0;
+
+	for (int i = 0; i < opts.threads; i++) {
+		Thread *thread = &threads[i];
+		pthread_join(thread->thread, NULL);
+
+		for (size_t b = 0; b < HIST_BUCKETS; b++)
+			hist->counts[b] += thread->hist.counts[b];
+		hist->sum += thread->hist.sum;
+		if (thread->hist.max > hist->max)
+			hist->max = thread->hist.max;
+
+		requests      += thread->requests;
+		bytes         += thread->bytes;
+		errors        += thread->errors;
+		non_200       += thread->non_200;
+		slow_requests += thread->slow_requests;
+	}
+
+	double secs = opts.duration;
+	double rps = (double) requests / secs;
+	double mean_us = requests ? (double) hist->sum / (double) requests / 1e3 : 0;
+	double p50 = (double) hist_quantile(hist, 0.5) / 1e3;
+	double p99 = (double) hist_quantile(hist, 0.99) / 1e3;
+	double p999 = (double) hist_quantile(hist, 0.999) / 1e3;
+	double max = (double) hist->max / 1e3;
+
+	fprintf(stderr,
+		"%s: %d connections (+%d slow), %d thread(s), %.1f s\n"
+		"  %" PRIu64 " requests, %.0f req/s, %.2f MB/s\n"
+		"  latency us: mean %.1f, p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n"
+		"  %" PRIu64 " error(s), %" PRIu64 " non-200, %" PRIu64 " slow request(s)\n",
+		mode_names[opts.mode], opts.connections, opts.slow, opts.threads, secs,
+		requests, rps, (double) bytes / secs / 1e6,
+		mean_us, p50, p99, p999, max,
+		errors, non_200, slow_requests);
+
+	printf("{\"bench\":\"load\",\"label\":\"%s\",\"mode\":\"%s\",\"path\":\"%s\","
+		"\"connections\":%d,\"depth\":%d,\"slow\":%d,\"threads\":%d,\"duration_s\":%.3f,"
+		"\"requests\":%" PRIu64 ",\"requests_per_s\":%.1f,\"bytes_per_s\":%.1f,"
+		"\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+		"\"errors\":%" PRIu64 ",\"non_200\":%" PRIu64 ",\"slow_requests\":%" PRIu64 "}\n",
+		opts.label ? opts.label : mode_names[opts.mode], mode_names[opts.mode], opts.path,
+		opts.connections, opts.depth, opts.slow, opts.threads, secs,
+		requests, rps, (double) bytes / secs,
+		mean_us, p50, p99, p999, max,
+		errors, non_200, slow_requests);
+
+	free(hist);
+	free(conns);
+	free(threads);
+	free(request);
+	return 0;
+}
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+
+#include <sys/stat.h>
+
+#include <settings.h>
+#include <http.h>
+#include <log.h>
+#include <resource.h>
+#include <scan.h>
+
+/*
+ * Micro-benchmarks of the hot paths of a request: parsing it,
+ * looking up what it asks for and building response headers.
+ *
+ * Every benchmark prints one JSON object per line to stdout.
+ */
+
+#define NUM_FILES (2000)
+
+/* Spend about this long on every benchmark */
+#define BENCH_NS (500 * 1000000ull)
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Keeps the compiler from dropping the work being measured */
+static volatile uintptr_t sink;
+
+static const char typical_req[] =
+	"GET /dir4/file-1234.html HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"\r\n";
+
+static const char small_req[] =
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n";
+
+static void report(const char *name, uint64_t ops, uint64_t ns, size_t bytes_per_op)
+{
+	double ns_per_op = (double) ns / (double) ops;
+
+	printf("{\"bench\":\"micro\",\"name\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"ops_per_s\":%.0f",
+			name, (unsigned long long) ops, ns_per_op, 1e9 / ns_per_op);
+	if (bytes_per_op)
+		printf(",\"bytes_per_s\":%.0f", (double) bytes_per_op * 1e9 / ns_per_op);
+	printf("}\n");
+	fflush(stdout);
+}
+
+/*
+ * Parse `count` copies of a request, all in one buffer like a
+ * pipelined read, over and over.
+ */
+static void bench_parse(const char *name, const char *req, int count)
+{
+	size_t req_len = strlen(req);
+	uint32_t size = (uint32_t) (req_len * count);
+	uint8_t *data = malloc(size);
+	if (!data)
+		exit(1);
+	for (int i = 0; i < count; i++)
+		(void) memcpy(data + i * req_len, req, req_len);
+
+	HttpRequest request;
+	uint64_t ops = 0;
+	uint64_t start = now_ns(), end;
+
+	do {
+		for (int round = 0; round < 1000; round++) {
+			(void) memset(&request, 0, sizeof(request));
+			request.buf.buf  = data;
+			request.buf.size = size;
+			request.buf.used = size;
+
+			for (int i = 0; i < count; i++) {
+				if (http_check_done(&request) || !request.buf.progress) {
+					fprintf(stderr, "%s: request didn't parse\n", name);
+					exit(1);
+				}
+				sink += request.path_len;
+				http_next_req(&request);
+			}
+		}
+		ops += 1000 * (uint64_t) count;
+		end = now_ns();
+	} while (end - start < BENCH_NS);
+
+	report(name, ops, end - start, req_len);
+	free(data);
+}
+
+/*
+ * Look up paths from a list, in a shuffled order so it's not
+ * always the same few cache lines.
+ */
+static void bench_lookup(const char *name, char **paths, int count)
+{
+	uint16_t *lens = malloc(count * sizeof(uint16_t));
+	if (!lens)
+		exit(1);
+	for (int i = 0; i < count; i++)
+		lens[i] = (uint16_t) strlen(paths[i]);
+
+	uint64_t ops = 0;
+	uint64_t start = now_ns(), end;
+
+	do {
+		for (int i = 0; i < count; i++)
+			sink += (uintptr_t) resource_get((uint8_t *) paths[i], lens[i]);
+		ops += (uint64_t) count;
+		end = now_ns();
+	} while (end - start < BENCH_NS);
+
+	report(name, ops, end - start, 0);
+	free(lens);
+}
+
+static void bench_headers(void)
+{
+	static const int statuses[] = {200, 404, 200, 400, 200, 413, 200, 505};
+	char headers[512];
+	uint64_t ops = 0;
+	uint64_t start = now_ns(), end;
+
+	do {
+		for (int i = 0; i < 1024; i++) {
+			int status = statuses[i % (sizeof(statuses) / sizeof(statuses[0]))];
+			sink += (uintptr_t) http_response_headers(headers, sizeof(headers), status, (size_t) i * 37);
+		}
+		ops += 1024;
+		end = now_ns();
+	} while (end - start < BENCH_NS);
+
+	report("http_response_headers", ops, end - start, 0);
+}
+
+static char root[] = "/tmp/wserver-micro-XXXXXX";
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void) st;
+	(void) flag;
+	(void) ftw;
+	return remove(path);
+}
+
+static void remove_root(void)
+{
+	(void) nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * A document root with NUM_FILES small files spread over a few
+ * directories. Returns the request paths of them.
+ */
+static char **make_root(void)
+{
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	atexit(remove_root);
+
+	char **paths = calloc(NUM_FILES, sizeof(char *));
+	if (!paths)
+		exit(1);
+
+	char fs_path[256];
+	for (int d = 0; d < 10; d++) {
+		(void) snprintf(fs_path, sizeof(fs_path), "%s/dir%d", root, d);
+		if (mkdir(fs_path, 0755) < 0) {
+			perror("mkdir");
+			exit(1);
+		}
+	}
+
+	for (int i = 0; i < NUM_FILES; i++) {
+		char path[64];
+		(void) snprintf(path, sizeof(path), "/dir%d/file-%d.html", i % 10, i);
+		(void) snprintf(fs_path, sizeof(fs_path), "%s%s", root, path);
+
+		int fd = open(fs_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || write(fd, "<p>hi</p>\n", 10) != 10) {
+			perror(fs_path);
+			exit(1);
+		}
+		close(fd);
+
+		paths[i] = strdup(path);
+		if (!paths[i])
+			exit(1);
+	}
+	return paths;
+}
+
+static void shuffle(char **paths, int count)
+{
+	srand(1);
+	for (int i = count - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		char *tmp = paths[i];
+		paths[i] = paths[j];
+		paths[j] = tmp;
+	}
+}
+
+int main(void)
+{
+	char **paths = make_root();
+
+	char *argv[] = {
+		"wserver-micro",
+		"--root", root,
+		"--live-reload", "no",
+		"--log", "no",
+		NULL,
+	};
+	if (settings_init(sizeof(argv) / sizeof(argv[0]) - 1, argv))
+		return 1;
+	if (log_init() < 0 || resource_init() < 0)
+		return 1;
+	scan_init();
+
+	fprintf(stderr, "Using %s request scanning.\n", scan_impl_name());
+
+	bench_parse("http_check_done/small", small_req, 1);
+	bench_parse("http_check_done/typical", typical_req, 1);
+	bench_parse("http_check_done/pipelined16", typical_req, 16);
+
+	shuffle(paths, NUM_FILES);
+	bench_lookup("resource_get/hit", paths, NUM_FILES);
+
+	/* The same paths with one byte changed, so every lookup misses */
+	for (int i = 0; i < NUM_FILES; i++)
+		paths[i][1] = 'x';
+	bench_lookup("resource_get/miss", paths, NUM_FILES);
+
+	bench_headers();
+
+	for (int i = 0; i < NUM_FILES; i++)
+		free(paths[i]);
+	free(paths);
+
+	resource_destroy();
+	log_destroy();
+	settings_destroy();
+	return 0;
+}
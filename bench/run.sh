@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Usage: run.sh WSERVER LOAD MICRO RESULTS
+#
+# Runs the micro-benchmarks, then every load scenario against a
+# server started on a scratch document root. Every result is one
+# JSON object per line in RESULTS.
+#
+# BENCH_DURATION  seconds per load scenario (5)
+# BENCH_PORT      port for the server (18080)
+# BENCH_THREADS   client threads (2)
+#
+
+set -e
+
+WSERVER=$1
+LOAD=$2
+MICRO=$3
+RESULTS=$4
+
+DURATION=${BENCH_DURATION:-5}
+PORT=${BENCH_PORT:-18080}
+THREADS=${BENCH_THREADS:-2}
+
+ROOT=$(mktemp -d /tmp/wserver-bench-XXXXXX)
+SERVER_PID=
+
+cleanup() {
+	status=$?
+	if [ -n "$SERVER_PID" ]; then
+		kill "$SERVER_PID" 2>/dev/null || true
+		wait "$SERVER_PID" 2>/dev/null || true
+	fi
+	rm -rf "$ROOT"
+	exit $status
+}
+trap cleanup EXIT INT TERM
+
+printf '<!doctype html>\n<title>bench</title>\n<p>Hello!</p>\n' > "$ROOT/index.html"
+head -c 102400 /dev/urandom > "$ROOT/mid.bin"
+head -c 4194304 /dev/urandom > "$ROOT/big.bin"
+head -c 20971520 /dev/urandom > "$ROOT/huge.bin"
+
+: > "$RESULTS"
+
+echo "== micro-benchmarks"
+"$MICRO" >> "$RESULTS"
+
+"$WSERVER" --root "$ROOT" --port "$PORT" --log no --live-reload no &
+SERVER_PID=$!
+
+# Wait for the server to listen
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	"$LOAD" -p "$PORT" -c 1 -d 0.05 -w 0 >/dev/null 2>&1 && break
+	sleep 0.2
+done
+
+run() {
+	label=$1
+	shift
+	echo "== $label"
+	"$LOAD" -p "$PORT" -t "$THREADS" -d "$DURATION" -l "$label" "$@" >> "$RESULTS"
+}
+
+run keepalive      -m keepalive -c 64
+run pipeline       -m pipeline -c 64 -P 16
+run connect        -m connect -c 64
+run many           -m keepalive -c 1000
+run slow           -m keepalive -c 64 -s 256 -i 20
+run mid-file       -m keepalive -c 64 -u /mid.bin
+run big-file       -m keepalive -c 8 -u /big.bin
+
+# More than the socket buffers take, the rest goes out after the client's FIN
+run half-close     -m halfclose -c 8 -u /huge.bin
+if ! tail -n 1 "$RESULTS" | grep -q '"errors":0,'; then
+	echo "half-close: responses were cut short" >&2
+	exit 1
+fi
+
+echo "Results in $RESULTS"
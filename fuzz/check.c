@@ -0,0 +1,229 @@
+#include "fuzz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <scan.h>
+
+static const char *scan_names[] = {"scalar", "sse4.2", "avx2"};
+#define NUM_SCAN_NAMES (sizeof(scan_names) / sizeof(scan_names[0]))
+
+/* The scan implementations this CPU has */
+static const char *scan_avail[NUM_SCAN_NAMES];
+static size_t scan_navail;
+
+static char mismatch[512];
+
+void fuzz_init(void)
+{
+	scan_navail = 0;
+	for (size_t i = 0; i < NUM_SCAN_NAMES; i++) {
+		if (scan_use(scan_names[i]) == 0)
+			scan_avail[scan_navail++] = scan_names[i];
+	}
+	scan_init();
+}
+
+/*
+ * Turn the state of the parser after http_check_done() returned
+ * into a ParseResult.
+ */
+static void real_result(const HttpRequest *request, int status, ParseResult *res)
+{
+	const HttpParser *parser = &request->parser;
+
+	(void) memset(res, 0, sizeof(*res));
+	res->status = status;
+	if (status || !request->buf.progress)
+		return;
+
+	res->done        = 1;
+	res->method      = request->method;
+	res->path_off    = parser->path_off - parser->start;
+	res->path_len    = request->path_len;
+	res->content_len = request->content_len;
+	if (request->content_len)
+		res->content_off = parser->content_off - parser->start;
+	res->end         = parser->off - parser->start;
+}
+
+static int result_eq(const ParseResult *a, const ParseResult *b)
+{
+	if (a->status != b->status || a->done != b->done)
+		return 0;
+	if (!a->done)
+		return 1;
+	return a->method == b->method &&
+		a->path_off == b->path_off && a->path_len == b->path_len &&
+		a->content_off == b->content_off && a->content_len == b->content_len &&
+		a->end == b->end;
+}
+
+static const char *describe(const char *how, size_t req, size_t off,
+		const ParseResult *got, const ParseResult *want)
+{
+	(void) snprintf(mismatch, sizeof(mismatch),
+		"%s: request %zu at offset %zu\n"
+		"  http_check_done(): status %d done %d method %d path %zu+%zu content %zu+%zu end %zu\n"
+		"  reference:         status %d done %d method %d path %zu+%zu content %zu+%zu end %zu\n",
+		how, req, off,
+		got->status, got->done, got->method, got->path_off, got->path_len,
+		got->content_off, got->content_len, got->end,
+		want->status, want->done, want->method, want->path_off, want->path_len,
+		want->content_off, want->content_len, want->end);
+	return mismatch;
+}
+
+/*
+ * Compare one request of the input against the reference. Returns
+ * 1 if the parser can go on with the next request, 0 if that was
+ * the last one, -1 if they don't agree.
+ */
+static int compare(const uint8_t *data, size_t size, size_t off, const ParseResult *got,
+		const char *how, size_t req)
+{
+	ParseResult want;
+	ref_parse(data + off, size - off, &want);
+
+	if (!result_eq(got, &want)) {
+		(void) describe(how, req, off, got, &want);
+		return -1;
+	}
+	return got->done && off + got->end < size;
+}
+
+/*
+ * Everything is in the buffer from the start, like a pipelined read.
+ * The buffer is exactly as big as the input, so reading past its end
+ * is caught by ASan.
+ */
+static const char *check_whole(const uint8_t *data, size_t size, const char *how)
+{
+	uint8_t *buf = malloc(size ? size : 1);
+	if (!buf)
+		abort();
+	(void) memcpy(buf, data, size);
+
+	HttpRequest request;
+	(void) memset(&request, 0, sizeof(request));
+	request.buf.buf  = buf;
+	request.buf.size = size;
+	request.buf.used = size;
+
+	const char *ret = NULL;
+	for (size_t req = 0; ; req++) {
+		size_t off = request.parser.start;
+
+		ParseResult got;
+		real_result(&request, http_check_done(&request), &got);
+
+		int next = compare(data, size, off, &got, how, req);
+		if (next < 0)
+			ret = mismatch;
+		if (next <= 0)
+			break;
+		http_next_req(&request);
+	}
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * A cheap PRNG for the piece sizes, seeded from the input so a
+ * crash can be reproduced.
+ */
+static inline uint32_t next_rand(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+/*
+ * The input comes in a few bytes at a time, and the finished requests
+ * are dropped from the front now and then, the way the server does
+ * it. The parser has to come to the same conclusions as with all of
+ * it there at once.
+ */
+static const char *check_pieces(const uint8_t *data, size_t size)
+{
+	uint8_t *buf = malloc(size ? size : 1);
+	if (!buf)
+		abort();
+
+	uint32_t state = 2166136261u;
+	for (size_t i = 0; i < size && i < 64; i++)
+		state = (state ^ data[i]) * 16777619u;
+	state |= 1;
+
+	HttpRequest request;
+	(void) memset(&request, 0, sizeof(request));
+	request.buf.buf  = buf;
+	request.buf.size = size;
+
+	/* Offset of buf[0] in the input, and how much of it is in there */
+	size_t base = 0;
+	size_t fed = 0;
+
+	const char *ret = NULL;
+	for (size_t req = 0; ; req++) {
+		int status;
+
+		for ( ;; ) {
+			status = http_check_done(&request);
+			if (status || request.buf.progress || fed == size)
+				break;
+
+			uint32_t r = next_rand(&state);
+			if ((r & 7) == 0 && request.parser.start) {
+				base += request.parser.start;
+				http_compact_req(&request);
+			}
+
+			size_t n = 1 + (r >> 8) % 24;
+			if (n > size - fed)
+				n = size - fed;
+			(void) memcpy(buf + request.buf.used, data + fed, n);
+			request.buf.used += n;
+			fed += n;
+		}
+
+		ParseResult got;
+		real_result(&request, status, &got);
+
+		int next = compare(data, size, base + request.parser.start, &got, "in pieces", req);
+		if (next < 0)
+			ret = mismatch;
+		if (next <= 0)
+			break;
+
+		uint32_t used = request.buf.used;
+		http_next_req(&request);
+		if (!request.buf.used)
+			base += used;
+	}
+
+	free(buf);
+	return ret;
+}
+
+const char *fuzz_check(const uint8_t *data, size_t size)
+{
+	/* The parser works with 32 bit offsets */
+	if (size > UINT32_MAX / 2)
+		return NULL;
+
+	const char *ret = NULL;
+	for (size_t i = 0; i < scan_navail && !ret; i++) {
+		(void) scan_use(scan_avail[i]);
+		ret = check_whole(data, size, scan_avail[i]);
+	}
+	scan_init();
+
+	if (!ret)
+		ret = check_pieces(data, size);
+	return ret;
+}
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+
+#include "fuzz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <scan.h>
+
+/*
+ * Differential test over corpus directories: every file has to
+ * parse the same with http_check_done() as with the reference
+ * parser (see fuzz_check()). After that the throughput of both
+ * parsers is measured on the corpus, so speed and correctness are
+ * tracked together.
+ *
+ * One JSON object per corpus goes to stdout, mismatches to stderr.
+ * Exits with 1 if there were any.
+ */
+
+/* Spend about this long timing every parser on a corpus */
+#define TIME_NS (300 * 1000000ull)
+
+typedef struct {
+	char *name;
+	uint8_t *data;
+	size_t size;
+} CorpusFile;
+
+typedef struct {
+	CorpusFile *files;
+	size_t count;
+	size_t bytes;
+} Corpus;
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+		return NULL;
+
+	struct stat st;
+	uint8_t *data = NULL;
+	if (fstat(fileno(file), &st) == 0 && (data = malloc(st.st_size ? st.st_size : 1))) {
+		*size = fread(data, 1, st.st_size, file);
+		if (*size != (size_t) st.st_size) {
+			free(data);
+			data = NULL;
+		}
+	}
+
+	fclose(file);
+	return data;
+}
+
+static int corpus_load(Corpus *corpus, const char *dir)
+{
+	(void) memset(corpus, 0, sizeof(*corpus));
+
+	DIR *d = opendir(dir);
+	if (!d) {
+		fprintf(stderr, "failed to open %s\n", dir);
+		return -1;
+	}
+
+	size_t cap = 0;
+	struct dirent *ent;
+	while ((ent = readdir(d))) {
+		char path[4096];
+		struct stat st;
+
+		(void) snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (corpus->count == cap) {
+			cap = cap ? cap * 2 : 64;
+			CorpusFile *bigger = realloc(corpus->files, cap * sizeof(CorpusFile));
+			if (!bigger)
+				break;
+			corpus->files = bigger;
+		}
+
+		CorpusFile *file = &corpus->files[corpus->count];
+		file->data = read_file(path, &file->size);
+		file->name = strdup(path);
+		if (!file->data || !file->name) {
+			fprintf(stderr, "failed to read %s\n", path);
+			free(file->data);
+			free(file->name);
+			continue;
+		}
+
+		corpus->bytes += file->size;
+		corpus->count++;
+	}
+
+	closedir(d);
+	return 0;
+}
+
+static void corpus_free(Corpus *corpus)
+{
+	for (size_t i = 0; i < corpus->count; i++) {
+		free(corpus->files[i].name);
+		free(corpus->files[i].data);
+	}
+	free(corpus->files);
+}
+
+/*
+ * Parse every request of a file, returns how many were complete.
+ */
+static size_t parse_real(const CorpusFile *file)
+{
+	HttpRequest request;
+	(void) memset(&request, 0, sizeof(request));
+	request.buf.buf  = file->data;
+	request.buf.size = file->size;
+	request.buf.used = file->size;
+
+	size_t count = 0;
+	while (!http_check_done(&request) && request.buf.progress) {
+		count++;
+		if (request.parser.off >= file->size)
+			break;
+		http_next_req(&request);
+	}
+	return count;
+}
+
+static size_t parse_ref(const CorpusFile *file)
+{
+	size_t count = 0;
+	size_t off = 0;
+
+	for ( ;; ) {
+		ParseResult res;
+		ref_parse(file->data + off, file->size - off, &res);
+		if (!res.done)
+			break;
+		count++;
+		off += res.end;
+		if (off >= file->size)
+			break;
+	}
+	return count;
+}
+
+/*
+ * Run a parser over the whole corpus for about TIME_NS, sets the
+ * bytes and requests it got through per second.
+ */
+static void corpus_time(const Corpus *corpus, size_t (*parse)(const CorpusFile *),
+		double *bytes_per_s, double *requests_per_s)
+{
+	uint64_t bytes = 0, requests = 0;
+	uint64_t start = now_ns(), end;
+
+	*bytes_per_s = *requests_per_s = 0;
+	if (!corpus->bytes)
+		return;
+
+	do {
+		for (size_t i = 0; i < corpus->count; i++)
+			requests += parse(&corpus->files[i]);
+		bytes += corpus->bytes;
+		end = now_ns();
+	} while (end - start < TIME_NS);
+
+	double secs = (double) (end - start) / 1e9;
+	*bytes_per_s = (double) bytes / secs;
+	*requests_per_s = (double) requests / secs;
+}
+
+static const char *base_name(const char *path)
+{
+	size_t len = strlen(path);
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+
+	const char *p = path + len;
+	while (p > path && p[-1] != '/')
+		p--;
+	return p;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s CORPUS_DIR...\n", argv[0]);
+		return 2;
+	}
+
+	fuzz_init();
+
+	int ret = 0;
+	for (int i = 1; i < argc; i++) {
+		Corpus corpus;
+		if (corpus_load(&corpus, argv[i]) < 0) {
+			ret = 1;
+			continue;
+		}
+
+		size_t mismatches = 0;
+		for (size_t f = 0; f < corpus.count; f++) {
+			const char *mismatch = fuzz_check(corpus.files[f].data, corpus.files[f].size);
+			if (mismatch) {
+				fprintf(stderr, "%s: %s", corpus.files[f].name, mismatch);
+				mismatches++;
+			}
+		}
+		if (mismatches)
+			ret = 1;
+
+		double bytes_per_s, requests_per_s, ref_bytes_per_s, ref_requests_per_s;
+		corpus_time(&corpus, parse_real, &bytes_per_s, &requests_per_s);
+		corpus_time(&corpus, parse_ref, &ref_bytes_per_s, &ref_requests_per_s);
+
+		char name[256];
+		(void) snprintf(name, sizeof(name), "%s", base_name(argv[i]));
+		name[strcspn(name, "/")] = '\0';
+
+		printf("{\"bench\":\"parse\",\"corpus\":\"%s\",\"files\":%zu,\"bytes\":%zu,"
+			"\"mismatches\":%zu,\"scan\":\"%s\","
+			"\"bytes_per_s\":%.0f,\"requests_per_s\":%.0f,"
+			"\"ref_bytes_per_s\":%.0f,\"ref_requests_per_s\":%.0f}\n",
+			name, corpus.count, corpus.bytes, mismatches, scan_impl_name(),
+			bytes_per_s, requests_per_s, ref_bytes_per_s, ref_requests_per_s);
+		fflush(stdout);
+
+		corpus_free(&corpus);
+	}
+
+	return ret;
+}
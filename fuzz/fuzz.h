@@ -0,0 +1,50 @@
+#ifndef _FUZZ_HEADER_GUARD
+#define _FUZZ_HEADER_GUARD
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <http.h>
+
+/*
+ * What parsing one request from the front of a buffer came to.
+ * Offsets are from the start of the request.
+ */
+typedef struct {
+	/* 0, or the status code the request was rejected with */
+	int status;
+
+	/* A whole request was there (and status is 0) */
+	int done;
+
+	HttpMethod method;
+	size_t path_off, path_len;
+	size_t content_off, content_len;
+
+	/* Right after the request, where the next one starts */
+	size_t end;
+} ParseResult;
+
+/*
+ * The reference parser: slow and simple, written from the RFCs
+ * (9110 and 9112) instead of from http.c, for differential tests.
+ */
+void ref_parse(const uint8_t *, size_t, ParseResult *);
+
+/*
+ * Set up what the checks need (the scan kernels).
+ */
+void fuzz_init(void);
+
+/*
+ * Parse every request in the input with http_check_done(), once
+ * with the whole input there, once with it trickling in, and with
+ * every scan implementation the CPU supports. All of them have to
+ * agree with ref_parse().
+ *
+ * Returns NULL if they do, or a description of the first difference
+ * (a static buffer).
+ */
+const char *fuzz_check(const uint8_t *, size_t);
+
+#endif // _FUZZ_HEADER_GUARD
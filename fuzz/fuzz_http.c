@@ -0,0 +1,28 @@
+#include "fuzz.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * libFuzzer entry points. Built with -fsanitize=fuzzer these make a
+ * fuzzer on their own, otherwise standalone.c supplies a main() that
+ * runs them on files (or stdin, for AFL).
+ */
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	(void) argc;
+	(void) argv;
+	fuzz_init();
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	const char *mismatch = fuzz_check(data, size);
+	if (mismatch) {
+		fprintf(stderr, "%s", mismatch);
+		abort();
+	}
+	return 0;
+}
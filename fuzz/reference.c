@@ -0,0 +1,223 @@
+#include "fuzz.h"
+
+#include <string.h>
+
+/*
+ * Everything here goes one byte at a time and says what it does,
+ * it has to be obviously right rather than fast. Where the RFCs
+ * leave a choice the server's is used:
+ *
+ *   - Only the methods in HttpMethod are known, others get 501.
+ *     A method longer than 7 bytes is not looked at any further.
+ *   - The path is visible ASCII up to a single space.
+ *   - HTTP/1.<digit> is served, any other "HTTP/..." gets 505.
+ *   - Lines end in CRLF, a CR without an LF after it is a 400.
+ *   - Field values are taken as they are, they only lose the
+ *     spaces and tabs around them.
+ *   - Content-Length can't be repeated, and values that (nearly)
+ *     overflow a size_t get 413.
+ *   - A POST needs a Content-Length (411).
+ */
+
+#define METHOD_MAX (7)
+
+static const struct {
+	const char *name;
+	HttpMethod method;
+} ref_methods[] = {
+	{ "GET",     HTTP_GET },
+	{ "PUT",     HTTP_PUT },
+	{ "POST",    HTTP_POST },
+	{ "HEAD",    HTTP_HEAD },
+	{ "DELETE",  HTTP_DELETE },
+	{ "OPTIONS", HTTP_OPTIONS },
+	{ "TRACE",   HTTP_TRACE },
+};
+
+static int is_visible(uint8_t c)
+{
+	return c >= 0x21 && c <= 0x7e;
+}
+
+static int is_digit(uint8_t c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static int is_alpha(uint8_t c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+/* token = 1*tchar */
+static int is_tchar(uint8_t c)
+{
+	if (is_alpha(c) || is_digit(c))
+		return 1;
+	return c && strchr("!#$%&'*+-.^_`|~", c) != NULL;
+}
+
+static uint8_t lower(uint8_t c)
+{
+	return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/*
+ * Find the CRLF ending the line at p[start]. Returns 0 and sets
+ * *cr if the line is complete, 1 if it isn't yet, or a status.
+ */
+static int line_end(const uint8_t *p, size_t len, size_t start, size_t *cr)
+{
+	size_t i = start;
+	while (i < len && p[i] != '\r')
+		i++;
+
+	if (i + 1 >= len)
+		return 1;
+	if (p[i + 1] != '\n')
+		return 400;
+
+	*cr = i;
+	return 0;
+}
+
+static int content_length(const uint8_t *value, size_t len, size_t *out)
+{
+	if (len == 0)
+		return 400;
+
+	size_t n = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (!is_digit(value[i]))
+			return 400;
+		if (n > (SIZE_MAX - 9) / 10)
+			return 413;
+		n = n * 10 + (value[i] - '0');
+	}
+
+	*out = n;
+	return 0;
+}
+
+void ref_parse(const uint8_t *p, size_t len, ParseResult *res)
+{
+	(void) memset(res, 0, sizeof(*res));
+
+	/* method SP */
+	size_t sp = 0;
+	while (sp < len && sp <= METHOD_MAX && p[sp] != ' ')
+		sp++;
+
+	if (sp > METHOD_MAX) {
+		res->status = 501;
+		return;
+	}
+	if (sp == len)
+		return;
+
+	for (size_t i = 0; i < sizeof(ref_methods) / sizeof(ref_methods[0]); i++) {
+		if (strlen(ref_methods[i].name) == sp && !memcmp(p, ref_methods[i].name, sp))
+			res->method = ref_methods[i].method;
+	}
+	if (res->method == HTTP_NONE) {
+		res->status = 501;
+		return;
+	}
+
+	/* request-target SP */
+	size_t path = sp + 1;
+	size_t path_end = path;
+	while (path_end < len && is_visible(p[path_end]))
+		path_end++;
+
+	if (path_end - path > UINT16_MAX) {
+		res->status = 414;
+		return;
+	}
+	if (path_end == len)
+		return;
+	if (path_end == path || p[path_end] != ' ') {
+		res->status = 400;
+		return;
+	}
+	res->path_off = path;
+	res->path_len = path_end - path;
+
+	/* HTTP-version CRLF */
+	size_t version = path_end + 1;
+	size_t cr;
+	int ret = line_end(p, len, version, &cr);
+	if (ret) {
+		res->status = (ret == 1) ? 0 : ret;
+		return;
+	}
+
+	size_t version_len = cr - version;
+	if (version_len != 8 || memcmp(p + version, "HTTP/1.", 7) || !is_digit(p[version + 7])) {
+		res->status = (version_len >= 5 && !memcmp(p + version, "HTTP/", 5)) ? 505 : 400;
+		return;
+	}
+
+	/* *( field-line CRLF ) CRLF */
+	size_t line = cr + 2;
+	int seen_length = 0;
+
+	for ( ;; ) {
+		ret = line_end(p, len, line, &cr);
+		if (ret) {
+			res->status = (ret == 1) ? 0 : ret;
+			return;
+		}
+		if (cr == line)
+			break;
+
+		/* field-name ":" OWS field-value OWS, no obs-fold */
+		size_t colon = line;
+		while (colon < cr && is_tchar(p[colon]))
+			colon++;
+		if (colon == line || colon == cr || p[colon] != ':') {
+			res->status = 400;
+			return;
+		}
+
+		size_t value = colon + 1;
+		size_t value_end = cr;
+		while (value < value_end && (p[value] == ' ' || p[value] == '\t'))
+			value++;
+		while (value_end > value && (p[value_end - 1] == ' ' || p[value_end - 1] == '\t'))
+			value_end--;
+
+		static const char name[] = "content-length";
+		int is_length = (colon - line == sizeof(name) - 1);
+		for (size_t i = 0; is_length && i < sizeof(name) - 1; i++)
+			is_length = (lower(p[line + i]) == (uint8_t) name[i]);
+
+		if (is_length) {
+			if (seen_length) {
+				res->status = 400;
+				return;
+			}
+			seen_length = 1;
+
+			if ((res->status = content_length(p + value, value_end - value, &res->content_len)))
+				return;
+		}
+
+		line = cr + 2;
+	}
+
+	if (res->method == HTTP_POST && !seen_length) {
+		res->status = 411;
+		return;
+	}
+
+	/* message-body */
+	size_t body = cr + 2;
+	if (len - body < res->content_len)
+		return;
+
+	if (res->content_len)
+		res->content_off = body;
+	res->end = body + res->content_len;
+	res->done = 1;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+ * main() for builds without libFuzzer: runs the fuzz target once on
+ * every file given, or on stdin without any (which is how AFL feeds
+ * its inputs).
+ */
+
+int LLVMFuzzerInitialize(int *, char ***);
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+static int run_file(FILE *file, const char *name)
+{
+	uint8_t *data = NULL;
+	size_t size = 0, cap = 0;
+
+	for ( ;; ) {
+		if (size == cap) {
+			cap = cap ? cap * 2 : 4096;
+			uint8_t *bigger = realloc(data, cap);
+			if (!bigger) {
+				free(data);
+				return -1;
+			}
+			data = bigger;
+		}
+
+		size_t n = fread(data + size, 1, cap - size, file);
+		if (!n)
+			break;
+		size += n;
+	}
+
+	if (ferror(file)) {
+		fprintf(stderr, "failed to read %s\n", name);
+		free(data);
+		return -1;
+	}
+
+	(void) LLVMFuzzerTestOneInput(data, size);
+	free(data);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	(void) LLVMFuzzerInitialize(&argc, &argv);
+
+	if (argc < 2)
+		return run_file(stdin, "stdin") < 0;
+
+	int ret = 0;
+	for (int i = 1; i < argc; i++) {
+		FILE *file = fopen(argv[i], "rb");
+		if (!file || run_file(file, argv[i]) < 0) {
+			fprintf(stderr, "failed to open %s\n", argv[i]);
+			ret = 1;
+		}
+		if (file)
+			fclose(file);
+	}
+	return ret;
+}
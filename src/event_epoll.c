@@ -0,0 +1,78 @@
+#include <event.h>
+
+#if WSERVER_USE_EPOLL
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+static inline uint32_t to_epoll(uint32_t interest)
+{
+	uint32_t ev = EPOLLET | EPOLLRDHUP;
+	if (interest & EVENT_READ)  ev |= EPOLLIN;
+	if (interest & EVENT_WRITE) ev |= EPOLLOUT;
+	return ev;
+}
+
+int event_create(void)
+{
+	return epoll_create1(EPOLL_CLOEXEC);
+}
+
+int event_add(int efd, int fd, uint32_t interest, void *udata)
+{
+	struct epoll_event ev = {
+		.events = to_epoll(interest),
+		.data   = { .ptr = udata }
+	};
+	return epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int event_mod(int efd, int fd, uint32_t interest, void *udata)
+{
+	/*
+	 * EPOLL_CTL_MOD re-checks readiness, so switching to write
+	 * interest on a writable socket fires straight away.
+	 */
+	struct epoll_event ev = {
+		.events = to_epoll(interest),
+		.data   = { .ptr = udata }
+	};
+	return epoll_ctl(efd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int event_del(int efd, int fd)
+{
+	return epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int event_wait(int efd, Event *events, int max_events, int timeout)
+{
+	struct epoll_event raw[max_events];
+
+	int n = epoll_wait(efd, raw, max_events, timeout);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	for (int i = 0; i < n; i++) {
+		uint32_t flags = 0;
+		if (raw[i].events & EPOLLIN)    flags |= EVENT_READ;
+		if (raw[i].events & EPOLLOUT)   flags |= EVENT_WRITE;
+		if (raw[i].events & EPOLLRDHUP) flags |= EVENT_RDHUP;
+		if (raw[i].events & EPOLLHUP)   flags |= EVENT_EOF;
+		if (raw[i].events & EPOLLERR)   flags |= EVENT_ERROR;
+
+		events[i].flags = flags;
+		events[i].udata = raw[i].data.ptr;
+	}
+
+	return n;
+}
+
+void event_destroy(int efd)
+{
+	if (efd >= 0)
+		close(efd);
+}
+
+#endif // WSERVER_USE_EPOLL
@@ -0,0 +1,92 @@
+#include <event.h>
+
+#if WSERVER_USE_KQUEUE
+
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+int event_create(void)
+{
+	return kqueue();
+}
+
+/*
+ * Both filters are always registered, interest changes only
+ * enable / disable them. That way we never have to EV_DELETE
+ * a filter that might not exist.
+ */
+static inline int event_apply(int efd, int fd, uint32_t interest, void *udata, uint16_t base)
+{
+	struct kevent changes[2];
+
+	EV_SET(&changes[0], fd, EVFILT_READ,
+		base | EV_CLEAR | ((interest & EVENT_READ)  ? EV_ENABLE : EV_DISABLE),
+		0, 0, udata);
+	EV_SET(&changes[1], fd, EVFILT_WRITE,
+		base | EV_CLEAR | ((interest & EVENT_WRITE) ? EV_ENABLE : EV_DISABLE),
+		0, 0, udata);
+
+	return kevent(efd, changes, 2, NULL, 0, NULL);
+}
+
+int event_add(int efd, int fd, uint32_t interest, void *udata)
+{
+	return event_apply(efd, fd, interest, udata, EV_ADD);
+}
+
+int event_mod(int efd, int fd, uint32_t interest, void *udata)
+{
+	/* EV_ADD on an existing filter just modifies it */
+	return event_apply(efd, fd, interest, udata, EV_ADD);
+}
+
+int event_del(int efd, int fd)
+{
+	struct kevent changes[2];
+	EV_SET(&changes[0], fd, EVFILT_READ,  EV_DELETE, 0, 0, NULL);
+	EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	return kevent(efd, changes, 2, NULL, 0, NULL);
+}
+
+int event_wait(int efd, Event *events, int max_events, int timeout)
+{
+	struct kevent raw[max_events];
+	struct timespec ts, *tsp = NULL;
+
+	if (timeout >= 0) {
+		ts.tv_sec  = timeout / 1000;
+		ts.tv_nsec = (long) (timeout % 1000) * 1000000L;
+		tsp = &ts;
+	}
+
+	int n = kevent(efd, NULL, 0, raw, max_events, tsp);
+	if (n < 0)
+		return (errno == EINTR) ? 0 : -1;
+
+	for (int i = 0; i < n; i++) {
+		uint32_t flags = 0;
+		if (raw[i].filter == EVFILT_READ)  flags |= EVENT_READ;
+		if (raw[i].filter == EVFILT_WRITE) flags |= EVENT_WRITE;
+		/* The read side ending is only the peer done sending */
+		if (raw[i].flags & EV_EOF)
+			flags |= (raw[i].filter == EVFILT_READ) ? EVENT_RDHUP : EVENT_EOF;
+		if (raw[i].flags & EV_ERROR)       flags |= EVENT_ERROR;
+
+		events[i].flags = flags;
+		events[i].udata = raw[i].udata;
+	}
+
+	return n;
+}
+
+void event_destroy(int efd)
+{
+	if (efd >= 0)
+		close(efd);
+}
+
+#endif // WSERVER_USE_KQUEUE
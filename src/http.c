@@ -1,5 +1,6 @@
 #include <http.h>
 #include <log.h>
+#include <scan.h>
 #include <config.h>
 
 #define WS_LITTLE_ENDIAN (*(uint8_t*)&(uint16_t){1})
@@ -82,132 +83,629 @@ const char *http_status_msg(int status_code)
 	return status_code_map[status_code];
 }
 
-static inline int cmp_field_str(
-	uint8_t **buf_idx,
-	uint8_t *const buf_end,
-	const uint8_t *lit
-)
+int http_response_headers(char *buf, size_t size, int status_code, size_t content_len)
 {
-	for (; *lit != '\0' && *buf_idx != buf_end; lit++, (*buf_idx)++) {
-		if (**buf_idx != *lit)
-			return 0;
+	return http_response_headers_extra(buf, size, status_code, content_len, "");
+}
+
+static int response_headers(char *buf, size_t size, int status_code, size_t content_len,
+		const char *extra, const char *connection)
+{
+	return snprintf(buf, size,
+		"HTTP/1.1 %s\r\n"
+		"Content-Length: %zu\r\n"
+		"%s"
+		"Connection: %s\r\n"
+		"Server: WServer\r\n"
+		"\r\n",
+		http_status_msg(status_code),
+		content_len,
+		extra,
+		connection
+	);
+}
+
+int http_response_headers_extra(char *buf, size_t size, int status_code, size_t content_len,
+		const char *extra)
+{
+	return response_headers(buf, size, status_code, content_len, extra, "Keep-Alive");
+}
+
+int http_response_headers_close(char *buf, size_t size, int status_code, size_t content_len,
+		const char *extra)
+{
+	return response_headers(buf, size, status_code, content_len, extra, "close");
+}
+
+static const char http_days[7][4] = {
+	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat",
+};
+
+static const char http_months[12][4] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+void http_format_date(char *buf, time_t t)
+{
+	struct tm tm;
+	(void) gmtime_r(&t, &tm);
+	(void) snprintf(buf, HTTP_DATE_LEN + 1, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+		http_days[tm.tm_wday], tm.tm_mday, http_months[tm.tm_mon],
+		(tm.tm_year + 1900) % 10000, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/*
+ * Days since 1970-01-01 of a date in the proleptic Gregorian calendar.
+ */
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+	y -= m <= 2;
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	unsigned yoe = (unsigned) (y - era * 400);
+	unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+	unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t) doe - 719468;
+}
+
+static inline int date_num(const uint8_t *p, int digits)
+{
+	int n = 0;
+	for (int i = 0; i < digits; i++) {
+		if (!isdigit(p[i]))
+			return -1;
+		n = n * 10 + (p[i] - '0');
 	}
-	if (*buf_idx == buf_end)
-		return 0;
+	return n;
+}
 
-	return 1;
+time_t http_parse_date(const uint8_t *p, uint32_t len)
+{
+	/* "Sun, 06 Nov 1994 08:49:37 GMT" */
+	if (len != HTTP_DATE_LEN || memcmp(p + 3, ", ", 2) != 0 || p[7] != ' ' || p[11] != ' ' ||
+			p[16] != ' ' || p[19] != ':' || p[22] != ':' || memcmp(p + 25, " GMT", 4) != 0)
+		return -1;
+
+	int month = -1;
+	for (int i = 0; i < 12; i++) {
+		if (memcmp(p + 8, http_months[i], 3) == 0)
+			month = i + 1;
+	}
+
+	int day = date_num(p + 5, 2), year = date_num(p + 12, 4);
+	int hour = date_num(p + 17, 2), min = date_num(p + 20, 2), sec = date_num(p + 23, 2);
+	if (month < 0 || day < 1 || day > 31 || year < 0 || hour < 0 || hour > 23 ||
+			min < 0 || min > 59 || sec < 0 || sec > 60)
+		return -1;
+
+	return (time_t) (days_from_civil(year, month, day) * 86400 + hour * 3600 + min * 60 + sec);
+}
+
+/*
+ * Unaligned loads, without the undefined behavior.
+ */
+static inline u32 load32(const uint8_t *p)
+{
+	u32 v;
+	(void) memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline u64 load64(const uint8_t *p)
+{
+	u64 v;
+	(void) memcpy(&v, p, sizeof(v));
+	return v;
 }
 
-#define EXPECT(b, e, c, s, o) \
-	do { \
-		if (*(b)++ != (c)) return (s); \
-		if ((b) == (e)) return (o); \
-	} while (0)
+/*
+ * Characters allowed in a header name (tchar in RFC 9110).
+ */
+static const uint8_t http_tchar[256] = {
+	['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+	['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+	['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+	['`'] = 1, ['|'] = 1, ['~'] = 1,
+};
+
+/*
+ * Case insensitive compare of a header name.
+ */
+static inline int field_name_eq(const uint8_t *name, uint32_t len, const char *lit, uint32_t lit_len)
+{
+	if (len != lit_len)
+		return 0;
+	for (uint32_t i = 0; i < len; i++) {
+		if (tolower(name[i]) != lit[i])
+			return 0;
+	}
+	return 1;
+}
 
 /*
  * FIELDS
  *
- * Return -1 if the buffer is incomplete
- * Return 0  if everything went smoothly / not the correct field
+ * Every handler gets the value of its field, without the
+ * surrounding whitespace.
+ *
+ * Return 0  if everything went smoothly
  * Return n  HTTP status code error
  */
 
-static inline int field_content_length(
-	HttpRequest *request,
-	uint8_t **buf_idx,
-	uint8_t *const buf_end
-)
+static int field_content_length(HttpRequest *request, const uint8_t *value, uint32_t len)
 {
-	const uint8_t lit[] = "Content-Length";
-	if (!cmp_field_str(buf_idx, buf_end, (const uint8_t *) lit))
-		return 0;
+	if (len == 0)
+		return 400;
+
+	size_t content_len = 0;
+	for (uint32_t i = 0; i < len; i++) {
+		if (!isdigit(value[i]))
+			return 400;
+		if (content_len > (SIZE_MAX - 9) / 10)
+			return 413;
+		content_len = content_len * 10 + (value[i] - '0');
+	}
 
-	EXPECT(*buf_idx, buf_end, ':', 400, -1);
-	EXPECT(*buf_idx, buf_end, ' ', 400, -1);
+	request->content_len = content_len;
+	return 0;
+}
 
-	request->content_len = 0;
-	if (isdigit(**buf_idx)) {
-		while (*buf_idx != buf_end && isdigit(**buf_idx)) {
-			request->content_len *= 10;
-			request->content_len += **buf_idx - '0';
-			(*buf_idx)++;
+/*
+ * The weight of a list element out of its parameters (everything
+ * after its name), in thousandths. 1000 if there's none, 0 means
+ * "not this one".
+ */
+static int qvalue(const uint8_t *p, const uint8_t *end)
+{
+	while ((p = memchr(p, ';', end - p))) {
+		for (p++; p < end && (*p == ' ' || *p == '\t'); p++);
+		if (end - p < 2 || tolower(p[0]) != 'q' || p[1] != '=')
+			continue;
+
+		p += 2;
+		if (p == end || (*p != '0' && *p != '1'))
+			return 1000;
+
+		int q = (*p++ - '0') * 1000;
+		if (p < end && *p == '.') {
+			for (int scale = 100; ++p < end && isdigit(*p) && scale; scale /= 10)
+				q += (*p - '0') * scale;
 		}
-	} else {
-		return 400;
+		return (q > 1000) ? 1000 : q;
 	}
+	return 1000;
+}
 
-	if (*buf_idx == buf_end) {
-		request->content_len = 0;
-		return -1;
+static uint8_t encoding_bit(const uint8_t *name, uint32_t len)
+{
+	if (field_name_eq(name, len, "gzip", 4) || field_name_eq(name, len, "x-gzip", 6))
+		return HTTP_ENCODING_BIT(HTTP_ENCODING_GZIP);
+	if (field_name_eq(name, len, "br", 2))
+		return HTTP_ENCODING_BIT(HTTP_ENCODING_BR);
+	return 0;
+}
+
+/*
+ * Accept-Encoding: a list of codings with optional weights. Only
+ * whether a coding is acceptable at all matters, the server sends
+ * whichever acceptable variant is smallest. Anything it doesn't
+ * understand is skipped, never an error.
+ */
+static int field_accept_encoding(HttpRequest *request, const uint8_t *value, uint32_t len)
+{
+	const uint8_t *end = value + len;
+	uint8_t accepted = 0, refused = 0;
+	int star = 0;
+
+	while (value < end) {
+		const uint8_t *elem_end = memchr(value, ',', end - value);
+		if (!elem_end)
+			elem_end = end;
+
+		const uint8_t *name = value;
+		for (; name < elem_end && (*name == ' ' || *name == '\t'); name++);
+		const uint8_t *name_end = name;
+		for (; name_end < elem_end && http_tchar[*name_end]; name_end++);
+
+		int zero = !qvalue(name_end, elem_end);
+		if (name_end - name == 1 && *name == '*') {
+			star = !zero;
+		} else {
+			uint8_t bit = encoding_bit(name, name_end - name);
+			if (zero)
+				refused |= bit;
+			else
+				accepted |= bit;
+		}
+
+		value = elem_end + (elem_end < end);
 	}
 
-	if (**buf_idx != '\r')
-		return 400;
+	if (star)
+		accepted |= (HTTP_ENCODING_BIT(HTTP_ENCODINGS) - 1) & ~refused;
+	request->accept_encoding |= accepted & ~refused;
 	return 0;
 }
 
-static int skip_line_end(uint8_t **buf_idx, uint8_t *const buf_end)
+#define MEDIA(name, type) \
+	{ name, sizeof(name) - 1, type }
+
+/*
+ * Media ranges of Accept that there are AcceptTypes for,
+ * names in lowercase.
+ */
+static const struct {
+	const char *name;
+	uint32_t len;
+	AcceptType type;
+} http_media[] = {
+	MEDIA("*/*",                    ACCTYPE_ALL),
+	MEDIA("text/*",                 ACCTYPE_TEXT_ALL),
+	MEDIA("text/plain",             ACCTYPE_TEXT_PLAIN),
+	MEDIA("text/html",              ACCTYPE_TEXT_HTML),
+	MEDIA("text/css",               ACCTYPE_TEXT_CSS),
+	MEDIA("text/javascript",        ACCTYPE_TEXT_JAVASCRIPT),
+	MEDIA("application/javascript", ACCTYPE_TEXT_JAVASCRIPT),
+	MEDIA("text/xml",               ACCTYPE_TEXT_XML),
+	MEDIA("application/xml",        ACCTYPE_TEXT_XML),
+	MEDIA("image/*",                ACCTYPE_IMAGE_ALL),
+	MEDIA("image/jpeg",             ACCTYPE_IMAGE_JPEG),
+	MEDIA("image/png",              ACCTYPE_IMAGE_PNG),
+};
+
+#define HTTP_MEDIA_NUM (sizeof(http_media) / sizeof(http_media[0]))
+
+/*
+ * The wildcard range a type falls under.
+ */
+static inline AcceptType accept_group(AcceptType type)
 {
-	for (; *buf_idx != buf_end && **buf_idx != '\r'; (*buf_idx)++);
+	if (type >= ACCTYPE_IMAGE_ALL)
+		return ACCTYPE_IMAGE_ALL;
+	if (type >= ACCTYPE_TEXT_ALL)
+		return ACCTYPE_TEXT_ALL;
+	return ACCTYPE_ALL;
+}
 
-	if (*buf_idx == buf_end)
-		return -1;
+/*
+ * 0 for all types, 1 for a wildcard range, 2 for one type.
+ */
+static inline int accept_specificity(AcceptType type)
+{
+	if (type == ACCTYPE_ALL)
+		return 0;
+	return (type == accept_group(type)) ? 1 : 2;
+}
 
-	if (buf_end - (*buf_idx) >= 2) {
-		if (*(u16*)(*buf_idx) != COMPOSE2('\r','\n'))
-			return 400;
+static int accept_position(const AcceptField *accept, AcceptType type)
+{
+	for (int i = 0; i < accept->types_len; i++) {
+		if (accept->types[i] == type)
+			return i;
 	}
-
-	*buf_idx += 2;
-	return 0;
+	return -1;
 }
 
-static inline int get_request_len(HttpRequest *request, uint8_t **header_end)
+int http_accept_rank(const AcceptField *accept, AcceptType type)
 {
-	HttpBuffer *buf = &request->buf;
-	uint8_t *buf_idx = buf->buf;
-	uint8_t * const buf_end = buf->buf + buf->used;
+	if (!accept->types_len && !accept->refused)
+		return 0;
 
-	if (request->content_len) {
-		for (; buf_idx != buf_end; buf_idx++) {
-			if (*buf_idx == '\r' && (buf_end - buf_idx >= 4)) {
-				if (*(u32*)buf_idx == COMPOSE4('\r','\n','\r','\n')) {
-					*header_end = buf_idx + 4;
-					return 0;
-				}
+	/* The most specific range there is decides, a refusal too */
+	const AcceptType ranges[3] = { type, accept_group(type), ACCTYPE_ALL };
+	for (int i = 0; i < 3; i++) {
+		if (accept->refused & (1u << ranges[i]))
+			return -1;
+
+		int pos = accept_position(accept, ranges[i]);
+		if (pos >= 0)
+			return pos;
+	}
+	return -1;
+}
+
+/*
+ * Accept: media ranges with optional weights, sorted into
+ * precedence (by weight, then the more specific one first).
+ * Types the server has nothing of are skipped, never an error,
+ * and so are parameters other than the weight.
+ */
+static int field_accept(HttpRequest *request, const uint8_t *value, uint32_t len)
+{
+	AcceptField *accept = &request->accept_field;
+	const uint8_t *end = value + len;
+	int weights[NUM_ACCEPT_TYPES];
+
+	accept->types_len = 0;
+	accept->refused = 0;
+
+	while (value < end) {
+		const uint8_t *elem_end = memchr(value, ',', end - value);
+		if (!elem_end)
+			elem_end = end;
+
+		const uint8_t *name = value;
+		for (; name < elem_end && (*name == ' ' || *name == '\t'); name++);
+		const uint8_t *name_end = name;
+		for (; name_end < elem_end && (http_tchar[*name_end] || *name_end == '/'); name_end++);
+		value = elem_end + (elem_end < end);
+
+		AcceptType type = ACCTYPE_LAST;
+		for (size_t i = 0; i < HTTP_MEDIA_NUM; i++) {
+			if (field_name_eq(name, name_end - name, http_media[i].name, http_media[i].len)) {
+				type = http_media[i].type;
+				break;
 			}
 		}
-		if (buf_idx == buf_end)
-			return -1;
+
+		/* The first time a type is listed counts */
+		if (type == ACCTYPE_LAST || (accept->refused & (1u << type)) || accept_position(accept, type) >= 0)
+			continue;
+
+		int weight = qvalue(name_end, elem_end);
+		if (!weight) {
+			accept->refused |= 1u << type;
+			continue;
+		}
+
+		int i = accept->types_len++;
+		for (; i > 0 && (weights[i - 1] < weight || (weights[i - 1] == weight &&
+				accept_specificity(accept->types[i - 1]) < accept_specificity(type))); i--) {
+			accept->types[i] = accept->types[i - 1];
+			weights[i] = weights[i - 1];
+		}
+		accept->types[i] = type;
+		weights[i] = weight;
+	}
+
+	return 0;
+}
+
+/*
+ * If-None-Match is only compared once the resource is known,
+ * see resource_not_modified().
+ */
+static int field_if_none_match(HttpRequest *request, const uint8_t *value, uint32_t len)
+{
+	request->parser.if_none_match_off = value - request->buf.buf;
+	request->if_none_match_len = len;
+	return 0;
+}
+
+/*
+ * A date that can't be read is ignored, like the RFC says.
+ */
+static int field_if_modified_since(HttpRequest *request, const uint8_t *value, uint32_t len)
+{
+	time_t t = http_parse_date(value, len);
+	request->if_modified_since = (t > 0) ? t : 0;
+	return 0;
+}
+
+/*
+ * The digits of a range position, as many as there are. Numbers
+ * too big for 64 bits stick at UINT64_MAX, no file is that long.
+ *
+ * Returns how many digits there were.
+ */
+static uint32_t range_pos(const uint8_t **p, const uint8_t *end, uint64_t *pos)
+{
+	const uint8_t *start = *p;
+	uint64_t n = 0;
+
+	for (; *p < end && isdigit(**p); (*p)++) {
+		uint64_t digit = **p - '0';
+		n = (n > (UINT64_MAX - digit) / 10) ? UINT64_MAX : n * 10 + digit;
 	}
 
-	/* Skip the request line */
-	int ret;
-	if ((ret = skip_line_end(&buf_idx, buf_end)))
-		return ret;
+	*pos = n;
+	return *p - start;
+}
+
+/*
+ * Range: "bytes=" and a list of first-last, first- or -suffix.
+ * Whether they can be satisfied is only known once the resource
+ * is, see resource_ranges(). Other units, too many ranges or any
+ * range that doesn't make sense get the whole field ignored (and
+ * the full response sent), like the RFC says.
+ */
+static int field_range(HttpRequest *request, const uint8_t *value, uint32_t len)
+{
+	const uint8_t *end = value + len;
+	uint8_t n = 0;
 
-	for (;;) {
-		if ((ret = field_content_length(request, &buf_idx, buf_end)))
-			return ret;
+	request->ranges_len = 0;
+	if (len < 6 || !field_name_eq(value, 6, "bytes=", 6))
+		return 0;
 
-		if ((ret = skip_line_end(&buf_idx, buf_end)))
-			return ret;
+	for (value += 6; value < end; ) {
+		const uint8_t *elem_end = memchr(value, ',', end - value);
+		if (!elem_end)
+			elem_end = end;
+
+		const uint8_t *p = value;
+		const uint8_t *spec_end = elem_end;
+		for (; p < spec_end && (*p == ' ' || *p == '\t'); p++);
+		for (; spec_end > p && (spec_end[-1] == ' ' || spec_end[-1] == '\t'); spec_end--);
+		value = elem_end + (elem_end < end);
+
+		/* Empty list elements are allowed */
+		if (p == spec_end)
+			continue;
+		if (n == HTTP_MAX_RANGES)
+			return 0;
 
-		if (buf_end - buf_idx >= 2) {
-			if (*(u16*)buf_idx == COMPOSE2('\r','\n')) {
-				*header_end = buf_idx + 2;
-				break;
-			}
+		HttpRange *range = &request->ranges[n];
+		if (*p == '-') {
+			p++;
+			range->suffix = 1;
+			if (!range_pos(&p, spec_end, &range->last))
+				return 0;
+		} else {
+			range->suffix = 0;
+			if (!range_pos(&p, spec_end, &range->first) || p == spec_end || *p++ != '-')
+				return 0;
+			if (!range_pos(&p, spec_end, &range->last))
+				range->last = UINT64_MAX;
+			else if (range->last < range->first)
+				return 0;
 		}
+
+		if (p != spec_end)
+			return 0;
+		n++;
+	}
+
+	request->ranges_len = n;
+	return 0;
+}
+
+/*
+ * If-Range is only compared once the resource is known,
+ * see resource_ranges().
+ */
+static int field_if_range(HttpRequest *request, const uint8_t *value, uint32_t len)
+{
+	request->parser.if_range_off = value - request->buf.buf;
+	request->if_range_len = len;
+	return 0;
+}
+
+#define FIELD(name, seen, handler) \
+	{ name, sizeof(name) - 1, seen, handler }
+
+/*
+ * Every field the parser cares about, names in lowercase.
+ */
+static const struct http_field {
+	const char *name;
+	uint32_t name_len;
+	uint32_t seen;
+	int (*handler)(HttpRequest *, const uint8_t *, uint32_t);
+} http_fields[] = {
+	FIELD("content-length", HTTP_SEEN_CONTENT_LENGTH, field_content_length),
+	FIELD("accept", 0, field_accept),
+	FIELD("accept-encoding", 0, field_accept_encoding),
+	FIELD("if-none-match", 0, field_if_none_match),
+	FIELD("if-modified-since", 0, field_if_modified_since),
+	FIELD("range", 0, field_range),
+	FIELD("if-range", 0, field_if_range),
+};
+
+#define HTTP_FIELD_NUM (sizeof(http_fields) / sizeof(struct http_field))
+
+/*
+ * Parse one complete header line (without the CRLF).
+ */
+static int parse_field(HttpRequest *request, const uint8_t *line, const uint8_t *line_end)
+{
+	/* Obsolete line folding, we don't do that */
+	if (*line == ' ' || *line == '\t')
+		return 400;
+
+	const uint8_t *colon = memchr(line, ':', line_end - line);
+	if (!colon || colon == line)
+		return 400;
+
+	/* Whitespace before the colon too, "Name : value" has to be rejected */
+	for (const uint8_t *c = line; c != colon; c++) {
+		if (!http_tchar[*c])
+			return 400;
+	}
+
+	const uint8_t *value = colon + 1;
+	const uint8_t *value_end = line_end;
+	for (; value != value_end && (*value == ' ' || *value == '\t'); value++);
+	for (; value_end != value && (value_end[-1] == ' ' || value_end[-1] == '\t'); value_end--);
+
+	uint32_t name_len = colon - line;
+	for (size_t i = 0; i < HTTP_FIELD_NUM; i++) {
+		const struct http_field *field = &http_fields[i];
+		if (!field_name_eq(line, name_len, field->name, field->name_len))
+			continue;
+
+		if (request->parser.seen & field->seen)
+			return 400;
+		request->parser.seen |= field->seen;
+
+		return field->handler(request, value, value_end - value);
 	}
 
 	return 0;
 }
 
+/*
+ * Parse the method, bytes [p, p + len] are valid (the
+ * method plus the space after it).
+ */
+static inline HttpMethod parse_method(const uint8_t *p, uint32_t len)
+{
+	switch (len) {
+		case 3:
+			switch (load32(p)) {
+				case COMPOSE4('G','E','T',' '): return HTTP_GET;
+				case COMPOSE4('P','U','T',' '): return HTTP_PUT;
+			}
+			break;
+		case 4:
+			switch (load32(p)) {
+				case COMPOSE4('P','O','S','T'): return HTTP_POST;
+				case COMPOSE4('H','E','A','D'): return HTTP_HEAD;
+			}
+			break;
+		case 5:
+			if (memcmp(p, "TRACE", 5) == 0)
+				return HTTP_TRACE;
+			break;
+		case 6:
+			if (memcmp(p, "DELETE", 6) == 0)
+				return HTTP_DELETE;
+			break;
+		case 7:
+			if (load64(p) == COMPOSE8('O','P','T','I','O','N','S',' '))
+				return HTTP_OPTIONS;
+			break;
+	}
+
+	return HTTP_NONE;
+}
+
+/*
+ * Find the end of the line starting at parser->off, resuming the
+ * scan where the last call stopped. Returns NULL if the line isn't
+ * complete yet, or sets *status if it's malformed.
+ */
+static inline const uint8_t *find_line_end(HttpRequest *request, int *status)
+{
+	HttpBuffer *buf = &request->buf;
+	HttpParser *parser = &request->parser;
+	const uint8_t *buf_end = buf->buf + buf->used;
+
+	uint32_t from = (parser->scan > parser->off) ? parser->scan : parser->off;
+	const uint8_t *cr = scan_cr(buf->buf + from, buf_end);
+
+	if (cr == buf_end || cr + 1 == buf_end) {
+		/* Rescan a trailing '\r' next time, to check its '\n' */
+		parser->scan = cr - buf->buf;
+		return NULL;
+	}
+
+	if (cr[1] != '\n') {
+		*status = 400;
+		return NULL;
+	}
+
+	return cr;
+}
+
 /*
  * This function checks if the request is finished. While it is
  * checking this, it also parses the request.
  *
+ * The parser is resumable: it picks up exactly where the last call
+ * stopped (request->parser), so every byte is only looked at once
+ * no matter how many pieces the request arrives in.
+ *
  * Returns 0 if the request is valid.
  * Returns an HTTP status code if it's not valid.
  *
@@ -219,118 +717,175 @@ int http_check_done(HttpRequest *request)
 		return 500;
 
 	HttpBuffer *buf = &request->buf;
-	uint8_t *buf_idx = buf->buf;
+	HttpParser *parser = &request->parser;
+	int status = 0;
+
+	/* Idle connections don't hold a buffer */
+	if (!buf->buf)
+		return 0;
+
 	uint8_t * const buf_end = buf->buf + buf->used;
 
-	if (request->method == HTTP_NONE) {
-		if (buf->used > 4) {
-			switch (*(u32 *) buf_idx) {
-				case COMPOSE4('G','E','T',' '):
-					request->method = HTTP_GET; buf_idx += 3; break;
-				case COMPOSE4('P','U','T',' '):
-					request->method = HTTP_PUT; buf_idx += 3; break;
-				case COMPOSE4('P','O','S','T'):
-					request->method = HTTP_POST; buf_idx += 4; break;
-				case COMPOSE4('H','E','A','D'):
-					request->method = HTTP_HEAD; buf_idx += 4; break;
-				case COMPOSE4('D','E','L','E'):
-					if (*(u16 *) (buf_idx + 4) == COMPOSE2('T','E')) {
-						request->method = HTTP_DELETE;
-						buf_idx += 6;
-						break;
-					} else {
-						return 400;
-					}
-				case COMPOSE4('T','R','A','C'):
-					if (*(buf_idx + 4) == 'E') {
-						request->method = HTTP_TRACE;
-						buf_idx += 5;
-						break;
-					} else {
-						return 400;
-					}
-				default:
-					if (*(u64 *) buf_idx ==
-						COMPOSE8('O','P','T','I','O','N','S',' ')) {
-						request->method = HTTP_OPTIONS;
-						buf_idx += 7;
-						break;
-					} else {
-						return 400;
-					}
+	for ( ;; ) {
+		uint8_t *buf_idx = buf->buf + parser->off;
+
+		switch (parser->state) {
+			case HTTP_PARSE_METHOD: {
+				/* The longest method is 7 bytes */
+				uint32_t avail = buf_end - buf_idx;
+				const uint8_t *sp = memchr(buf_idx, ' ', (avail < 8) ? avail : 8);
+				if (!sp) {
+					if (avail < 8)
+						goto request_not_finished;
+					return 501;
+				}
+
+				request->method = parse_method(buf_idx, sp - buf_idx);
+				if (request->method == HTTP_NONE)
+					return 501;
 
+				parser->off += (sp - buf_idx) + 1;
+				parser->state = HTTP_PARSE_PATH;
+				break;
 			}
-		} else {
-			goto request_not_finished;
-		}
-	}
 
-	if (!request->path || request->path_len == 0) {
-		if (*buf_idx++ != ' ')
-			return 400;
+			case HTTP_PARSE_PATH: {
+				uint32_t from = (parser->scan > parser->off) ? parser->scan : parser->off;
+				uint8_t *path_end = (uint8_t *) scan_token(buf->buf + from, buf_end);
 
-		request->path = buf_idx;
-		for (; (*buf_idx > 32 && *buf_idx < 127)
-				&& (buf_idx != buf_end); buf_idx++, request->path_len++);
+				if (path_end - buf_idx > UINT16_MAX)
+					return 414;
+				if (path_end == buf_end) {
+					parser->scan = path_end - buf->buf;
+					goto request_not_finished;
+				}
+				if (path_end == buf_idx || *path_end != ' ')
+					return 400;
 
-		if (buf_idx == buf_end)
-			goto request_not_finished;
+				parser->path_off = parser->off;
+				request->path_len = path_end - buf_idx;
 
-		if (!(*buf_idx > 32 || *buf_idx < 127))
-			return 400;
+				parser->off += request->path_len + 1;
+				parser->state = HTTP_PARSE_VERSION;
+				break;
+			}
 
-		if (*buf_idx++ != ' ')
-			return 400;
-	}
+			case HTTP_PARSE_VERSION: {
+				const uint8_t *line_end = find_line_end(request, &status);
+				if (!line_end)
+					goto line_not_finished;
 
-	uint8_t *header_end = NULL;
-	int ret;
-	switch ((ret = get_request_len(request, &header_end))) {
-		case 0: break;
-		case -1: goto request_not_finished;
-		default:
-			return ret;
-	}
+				uint32_t len = line_end - buf_idx;
+				if (len != 8 || memcmp(buf_idx, "HTTP/1.", 7) != 0 || !isdigit(buf_idx[7]))
+					return (len >= 5 && memcmp(buf_idx, "HTTP/", 5) == 0) ? 505 : 400;
 
-	/*
-	 * If the request uses a GET method, it's simple: just check for
-	 * two consecutive CRLFs.
-	 *
-	 * However, if it's a POST (or some method that has a body), then
-	 * check for the Content-Length.
-	 */
-
-	int request_is_done = 0;
-	if (request->method == HTTP_GET) {
-		if (header_end)
-			request_is_done = 1;
-	}
+				parser->off += len + 2;
+				parser->state = HTTP_PARSE_HEADERS;
+				break;
+			}
 
-	request->content = header_end;
+			case HTTP_PARSE_HEADERS: {
+				const uint8_t *line_end = find_line_end(request, &status);
+				if (!line_end)
+					goto line_not_finished;
 
-	if (request->method == HTTP_POST) {
-		if (request->content_len) {
-			size_t actual_len = ((size_t) buf_end) - ((size_t) request->content);
-			request_is_done = 1;
-			if (actual_len < request->content_len)
-				goto request_not_finished;
-			else if (request->content_len > actual_len)
-				return 400;
-		} else {
-			/* The client doesn't tell us how long the body is */
-			return 411;
+				/* An empty line ends the headers */
+				if (line_end == buf_idx) {
+					parser->off += 2;
+
+					if (request->method == HTTP_POST &&
+						!(parser->seen & HTTP_SEEN_CONTENT_LENGTH)) {
+						/* The client doesn't tell us how long the body is */
+						return 411;
+					}
+
+					parser->state = request->content_len ? HTTP_PARSE_BODY : HTTP_PARSE_DONE;
+					break;
+				}
+
+				if ((status = parse_field(request, buf_idx, line_end)))
+					return status;
+
+				parser->off += (line_end - buf_idx) + 2;
+				break;
+			}
+
+			case HTTP_PARSE_BODY:
+				if ((size_t) (buf_end - buf_idx) < request->content_len)
+					goto request_not_finished;
+
+				parser->content_off = parser->off;
+				parser->off += request->content_len;
+				parser->state = HTTP_PARSE_DONE;
+				break;
+
+			case HTTP_PARSE_DONE:
+				/*
+				 * The buffer may have moved while reading,
+				 * so the pointers are only made at the end.
+				 */
+				request->path = buf->buf + parser->path_off;
+				if (request->content_len)
+					request->content = buf->buf + parser->content_off;
+				if (request->if_none_match_len)
+					request->if_none_match = buf->buf + parser->if_none_match_off;
+				if (request->if_range_len)
+					request->if_range = buf->buf + parser->if_range_off;
+
+				buf->progress = 1;
+				return 0;
 		}
 	}
 
-	/* Do other methods later, just want to get this working. */
-
-	request->buf.progress = request_is_done;
-	return 0;
+line_not_finished:
+	if (status)
+		return status;
 
 request_not_finished:
-	if (!buf->progress)
-		return 400;
-	else
-		buf->progress = 0;
+	/* The buffer is full and the request still isn't complete */
+	if (buf->progress)
+		return 413;
 	return 0;
 }
+
+void http_next_req(HttpRequest *request)
+{
+	HttpBuffer buf = request->buf;
+	uint32_t start = request->parser.off;
+
+	(void) memset(request, 0, sizeof(HttpRequest));
+	request->buf.buf  = buf.buf;
+	request->buf.size = buf.size;
+
+	/* Nothing left over, start at the front again */
+	if (start >= buf.used)
+		return;
+
+	request->buf.used     = buf.used;
+	request->parser.start = start;
+	request->parser.off   = start;
+	request->parser.scan  = start;
+}
+
+#define SHIFT_OFF(o, shift) ((o) = ((o) >= (shift)) ? (o) - (shift) : 0)
+
+void http_compact_req(HttpRequest *request)
+{
+	HttpBuffer *buf = &request->buf;
+	HttpParser *parser = &request->parser;
+	uint32_t shift = parser->start;
+
+	if (shift == 0)
+		return;
+
+	(void) memmove(buf->buf, buf->buf + shift, buf->used - shift);
+	buf->used -= shift;
+
+	SHIFT_OFF(parser->start, shift);
+	SHIFT_OFF(parser->off, shift);
+	SHIFT_OFF(parser->scan, shift);
+	SHIFT_OFF(parser->path_off, shift);
+	SHIFT_OFF(parser->content_off, shift);
+	SHIFT_OFF(parser->if_none_match_off, shift);
+	SHIFT_OFF(parser->if_range_off, shift);
+}
@@ -1,20 +1,106 @@
 #ifndef _CONFIG_HEADER_GUARD
 #define _CONFIG_HEADER_GUARD
 
+/*
+ * Defaults for the runtime settings (see settings.h), every one
+ * of them can be changed from a config file or the command line
+ * without a rebuild, unless they say compile-time.
+ */
+
 /*** The port the server will listen on ***/
-#define WSERVER_PORT     "8080"
+#define WSERVER_PORT     (8080)
 
 /*** The max amount of pending connections ***/
-#define WSERVER_MAX_CON  (500)
+#define WSERVER_BACKLOG  (511)
+
+/*** The max amount of connections a worker keeps open. Past ***/
+/*** that it answers new ones with a 503 and closes them, or  ***/
+/*** stops accepting with WSERVER_PAUSE_ACCEPT. 0 for no limit. ***/
+#define WSERVER_MAX_CONNECTIONS (10000)
+
+/*** Set to 1 to leave connections in the backlog instead of ***/
+/*** answering 503 once a worker is at its limit.             ***/
+#define WSERVER_PAUSE_ACCEPT (0)
 
-/*** The max amount of buffer the server will allocate for a    ***/
-/*** request (in kilobytes). If undefined, infinite (dangerous) ***/
+/*** Events taken from the kernel at once (compile-time) ***/
+#define WSERVER_MAX_EVENTS (256)
+
+/*** The size of the receive buffer (in kilobytes) a connection ***/
+/*** borrows while it has unanswered bytes. A request (with its  ***/
+/*** body) has to fit in it.                                      ***/
 #define WSERVER_MAX_BUF  (10)
 
-/*** Set to one to enable logging, 0 to disable it. ***/
+/*** Seconds a client gets to send the headers of a request,  ***/
+/*** however slowly they trickle in. Also counts for the first ***/
+/*** request of a new connection. 0 waits forever.            ***/
+#define WSERVER_HEADER_TIMEOUT (10)
+
+/*** Seconds an idle connection is kept open for its next ***/
+/*** request. 0 waits forever.                             ***/
+#define WSERVER_KEEPALIVE_TIMEOUT (15)
+
+/*** Seconds a request body or a response can go without a ***/
+/*** single byte moving. 0 waits forever.                   ***/
+#define WSERVER_IDLE_TIMEOUT (30)
+
+/*** Resolution of the timeouts above, in milliseconds (compile-time) ***/
+#define WSERVER_TIMER_TICK_MS (100)
+
+/*** The document root, request paths are relative to it ***/
+#define WSERVER_ROOT "."
+
+/*** Files up to this size (in kilobytes) are kept in memory, ***/
+/*** along with their response headers. Bigger are streamed.   ***/
+#define WSERVER_CACHE_MAX_FILE (64)
+
+/*** The max amount of memory (in kilobytes) used for cached files ***/
+#define WSERVER_CACHE_MAX_SIZE (64 * 1024)
+
+/*** Set to 1 to gzip / brotli text files that don't have a ***/
+/*** .gz / .br file next to them, once when they're loaded.   ***/
+/*** Needs zlib / libbrotlienc at build time.                  ***/
+#define WSERVER_COMPRESS (1)
+
+/*** The max amount of memory (in kilobytes) used for files ***/
+/*** compressed by the server                                ***/
+#define WSERVER_COMPRESS_MAX_SIZE (16 * 1024)
+
+/*** How hard to compress, gzip 1-9 and brotli 0-11 (compile-time) ***/
+#define WSERVER_GZIP_LEVEL     (6)
+#define WSERVER_BROTLI_QUALITY (6)
+
+/*** Set to 1 to pick up changes to the document root while ***/
+/*** running (only on Linux, through inotify).               ***/
+#define WSERVER_LIVE_RELOAD (1)
+
+/*** The amount of worker threads (one event loop each). ***/
+/*** Set to 0 to start one per online CPU.                ***/
+#define WSERVER_WORKERS (0)
+
+/*** The I/O backend: "uring" (Linux io_uring), the native  ***/
+/*** event system ("epoll" / "kqueue"), or "auto" to use     ***/
+/*** io_uring when the kernel supports it.                   ***/
+#define WSERVER_BACKEND "auto"
+
+/*** Set to 1 to pin every worker thread to its own CPU ***/
+#define WSERVER_PIN_WORKERS (1)
+
+/*** Set to one to compile logging in, 0 to leave it out. ***/
 #define WSERVER_ENABLE_LOG (1)
 
 /*** Log file WServer will output to. Leave undefined for stdout ***/
 //#define WSERVER_LOG_FILE "test.log"
 
+/*** Access log written to the log file, one line per response: ***/
+/*** "off", "clf" (Common Log Format plus the parse time and    ***/
+/*** the time to the last byte in microseconds) or "json".       ***/
+#define WSERVER_ACCESS_LOG "off"
+
+/*** Set to 1 to serve counters and latency histograms of every ***/
+/*** worker at WSERVER_METRICS_PATH, in the Prometheus format.   ***/
+#define WSERVER_METRICS (0)
+
+/*** Where the metrics are served (compile-time) ***/
+#define WSERVER_METRICS_PATH "/__metrics"
+
 #endif // _CONFIG_HEADER_GUARD
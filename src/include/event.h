@@ -0,0 +1,82 @@
+#ifndef _EVENT_HEADER_GUARD
+#define _EVENT_HEADER_GUARD
+
+#include <stdint.h>
+
+#if defined(__FreeBSD__) || defined(__NetBSD__) || \
+	defined(__OpenBSD__) || defined(__DragonFly__) || \
+	(defined(__APPLE__) && defined(__MACH__))
+
+#define WSERVER_USE_KQUEUE (1)
+
+#elif defined(__linux__)
+
+#define WSERVER_USE_EPOLL  (1)
+
+#else
+
+#error "WServer currently only supports the KQUEUE and EPOLL event systems."
+
+#endif
+
+/*
+ * Interest flags, passed to event_add() and event_mod().
+ */
+#define EVENT_READ  (1u << 0)
+#define EVENT_WRITE (1u << 1)
+
+/*
+ * Extra readiness flags, only ever reported by event_wait().
+ * EVENT_RDHUP is the peer done sending (it may still read),
+ * EVENT_EOF the connection hung up both ways.
+ */
+#define EVENT_EOF   (1u << 2)
+#define EVENT_ERROR (1u << 3)
+#define EVENT_RDHUP (1u << 4)
+
+typedef struct {
+	/* EVENT_* flags that are ready */
+	uint32_t flags;
+
+	/* Whatever was passed to event_add() / event_mod() */
+	void *udata;
+} Event;
+
+/*
+ * Create an event queue.
+ * Returns the event file descriptor, or -1 on failure.
+ */
+int event_create(void);
+
+/*
+ * Start watching a file descriptor for the given interest.
+ *
+ * Readiness is edge-triggered where the backend supports it,
+ * so the caller has to read / write until EAGAIN.
+ */
+int event_add(int, int, uint32_t, void *);
+
+/*
+ * Change the interest of an already watched file descriptor.
+ */
+int event_mod(int, int, uint32_t, void *);
+
+/*
+ * Stop watching a file descriptor.
+ */
+int event_del(int, int);
+
+/*
+ * Wait for a batch of events.
+ * A negative timeout (in milliseconds) waits forever.
+ *
+ * Returns the amount of events, or -1 on failure.
+ */
+int event_wait(int, Event *, int, int);
+
+/*
+ * Destroy an event queue.
+ */
+void event_destroy(int);
+
+#endif // _EVENT_HEADER_GUARD
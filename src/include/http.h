@@ -2,9 +2,11 @@
 #define _HTTP_HEADER_GUARD
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <time.h>
 
 typedef enum {
 	HTTP_NONE,
@@ -17,6 +19,11 @@ typedef enum {
 	HTTP_TRACE,
 } HttpMethod;
 
+/*
+ * The memory behind buf belongs to whoever reads into it
+ * (the server takes it from a pool), the parser never
+ * allocates or frees it.
+ */
 typedef struct {
 	uint8_t *buf;
 	uint32_t used;
@@ -34,6 +41,8 @@ typedef struct {
  * (what is the goal of this project?)
  */
 typedef enum {
+	ACCTYPE_ALL,
+
 	ACCTYPE_TEXT_ALL,
 	ACCTYPE_TEXT_PLAIN,
 	ACCTYPE_TEXT_HTML,
@@ -41,21 +50,99 @@ typedef enum {
 	ACCTYPE_TEXT_JAVASCRIPT,
 	ACCTYPE_TEXT_XML,
 
+	ACCTYPE_IMAGE_ALL,
 	ACCTYPE_IMAGE_JPEG,
 	ACCTYPE_IMAGE_PNG,
 	ACCTYPE_LAST,
 } AcceptType;
-#define NUM_ACCEPT_TYPES (ACCTYPE_LAST - 1)
-
+#define NUM_ACCEPT_TYPES (ACCTYPE_LAST)
 
+/*
+ * The Accept field: the types the client listed (the _ALL ones
+ * being the wildcard ranges), best first. Types it refused (q=0)
+ * aren't in there, they have their bit set instead.
+ * Without an Accept field (types_len 0) everything is acceptable.
+ */
 typedef struct {
 	AcceptType types[NUM_ACCEPT_TYPES]; // in order of precedence
 	uint8_t types_len;
+	uint16_t refused;
 } AcceptField;
 
+/*
+ * Content codings of a response. Identity (no coding) is always
+ * acceptable, the others only if the client says so.
+ */
+typedef enum {
+	HTTP_ENCODING_IDENTITY,
+	HTTP_ENCODING_GZIP,
+	HTTP_ENCODING_BR,
+	HTTP_ENCODINGS,
+} HttpEncoding;
+
+#define HTTP_ENCODING_BIT(e) (1u << (e))
+
+/*
+ * The most byte ranges of one Range field that are served, a request
+ * asking for more of them gets the whole thing instead.
+ */
+#define HTTP_MAX_RANGES (6)
+
+/*
+ * A range of bytes, last included. In a Range field as it came
+ * in, last is UINT64_MAX for "first-", and a suffix range ("-n",
+ * the last n bytes) has n in last.
+ */
+typedef struct {
+	uint64_t first;
+	uint64_t last;
+	uint8_t suffix;
+} HttpRange;
+
+typedef enum {
+	HTTP_PARSE_METHOD,
+	HTTP_PARSE_PATH,
+	HTTP_PARSE_VERSION,
+	HTTP_PARSE_HEADERS,
+	HTTP_PARSE_BODY,
+	HTTP_PARSE_DONE,
+} HttpParseState;
+
+/*
+ * Header fields the parser has already seen.
+ */
+#define HTTP_SEEN_CONTENT_LENGTH (1u << 0)
+
+/*
+ * State of the parser, so every call to http_check_done()
+ * resumes exactly where the last one stopped.
+ * Positions are offsets, since the buffer can move.
+ */
+typedef struct {
+	HttpParseState state;
+
+	/* Start of the request being parsed */
+	uint32_t start;
+
+	/* Start of the part that's being parsed right now */
+	uint32_t off;
+
+	/* How far the current line / path was already scanned */
+	uint32_t scan;
+
+	/* HTTP_SEEN_* flags */
+	uint32_t seen;
+
+	uint32_t path_off;
+	uint32_t content_off;
+	uint32_t if_none_match_off;
+	uint32_t if_range_off;
+} HttpParser;
+
 typedef struct {
 	HttpMethod method;
 	HttpBuffer buf;
+	HttpParser parser;
 
 	/*
 	 * Important! These buffers won't be valid anymore
@@ -66,10 +153,28 @@ typedef struct {
 	size_t content_len;
 
 	uint8_t *path;
-	uint8_t path_len;
+	uint16_t path_len;
 
 	AcceptField accept_field;
 
+	/* HTTP_ENCODING_BIT()s of the codings in Accept-Encoding */
+	uint8_t accept_encoding;
+
+	/* If-None-Match as it came in (the last one counts), NULL if there's none */
+	uint8_t *if_none_match;
+	uint32_t if_none_match_len;
+
+	/* If-Modified-Since, 0 if there's none or it isn't a date we know */
+	time_t if_modified_since;
+
+	/* The byte ranges of a Range field, none if there's none or it's ignored */
+	HttpRange ranges[HTTP_MAX_RANGES];
+	uint8_t ranges_len;
+
+	/* If-Range as it came in, NULL if there's none */
+	uint8_t *if_range;
+	uint32_t if_range_len;
+
 	/*
 	 * If an error was detected while parsing the HTTP
 	 * request, this will hold the recommended status
@@ -84,6 +189,49 @@ typedef struct {
  */
 const char *http_status_msg(int);
 
+/*
+ * Write the status line and headers of a response with the
+ * given status code and content length into a buffer.
+ *
+ * Returns the length of the headers (like snprintf()).
+ */
+int http_response_headers(char *, size_t, int, size_t);
+
+/*
+ * The same, with extra header lines (each ending in CRLF)
+ * after the Content-Length.
+ */
+int http_response_headers_extra(char *, size_t, int, size_t, const char *);
+
+/*
+ * The same again, for the last response on a connection
+ * (Connection: close instead of Keep-Alive).
+ */
+int http_response_headers_close(char *, size_t, int, size_t, const char *);
+
+/*
+ * How much a client wants a type: the position of the most specific
+ * entry of its Accept field that matches, so lower is better.
+ *
+ * Returns -1 if the type isn't acceptable.
+ */
+int http_accept_rank(const AcceptField *, AcceptType);
+
+/*
+ * Write a time as an HTTP-date ("Sun, 06 Nov 1994 08:49:37 GMT"),
+ * the buffer needs HTTP_DATE_LEN + 1 bytes.
+ */
+#define HTTP_DATE_LEN (29)
+void http_format_date(char *, time_t);
+
+/*
+ * Read an HTTP-date, only in the format http_format_date() writes
+ * (IMF-fixdate, what every client sends nowadays).
+ *
+ * Returns -1 if it isn't one.
+ */
+time_t http_parse_date(const uint8_t *, uint32_t);
+
 /*
  * This function checks if the request is finished. While it is
  * checking this, it also parses the request.
@@ -96,29 +244,16 @@ const char *http_status_msg(int);
 int http_check_done(HttpRequest *);
 
 /*
- * Allocates an HttpRequest.
+ * Moves on to the next request on the same connection.
+ * Bytes of a pipelined request that already came in are kept,
+ * parsing resumes right after the finished request.
  */
-#define http_alloc_req() calloc(1, sizeof(HttpRequest))
-
-/*
- * Resets an HttpRequest:
- * deletes the buffer,
- * initializes to zero.
- */
-
-#define http_reset_req(request) \
-	do { \
-		if (!(request)) return; \
-		if ((request)->buf.buf) { \
-			free((request)->buf.buf); \
-			(request)->buf.buf = NULL; \
-		} \
-		(void) memset((request), 0, sizeof(HttpRequest)); \
-	} while (0)
+void http_next_req(HttpRequest *);
 
 /*
- * Frees a request.
+ * Drops the finished requests from the front of the buffer,
+ * making room to read more.
  */
-#define http_free_req(request) free((request))
+void http_compact_req(HttpRequest *);
 
 #endif // _HTTP_HEADER_GUARD
@@ -0,0 +1,16 @@
+#ifndef _IO_HEADER_GUARD
+#define _IO_HEADER_GUARD
+
+#include <sys/types.h>
+
+/*
+ * Send part of a file over a socket without copying it
+ * through userspace (sendfile() where the system has one).
+ *
+ * Sends at most len bytes starting at offset off.
+ * Returns the amount of bytes sent, or -1 with errno set.
+ * EAGAIN means nothing could be sent right now.
+ */
+ssize_t io_sendfile(int, int, off_t, size_t);
+
+#endif // _IO_HEADER_GUARD
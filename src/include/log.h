@@ -1,13 +1,26 @@
 #ifndef _LOG_HEADER_GUARD
 #define _LOG_HEADER_GUARD
 
-#define DEFAULT_LOG_FHANDLE stdout
+#include <stdint.h>
+
+/* stdout */
+#define DEFAULT_LOG_FD (1)
+
+/* Longer request paths are cut off in the access log */
+#define ACCESS_PATH_MAX (256)
 
 /*
- * Initialize the logging system.
- * This is based upon the WSERVER_LOG_FILE macro in config.h
+ * Initialize the logging system and start its writer thread.
+ * This is based upon the log, log-file and access-log settings.
+ *
+ * Logging is asynchronous: the functions below only put a record
+ * into a ring of the calling thread and never block. The writer
+ * writes the records out in batches, records of one thread stay
+ * in order. A message longer than 2 KiB is cut off.
+ *
+ * Returns -1 if the access log format is unknown.
  */
-void log_init(void);
+int log_init(void);
 
 /*
  * Outputs formatted text to the log file, with prefixed time.
@@ -25,10 +38,50 @@ void log_write_notime(const char *, ...);
 void log_error(const char *, ...);
 
 /*
- * Destroys the logging system.
+ * Destroys the logging system, after everything logged
+ * so far has been written out.
  */
 void log_destroy(void);
 
+/*
+ * One response in the access log. Times are in nanoseconds,
+ * measured with a monotonic clock from when the first byte
+ * of the request came in.
+ */
+typedef struct {
+	/* How long until the request was parsed and answered */
+	uint64_t parse_ns;
+
+	/* How long until the last byte of the response went out */
+	uint64_t total_ns;
+
+	/* Bytes of the response that went out (less if the client left) */
+	uint64_t bytes;
+
+	uint16_t status;
+
+	/* HttpMethod */
+	uint8_t method;
+
+	/* AF_INET or AF_INET6 with the address in peer, 0 if unknown */
+	uint8_t peer_family;
+	uint8_t peer[16];
+
+	uint16_t path_len;
+	char path[ACCESS_PATH_MAX];
+} AccessRecord;
+
+/*
+ * Whether access-log is on (and logging at all).
+ */
+int log_access_enabled(void);
+
+/*
+ * Put a line into the access log. Only the record is copied,
+ * the writer thread formats it.
+ */
+void log_access(const AccessRecord *);
+
 struct HttpRequest;
 
 /*
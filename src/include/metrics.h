@@ -0,0 +1,126 @@
+#ifndef _METRICS_HEADER_GUARD
+#define _METRICS_HEADER_GUARD
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <http.h>
+
+/*
+ * Server metrics, served in the Prometheus text format.
+ *
+ * Every worker counts into its own Metrics (cache line aligned,
+ * nothing is shared), they're only added up when scraped. A
+ * counter is only written by the worker that owns it, so updates
+ * are a plain load and store instead of a locked instruction.
+ */
+
+/*
+ * Latency histograms are HDR style: every power of two (of
+ * microseconds) is split into METRICS_HIST_SUB linear buckets,
+ * so every bucket is within 25% of its values.
+ */
+#define METRICS_HIST_SUB_BITS (2)
+#define METRICS_HIST_SUB      (1 << METRICS_HIST_SUB_BITS)
+
+/* Powers of two covered, up to 2^28 us (~4.5 minutes) */
+#define METRICS_HIST_GROUPS   (26)
+
+/* The last one counts everything that's bigger */
+#define METRICS_HIST_BUCKETS  ((METRICS_HIST_GROUPS + 1) * METRICS_HIST_SUB + 1)
+
+typedef struct {
+	uint64_t counts[METRICS_HIST_BUCKETS];
+
+	/* In microseconds */
+	uint64_t sum;
+} MetricsHist;
+
+#define METRICS_METHODS (HTTP_TRACE + 1)
+
+/*
+ * The status codes the server sends, counted separately.
+ * Anything else goes into METRICS_STATUS_OTHER.
+ */
+typedef enum {
+	METRICS_STATUS_200,
+	METRICS_STATUS_206,
+	METRICS_STATUS_304,
+	METRICS_STATUS_400,
+	METRICS_STATUS_404,
+	METRICS_STATUS_405,
+	METRICS_STATUS_406,
+	METRICS_STATUS_411,
+	METRICS_STATUS_413,
+	METRICS_STATUS_414,
+	METRICS_STATUS_416,
+	METRICS_STATUS_500,
+	METRICS_STATUS_501,
+	METRICS_STATUS_503,
+	METRICS_STATUS_505,
+	METRICS_STATUS_OTHER,
+	METRICS_STATUSES,
+} MetricsStatus;
+
+typedef struct {
+	_Alignas(64) uint64_t accepted;
+	uint64_t closed;
+
+	/* Connections closed because a timeout ran out */
+	uint64_t timeouts;
+
+	/* Connections answered 503 because the worker was full */
+	uint64_t rejected;
+
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+
+	/* Requests http_check_done() rejected */
+	uint64_t parse_errors;
+
+	/* Resources served from memory / streamed from their file */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+
+	uint64_t requests[METRICS_METHODS][METRICS_STATUSES];
+
+	/* From the first byte of a request until it was answered */
+	MetricsHist parse_time;
+
+	/* From the first byte of a request until the last byte of its response went out */
+	MetricsHist total_time;
+} Metrics;
+
+/*
+ * Add to a counter of the calling worker's Metrics.
+ */
+#define metrics_add(counter, n) \
+	__atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+/*
+ * Set up a Metrics for every worker.
+ * Returns -1 if there's no memory for them.
+ */
+int metrics_init(int);
+
+/*
+ * The Metrics of a worker.
+ */
+Metrics *metrics_worker(int);
+
+MetricsStatus metrics_status(int);
+
+/*
+ * Count a latency (in nanoseconds) in a histogram.
+ */
+void metrics_hist_add(MetricsHist *, uint64_t);
+
+/*
+ * Add up every worker's Metrics into Prometheus text.
+ * Returns a malloc()ed buffer and sets its length, or NULL.
+ */
+char *metrics_render(size_t *);
+
+void metrics_destroy(void);
+
+#endif // _METRICS_HEADER_GUARD
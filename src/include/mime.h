@@ -0,0 +1,81 @@
+#ifndef _MIME_HEADER_GUARD
+#define _MIME_HEADER_GUARD
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <http.h>
+
+/*
+ * Media types by file extension
+ *
+ * The table is generated from src/mime.types at build time by
+ * mimegen, as a perfect hash (hash and displace): an extension
+ * hashes to a bucket, and the displacement of that bucket to the
+ * only slot the extension can be in. A lookup is two hashes and a
+ * compare, no matter how many types there are.
+ */
+
+typedef struct {
+	/* "Content-Type: ...\r\n", ready to go into a response */
+	const char *line;
+	uint32_t line_len;
+
+	/* What Accept names it by, one of the wildcards if nothing more specific */
+	AcceptType type;
+
+	/* Worth compressing (text, JSON, XML, ...) */
+	uint8_t compressible;
+} MimeType;
+
+typedef struct {
+	const char *ext;
+	uint32_t len;
+	const MimeType *mime;
+} MimeExt;
+
+/*
+ * FNV-1a over an extension (in lowercase), then where that lands
+ * with a displacement. mimegen builds the table with these, so
+ * they can't change without it being regenerated.
+ */
+static inline uint32_t mime_hash(const uint8_t *ext, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ ext[i]) * 16777619u;
+	return hash;
+}
+
+static inline uint32_t mime_displace(uint32_t hash, uint32_t d)
+{
+	hash ^= d * 0x9e3779b9u;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/*
+ * The media type of an extension (without the dot, in any case).
+ * Returns NULL if it isn't in the table.
+ */
+const MimeType *mime_lookup(const uint8_t *, size_t);
+
+/*
+ * The media type of a file name, by what comes after its last dot.
+ * application/octet-stream if there's no extension or it isn't known.
+ */
+const MimeType *mime_of(const char *);
+
+/*
+ * The extensions of types Accept can name (not only with a wildcard),
+ * in the order of mime.types. These are what a path without an
+ * extension is negotiated between, see resource_negotiate().
+ */
+extern const MimeExt *const mime_negotiable[];
+extern const size_t mime_negotiable_num;
+
+#endif // _MIME_HEADER_GUARD
@@ -0,0 +1,104 @@
+#ifndef _OUTPUT_HEADER_GUARD
+#define _OUTPUT_HEADER_GUARD
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * The max amount of segments waiting on one connection.
+ */
+#define OUTPUT_MAX_SEGMENTS (16)
+
+typedef enum {
+	OUTPUT_MEM,
+	OUTPUT_FILE,
+} OutputType;
+
+/*
+ * A piece of a response that still has to be sent:
+ * either bytes in memory or a range of a file.
+ */
+typedef struct {
+	OutputType type;
+
+	/* 1 if buf has to be freed once it's sent */
+	uint8_t owned;
+
+	const uint8_t *buf;
+	int fd;
+
+	/* Offset into buf / fd of the next byte to send */
+	off_t off;
+
+	/* Bytes left to send */
+	size_t len;
+} OutputSegment;
+
+typedef struct {
+	OutputSegment segs[OUTPUT_MAX_SEGMENTS];
+	uint8_t head;
+	uint8_t count;
+
+	/*
+	 * Bytes ever queued / sent, so callers can tell when
+	 * everything up to some point went out.
+	 */
+	uint64_t queued;
+	uint64_t sent;
+} OutputQueue;
+
+/*
+ * Queue bytes in memory. If owned is set, the queue
+ * takes the buffer and frees it once it's sent.
+ *
+ * Returns -1 if the queue is full.
+ */
+int output_push_mem(OutputQueue *, const uint8_t *, size_t, int);
+
+/*
+ * Queue a range of a file, sent with io_sendfile().
+ *
+ * Returns -1 if the queue is full.
+ */
+int output_push_file(OutputQueue *, int, off_t, size_t);
+
+/*
+ * Send as much of the queue as the socket takes.
+ *
+ * Returns 1 once the queue is empty,
+ * 0 if the socket is full (wait for write readiness),
+ * -1 on error.
+ */
+int output_flush(OutputQueue *, int);
+
+/*
+ * Point iovecs at the memory segments at the front of the queue,
+ * for backends that do the sending themselves.
+ *
+ * Returns the amount of iovecs filled in (at most OUTPUT_MAX_SEGMENTS).
+ */
+int output_gather(OutputQueue *, struct iovec *);
+
+/*
+ * Account for bytes that were sent, dropping every segment that's done.
+ */
+void output_advance(OutputQueue *, size_t);
+
+/*
+ * Drop everything in the queue.
+ */
+void output_clear(OutputQueue *);
+
+#define output_empty(queue) ((queue)->count == 0)
+
+#define output_room(queue) (OUTPUT_MAX_SEGMENTS - (queue)->count)
+
+/*
+ * The i'th segment from the front of the queue.
+ */
+#define output_seg(queue, i) \
+	(&(queue)->segs[((queue)->head + (i)) % OUTPUT_MAX_SEGMENTS])
+
+#endif // _OUTPUT_HEADER_GUARD
@@ -0,0 +1,47 @@
+#ifndef _POOL_HEADER_GUARD
+#define _POOL_HEADER_GUARD
+
+#include <stddef.h>
+
+/*
+ * A freelist of fixed size objects, carved out of bigger slabs.
+ *
+ * Objects go back on the freelist instead of back to malloc, and
+ * slabs are only given back when the pool is destroyed. Pools are
+ * not thread safe: every worker has its own.
+ */
+typedef struct {
+	size_t obj_size;
+	size_t per_slab;
+
+	/* Free objects, linked through their first bytes */
+	void *free;
+
+	/* Every slab, linked through their headers */
+	void *slabs;
+
+	size_t in_use;
+} Pool;
+
+/*
+ * Initialize a pool of objects of a size, allocating
+ * per_slab of them at a time.
+ */
+void pool_init(Pool *, size_t, size_t);
+
+/*
+ * Get an object (not zeroed), or NULL if out of memory.
+ */
+void *pool_get(Pool *);
+
+/*
+ * Give an object back.
+ */
+void pool_put(Pool *, void *);
+
+/*
+ * Free every slab. Every object of the pool becomes invalid.
+ */
+void pool_destroy(Pool *);
+
+#endif // _POOL_HEADER_GUARD
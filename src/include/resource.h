@@ -15,12 +15,99 @@
 #include <errno.h>
 
 #include <http.h>
+#include <mime.h>
 
+/*
+ * One representation of a file: as it is, or in a content coding.
+ * Coded variants come from a .gz / .br file next to the original,
+ * or are compressed when the file is loaded.
+ */
 typedef struct {
+	/* -1 for variants that were compressed here, they're always cached */
 	int fd;
-	AcceptType type;
+
+	/* Size of the body */
+	size_t size;
+
+	/*
+	 * Prebuilt "200 OK" response: the status line and headers,
+	 * followed by the whole body if the file was small enough to
+	 * be cached. If it wasn't (cached == 0), only the headers are
+	 * in here and the body has to be streamed from fd.
+	 *
+	 * NULL if the resource has no such variant.
+	 */
+	uint8_t *response;
+	size_t header_len;
+	size_t response_len;
+	uint8_t cached;
+
+	/*
+	 * Where the header lines after Content-Length start in the
+	 * response, a 206 reuses them (and the end of the headers).
+	 */
+	size_t fields_off;
+
+	/*
+	 * Prebuilt "304 Not Modified" (in the same allocation as the
+	 * response), and the strong ETag it answers to, with its quotes.
+	 */
+	uint8_t *not_modified;
+	size_t not_modified_len;
+	char etag[64];
+	uint8_t etag_len;
+} ResourceVariant;
+
+typedef struct {
+	/* Its media type, the Content-Type line is the first one after Content-Length */
+	const MimeType *mime;
+
+	/* Modification time of the file, for Last-Modified */
+	time_t last_modified;
+
+	/* By HttpEncoding, the identity one is always there */
+	ResourceVariant variants[HTTP_ENCODINGS];
 } Resource;
 
+/*
+ * The smallest variant of a resource in one of the codings a client
+ * accepts (HTTP_ENCODING_BIT()s), the identity one if there's none.
+ */
+static inline const ResourceVariant *resource_variant(const Resource *resource, uint8_t accept)
+{
+	const ResourceVariant *best = &resource->variants[HTTP_ENCODING_IDENTITY];
+
+	for (int e = HTTP_ENCODING_IDENTITY + 1; e < HTTP_ENCODINGS; e++) {
+		const ResourceVariant *variant = &resource->variants[e];
+		if ((accept & HTTP_ENCODING_BIT(e)) && variant->response && variant->size < best->size)
+			best = variant;
+	}
+	return best;
+}
+
+/*
+ * 1 if the copy a client already has of a variant is still good
+ * (If-None-Match, or If-Modified-Since without one), so it gets
+ * the 304 instead of the response.
+ */
+int resource_not_modified(const Resource *, const ResourceVariant *, const HttpRequest *);
+
+/*
+ * The byte ranges of a variant a GET asks for (unless If-Range says
+ * the client's copy is outdated), clamped to its size, sorted, and
+ * with overlapping or adjacent ones merged.
+ *
+ * Returns how many there are (filled into the array, which needs
+ * HTTP_MAX_RANGES), 0 if the whole variant has to be sent, or -1
+ * if none of them can be satisfied (416).
+ */
+int resource_ranges(const Resource *, const ResourceVariant *, const HttpRequest *, HttpRange *);
+
+/*
+ * A snapshot of every resource, see resource.c
+ */
+typedef struct ResourceTable ResourceTable;
+
 /*
  * Initialize the resource system
  */
@@ -32,9 +119,41 @@ int resource_init(void);
 void resource_list(void);
 
 /*
- * Get a resource
+ * Get a resource, from the snapshot the calling thread is on.
+ *
+ * The pointer stays valid until the thread calls resource_quiesce(),
+ * or for as long as the snapshot is pinned.
+ */
+Resource *resource_get(uint8_t *, uint16_t);
+
+/*
+ * Get the resource a path without an extension stands for, after
+ * resource_get() found nothing: of the files named like it plus
+ * an extension, the one of the type the client wants most (Accept).
+ * Same as resource_get() as to how long the pointer stays valid.
+ *
+ * Returns 200 with the resource, 406 if there are such files but the
+ * client accepts none of them, or 404 if there are none.
+ */
+int resource_negotiate(uint8_t *, uint16_t, const AcceptField *, Resource **);
+
+/*
+ * Quiescent point: the calling thread moves on to the newest
+ * snapshot and lets go of the one it had. No Resource pointers
+ * (that aren't pinned) may be held across this call.
+ */
+void resource_quiesce(void);
+
+/*
+ * Keep the calling thread's snapshot alive past resource_quiesce(),
+ * e.g. for a response that is still being sent.
+ */
+ResourceTable *resource_pin(void);
+
+/*
+ * Let go of a pinned snapshot.
  */
-Resource *resource_get(uint8_t *, uint8_t);
+void resource_unpin(ResourceTable *);
 
 /*
  * Destroy the resource system
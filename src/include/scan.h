@@ -0,0 +1,46 @@
+#ifndef _SCAN_HEADER_GUARD
+#define _SCAN_HEADER_GUARD
+
+#include <stdint.h>
+
+/*
+ * Byte scanning kernels for the HTTP parser.
+ *
+ * Every function scans [start, end) and returns a pointer to the
+ * first match, or end if there is none. They never read outside
+ * of [start, end).
+ *
+ * scan_init() picks the fastest implementation the CPU supports
+ * (AVX2, SSE4.2 or plain C). Until it's called the plain C
+ * versions are used.
+ */
+
+/*
+ * Pick the implementations for this CPU.
+ */
+void scan_init(void);
+
+/*
+ * The name of the implementation in use ("avx2", "sse4.2", "scalar").
+ */
+const char *scan_impl_name(void);
+
+/*
+ * Switch to an implementation by name, e.g. to compare them.
+ * Returns -1 if there's no such implementation or the CPU
+ * doesn't support it.
+ */
+int scan_use(const char *);
+
+/*
+ * Find the first '\r'.
+ */
+extern const uint8_t *(*scan_cr)(const uint8_t *, const uint8_t *);
+
+/*
+ * Find the first byte that isn't a visible ASCII character,
+ * in other words outside of 33-126 (the end of a token / path).
+ */
+extern const uint8_t *(*scan_token)(const uint8_t *, const uint8_t *);
+
+#endif // _SCAN_HEADER_GUARD
@@ -0,0 +1,80 @@
+#ifndef _SETTINGS_HEADER_GUARD
+#define _SETTINGS_HEADER_GUARD
+
+/*
+ * Runtime settings.
+ *
+ * The defaults come from config.h. A config file (-c) overrides
+ * them, and command line options override the config file. Every
+ * setting is a "name = value" line in the file and a --name option
+ * on the command line, run with --help for the list.
+ *
+ * Everything is parsed once in settings_init(), before any thread
+ * starts, and never changes after that.
+ */
+typedef struct {
+	int port;
+
+	/* Pending connections the kernel queues up for accept() */
+	int backlog;
+
+	/* Open connections per worker, 0 for no limit */
+	int max_connections;
+
+	/* Past the limit, stop accepting instead of answering 503 */
+	int pause_accept;
+
+	/* Size of a receive buffer, in kilobytes */
+	int max_buf;
+
+	/* In seconds, 0 for none */
+	int header_timeout;
+	int keepalive_timeout;
+	int idle_timeout;
+
+	int log;
+	char *log_file;
+
+	/* "off", "clf" or "json" */
+	char *access_log;
+
+	/* Serve WSERVER_METRICS_PATH */
+	int metrics;
+
+	/* 0 starts one per online CPU */
+	int workers;
+	int pin_workers;
+
+	/* "auto", "uring" or the native event system */
+	char *backend;
+
+	/* The document root */
+	char *root;
+	int live_reload;
+
+	/* In kilobytes */
+	int cache_max_file;
+	int cache_max_size;
+
+	/* Compress text files without a precompressed one, into at most compress_max_size KiB */
+	int compress;
+	int compress_max_size;
+} Settings;
+
+extern const Settings *wserver_settings;
+
+/*
+ * Fill in wserver_settings from the defaults, the config file
+ * and the command line. Problems are reported on stderr.
+ *
+ * Returns 0 on success, 1 if the program should just exit
+ * (--help), -1 on error.
+ */
+int settings_init(int, char **);
+
+/*
+ * Free the settings.
+ */
+void settings_destroy(void);
+
+#endif // _SETTINGS_HEADER_GUARD
@@ -0,0 +1,85 @@
+#ifndef _TIMER_HEADER_GUARD
+#define _TIMER_HEADER_GUARD
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A hierarchical timing wheel, for deadlines of connections.
+ *
+ * Time goes in ticks of WSERVER_TIMER_TICK_MS. Every level has
+ * TIMER_SLOTS slots, a slot of level n covering TIMER_SLOTS^n
+ * ticks. Timers sit in the slot of their expiry on the lowest level
+ * that reaches that far, and move down a level (cascade) whenever
+ * the level below wrapped around. Setting, cancelling and expiring
+ * a timer are O(1).
+ *
+ * Wheels are not thread safe: every worker has its own.
+ */
+
+#define TIMER_SLOT_BITS (6)
+#define TIMER_SLOTS     (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS    (4)
+
+/*
+ * Embedded in whatever has a deadline.
+ * A zeroed Timer is a valid one that isn't set.
+ */
+typedef struct Timer {
+	struct Timer *next;
+	struct Timer *prev;
+
+	/* In ticks */
+	uint64_t expires;
+} Timer;
+
+typedef struct {
+	/* The tick the wheel is at, everything before it expired */
+	uint64_t now;
+
+	/* Lists of timers, the heads aren't timers themselves */
+	Timer slots[TIMER_LEVELS][TIMER_SLOTS];
+
+	/* Bit n is set if slot n of a level has timers */
+	uint64_t occupied[TIMER_LEVELS];
+
+	size_t count;
+} TimerWheel;
+
+/*
+ * Start a wheel at a time (in milliseconds, any monotonic clock).
+ */
+void timer_wheel_init(TimerWheel *, uint64_t);
+
+/*
+ * Set a timer to expire at a time (in milliseconds), moving it
+ * if it was already set. Deadlines further away than the wheel
+ * reaches (weeks) are cut short.
+ */
+void timer_set(TimerWheel *, Timer *, uint64_t);
+
+/*
+ * Take a timer off its wheel, if it's set.
+ */
+void timer_cancel(TimerWheel *, Timer *);
+
+static inline int timer_pending(const Timer *timer)
+{
+	return timer->next != NULL;
+}
+
+/*
+ * Move the wheel up to a time (in milliseconds), calling the
+ * function on every timer that expired. The timer is already off
+ * the wheel by then, so the function can set it again or free it.
+ */
+void timer_advance(TimerWheel *, uint64_t, void (*)(Timer *, void *), void *);
+
+/*
+ * Milliseconds from a time until the wheel has to be advanced
+ * again, for the timeout of the event loop. Returns -1 if no timer
+ * is set.
+ */
+int timer_next(const TimerWheel *, uint64_t);
+
+#endif // _TIMER_HEADER_GUARD
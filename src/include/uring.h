@@ -0,0 +1,149 @@
+#ifndef _URING_HEADER_GUARD
+#define _URING_HEADER_GUARD
+
+/*
+ * A minimal io_uring wrapper on top of the raw syscalls
+ * (there is no liburing dependency).
+ *
+ * WSERVER_HAVE_URING is only set when the system headers know
+ * about everything the server uses. Whether the running kernel
+ * supports it is a separate question, see uring_supported().
+ */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_ACCEPT_MULTISHOT) && \
+	defined(IORING_SETUP_SINGLE_ISSUER)
+#define WSERVER_HAVE_URING (1)
+#endif
+#endif
+#endif
+
+#if WSERVER_HAVE_URING
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The buffer group the provided receive buffers are registered as.
+ */
+#define URING_BUF_GROUP (0)
+
+typedef struct {
+	int fd;
+
+	/* Submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+
+	/* Tail of the SQEs handed out, and how many the kernel hasn't seen */
+	unsigned sqe_tail;
+	unsigned to_submit;
+
+	/* Completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *rings;
+	size_t rings_size;
+	size_t sqes_size;
+
+	/* Provided receive buffers */
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	uint8_t *bufs;
+	unsigned buf_count;
+	unsigned buf_size;
+	uint16_t br_tail;
+} Uring;
+
+/*
+ * Check once if the kernel has everything the server needs
+ * (multishot accept / recv, provided buffer rings, splice).
+ */
+int uring_supported(void);
+
+/*
+ * Set up a ring with the given amount of SQEs, and register
+ * buf_count (a power of 2) receive buffers of buf_size bytes.
+ *
+ * Returns -1 with errno set on failure.
+ */
+int uring_init(Uring *, unsigned, unsigned, unsigned);
+
+void uring_destroy(Uring *);
+
+/*
+ * Make sure count SQEs can be handed out without submitting in
+ * between (linked SQEs have to go to the kernel together).
+ * Returns -1 if the queue doesn't drain.
+ */
+int uring_reserve(Uring *, unsigned);
+
+/*
+ * Get a zeroed SQE, submitting the queued ones if the queue is full.
+ * Returns NULL if there's still no room.
+ */
+struct io_uring_sqe *uring_sqe(Uring *);
+
+/*
+ * Submit everything queued and wait for at least one completion,
+ * at most timeout milliseconds (negative waits forever).
+ *
+ * Returns -1 with errno set on failure. A timeout or a signal
+ * isn't a failure.
+ */
+int uring_wait(Uring *, int);
+
+/*
+ * The next completion, or NULL if there is none.
+ * Every completion has to be handed back with uring_cqe_seen().
+ */
+static inline struct io_uring_cqe *uring_cqe(Uring *ring)
+{
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void uring_cqe_seen(Uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The receive buffer with a buffer ID (from the upper bits of cqe->flags).
+ */
+static inline uint8_t *uring_buf(Uring *ring, uint16_t bid)
+{
+	return ring->bufs + (size_t) bid * ring->buf_size;
+}
+
+/*
+ * Give a receive buffer back to the kernel.
+ */
+void uring_buf_put(Uring *, uint16_t);
+
+/*
+ * Fill in the common fields of an SQE.
+ */
+static inline void uring_prep(struct io_uring_sqe *sqe, uint8_t op, int fd,
+		const void *addr, uint32_t len, uint64_t off, uint64_t user_data)
+{
+	sqe->opcode    = op;
+	sqe->fd        = fd;
+	sqe->addr      = (uint64_t) (uintptr_t) addr;
+	sqe->len       = len;
+	sqe->off       = off;
+	sqe->user_data = user_data;
+}
+
+#endif // WSERVER_HAVE_URING
+
+#endif // _URING_HEADER_GUARD
@@ -0,0 +1,67 @@
+#include <io.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#elif defined(__FreeBSD__) || defined(__DragonFly__) || \
+	(defined(__APPLE__) && defined(__MACH__))
+#include <sys/uio.h>
+#define WSERVER_BSD_SENDFILE (1)
+#endif
+
+/*
+ * Chunk size for the fallback path, when there is no sendfile().
+ */
+#define IO_FALLBACK_CHUNK (16 * 1024)
+
+ssize_t io_sendfile(int sock, int fd, off_t off, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+#if defined(__linux__)
+	/* Linux sends at most 0x7ffff000 bytes per call anyway */
+	return sendfile(sock, fd, &off, len);
+
+#elif defined(WSERVER_BSD_SENDFILE) && defined(__APPLE__)
+	off_t sent = (off_t) len;
+	if (sendfile(fd, sock, off, &sent, NULL, 0) < 0) {
+		/* A partial send still reports how much went out */
+		if ((errno == EAGAIN || errno == EINTR) && sent > 0)
+			return sent;
+		return -1;
+	}
+	return sent;
+
+#elif defined(WSERVER_BSD_SENDFILE)
+	off_t sent = 0;
+	if (sendfile(fd, sock, off, len, NULL, &sent, 0) < 0) {
+		if ((errno == EAGAIN || errno == EBUSY || errno == EINTR) && sent > 0)
+			return sent;
+		if (errno == EBUSY)
+			errno = EAGAIN;
+		return -1;
+	}
+	return sent;
+
+#else
+	uint8_t chunk[IO_FALLBACK_CHUNK];
+	if (len > sizeof(chunk))
+		len = sizeof(chunk);
+
+	ssize_t n = pread(fd, chunk, len, off);
+	if (n <= 0) {
+		if (n == 0)
+			errno = EIO;
+		return -1;
+	}
+
+	/* Only what actually got sent counts, the rest is read again */
+	return send(sock, chunk, n, 0);
+#endif
+}
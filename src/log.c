@@ -1,73 +1,539 @@
 #include <http.h>
 #include <config.h>
+#include <settings.h>
 #include <log.h>
 
 #if WSERVER_ENABLE_LOG
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <sys/time.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 #endif
 
 #if WSERVER_ENABLE_LOG
 #define MAYBE_UNUSED
-static FILE *wserver_log_file;
 #else
 #define MAYBE_UNUSED __attribute__((unused))
 #endif
 
-void log_init(void)
-{
 #if WSERVER_ENABLE_LOG
-#ifdef WSERVER_LOG_FILE
-	wserver_log_file = fopen(WSERVER_LOG_FILE, "w");
-	if (!wserver_log_file) {
-		fprintf(stderr,
-			"failed to open log file (" WSERVER_LOG_FILE "): %s\n",
-			strerror(errno)
-		);
-		wserver_log_file = DEFAULT_LOG_FHANDLE;
+const char *method_types[] = {
+	[HTTP_NONE] = "None",
+	[HTTP_GET]  = "GET",
+	[HTTP_PUT]  = "PUT",
+	[HTTP_POST] = "POST",
+	[HTTP_HEAD] = "HEAD",
+	[HTTP_DELETE] = "DELETE",
+	[HTTP_OPTIONS] = "OPTIONS",
+	[HTTP_TRACE] = "TRACE",
+};
+
+/*
+ * The log file is never touched by the threads that log.
+ *
+ * Every thread gets its own ring that only it writes records into:
+ * the message and the time it was logged at. A writer thread drains
+ * all the rings in batches, puts the formatted time in front of
+ * every line and hands the batch to the file in large writes.
+ *
+ * A record is dropped if its ring is full (the writer reports how
+ * many were), logging never blocks the event loop.
+ */
+
+/* Size of every thread's ring, a power of two */
+#define LOG_RING_SIZE (256 * 1024)
+
+/* Longest message of one record, longer ones are cut off */
+#define LOG_MSG_MAX (2048)
+
+/* How often the writer looks at the rings when nobody wakes it up */
+#define LOG_WRITER_SLEEP_MS (20)
+
+/* The writer's output buffer */
+#define LOG_OUT_SIZE (64 * 1024)
+
+typedef enum {
+	LOG_PAD,
+	LOG_TIME,
+	LOG_ERROR,
+	LOG_NOTIME,
+	LOG_ACCESS,
+} LogKind;
+
+/*
+ * A record in a ring, followed by len bytes of message
+ * (or the used part of an AccessRecord).
+ */
+typedef struct {
+	uint32_t len;
+	uint32_t kind;
+	int64_t sec;
+	int64_t nsec;
+} LogRecord;
+
+#define LOG_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+typedef struct LogRing {
+	/* Only moved by the thread the ring belongs to */
+	_Alignas(64) _Atomic uint64_t head;
+
+	/* Only moved by the writer */
+	_Alignas(64) _Atomic uint64_t tail;
+
+	_Alignas(64) _Atomic uint64_t dropped;
+	uint64_t dropped_seen;
+
+	struct LogRing *next;
+	uint8_t *buf;
+} LogRing;
+
+static int wserver_log_fd = -1;
+static atomic_int wserver_log_active;
+
+typedef enum {
+	ACCESS_OFF,
+	ACCESS_CLF,
+	ACCESS_JSON,
+} AccessFormat;
+
+static AccessFormat access_format;
+
+/* Every ring ever made, new ones are pushed onto the front */
+static LogRing *_Atomic log_rings;
+static _Thread_local LogRing *log_ring;
+
+static pthread_t log_writer;
+static int log_writer_running;
+static atomic_int log_writer_stop;
+static pthread_mutex_t log_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+
+static LogRing *log_ring_get(void)
+{
+	if (log_ring)
+		return log_ring;
+
+	LogRing *ring = aligned_alloc(64, sizeof(LogRing));
+	if (!ring)
+		return NULL;
+	(void) memset(ring, 0, sizeof(LogRing));
+
+	ring->buf = malloc(LOG_RING_SIZE);
+	if (!ring->buf) {
+		free(ring);
+		return NULL;
 	}
-#else
-	wserver_log_file = DEFAULT_LOG_FHANDLE;
-#endif
-#endif
+
+	LogRing *head = atomic_load_explicit(&log_rings, memory_order_relaxed);
+	do {
+		ring->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(&log_rings, &head, ring,
+			memory_order_release, memory_order_relaxed));
+
+	log_ring = ring;
+	return ring;
+}
+
+/*
+ * Start a record of the calling thread, with room for LOG_MSG_MAX
+ * bytes of message. Returns NULL if it has to be dropped.
+ */
+static LogRecord *log_begin(LogKind kind)
+{
+	if (!atomic_load_explicit(&wserver_log_active, memory_order_relaxed))
+		return NULL;
+
+	LogRing *ring = log_ring_get();
+	if (!ring)
+		return NULL;
+
+	const size_t need = LOG_ALIGN(sizeof(LogRecord) + LOG_MSG_MAX);
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	size_t pos = head & (LOG_RING_SIZE - 1);
+
+	/* Records never wrap around, the end of the ring is padded out instead */
+	size_t pad = (LOG_RING_SIZE - pos < need) ? LOG_RING_SIZE - pos : 0;
+	if (LOG_RING_SIZE - (head - tail) < pad + need) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	if (pad) {
+		((LogRecord *) (ring->buf + pos))->kind = LOG_PAD;
+		atomic_store_explicit(&ring->head, head + pad, memory_order_release);
+		pos = 0;
+	}
+
+	LogRecord *rec = (LogRecord *) (ring->buf + pos);
+	rec->kind = kind;
+	rec->len  = 0;
+
+	if (kind != LOG_NOTIME) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		rec->sec  = ts.tv_sec;
+		rec->nsec = ts.tv_nsec;
+	}
+	return rec;
+}
+
+/*
+ * Hand a record started with log_begin() to the writer.
+ */
+static void log_commit(LogRecord *rec)
+{
+	LogRing *ring = log_ring;
+
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	head += LOG_ALIGN(sizeof(LogRecord) + rec->len);
+	atomic_store_explicit(&ring->head, head, memory_order_release);
+
+	/* Wake the writer early if the ring is filling up */
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (head - tail > LOG_RING_SIZE / 2)
+		pthread_cond_signal(&log_wake);
+}
+
+static void log_vrecord(LogKind kind, const char *fmt, va_list args)
+{
+	LogRecord *rec = log_begin(kind);
+	if (!rec)
+		return;
+
+	int len = vsnprintf((char *) (rec + 1), LOG_MSG_MAX, fmt, args);
+	if (len < 0)
+		len = 0;
+	rec->len = (len < LOG_MSG_MAX) ? (uint32_t) len : LOG_MSG_MAX - 1;
+
+	log_commit(rec);
+}
+
+/*
+ * The writer's side.
+ */
+
+typedef struct {
+	char buf[LOG_OUT_SIZE];
+	size_t used;
+
+	/*
+	 * The formatted parts of time_sec, only redone once a second:
+	 * "YYYY-mm-dd HH:MM:SS" in front of every line, and the times
+	 * of the access log formats.
+	 */
+	int64_t time_sec;
+	int time_ok;
+	char time[32];
+	size_t time_len;
+	char clf_time[48];
+	size_t clf_time_len;
+	char iso_time[32];
+	size_t iso_time_len;
+	char zone[16];
+	size_t zone_len;
+} LogOut;
+
+static void log_out_flush(LogOut *out)
+{
+	size_t off = 0;
+	while (off < out->used) {
+		ssize_t n = write(wserver_log_fd, out->buf + off, out->used - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		off += (size_t) n;
+	}
+	out->used = 0;
 }
 
+static void log_out(LogOut *out, const void *bytes, size_t len)
+{
+	while (len) {
+		if (out->used == LOG_OUT_SIZE)
+			log_out_flush(out);
+
+		size_t n = LOG_OUT_SIZE - out->used;
+		n = (len < n) ? len : n;
+		(void) memcpy(out->buf + out->used, bytes, n);
+		out->used += n;
+		bytes = (const char *) bytes + n;
+		len -= n;
+	}
+}
+
+/*
+ * Bring the cached time strings up to date, returns 0 if the
+ * time can't be formatted.
+ */
+static int log_out_update_time(LogOut *out, int64_t sec)
+{
+	if (sec == out->time_sec && out->time_ok)
+		return 1;
+
+	struct tm tm_buf;
+	time_t t = (time_t) sec;
+
+	out->time_sec = sec;
+	out->time_ok = (localtime_r(&t, &tm_buf) != NULL);
+	if (!out->time_ok)
+		return 0;
+
+	out->time_len     = strftime(out->time, sizeof(out->time), "%Y-%m-%d %H:%M:%S", &tm_buf);
+	out->clf_time_len = strftime(out->clf_time, sizeof(out->clf_time), "%d/%b/%Y:%H:%M:%S %z", &tm_buf);
+	out->iso_time_len = strftime(out->iso_time, sizeof(out->iso_time), "%Y-%m-%dT%H:%M:%S", &tm_buf);
+	out->zone_len     = strftime(out->zone, sizeof(out->zone), "%z", &tm_buf);
+	return 1;
+}
+
+static void log_out_time(LogOut *out, const LogRecord *rec)
+{
+	if (!log_out_update_time(out, rec->sec)) {
+		log_out(out, "[UNKNOWN TIME]: ", 16);
+		return;
+	}
+
+	char usec[16];
+	int n = snprintf(usec, sizeof(usec), ".%06d: ", (int) (rec->nsec / 1000));
+	log_out(out, out->time, out->time_len);
+	log_out(out, usec, (size_t) n);
+}
+
+/*
+ * Write the path escaped: '"', '\\' and anything that isn't
+ * printable ASCII as \xHH for CLF, or the JSON escapes.
+ */
+static void log_out_path(LogOut *out, const char *path, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	size_t run = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = (unsigned char) path[i];
+		if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\')
+			continue;
+
+		log_out(out, path + run, i - run);
+		run = i + 1;
+
+		if (c == '"' || c == '\\') {
+			char esc[2] = { '\\', (char) c };
+			log_out(out, esc, 2);
+		} else if (access_format == ACCESS_JSON) {
+			char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+			log_out(out, esc, 6);
+		} else {
+			char esc[4] = { '\\', 'x', hex[c >> 4], hex[c & 15] };
+			log_out(out, esc, 4);
+		}
+	}
+	log_out(out, path + run, len - run);
+}
+
+static void log_out_access(LogOut *out, const LogRecord *rec)
+{
+	const AccessRecord *access = (const AccessRecord *) (rec + 1);
+
+	char peer[INET6_ADDRSTRLEN] = "-";
+	if (access->peer_family == AF_INET || access->peer_family == AF_INET6)
+		(void) inet_ntop(access->peer_family, access->peer, peer, sizeof(peer));
+
+	const char *method = (access->method < sizeof(method_types) / sizeof(method_types[0]))
+		? method_types[access->method] : "None";
+	int time_ok = log_out_update_time(out, rec->sec);
+
+	char buf[192];
+	int n;
+
+	if (access_format == ACCESS_JSON) {
+		log_out(out, "{\"time\":\"", 9);
+		if (time_ok) {
+			log_out(out, out->iso_time, out->iso_time_len);
+			n = snprintf(buf, sizeof(buf), ".%06d", (int) (rec->nsec / 1000));
+			log_out(out, buf, (size_t) n);
+			log_out(out, out->zone, out->zone_len);
+		}
+
+		n = snprintf(buf, sizeof(buf), "\",\"client\":\"%s\",\"method\":\"%s\",\"path\":\"",
+				peer, method);
+		log_out(out, buf, (size_t) n);
+		log_out_path(out, access->path, access->path_len);
+
+		n = snprintf(buf, sizeof(buf),
+				"\",\"status\":%u,\"bytes\":%llu,\"parse_us\":%llu,\"total_us\":%llu}\n",
+				access->status,
+				(unsigned long long) access->bytes,
+				(unsigned long long) (access->parse_ns / 1000),
+				(unsigned long long) (access->total_ns / 1000));
+		log_out(out, buf, (size_t) n);
+		return;
+	}
+
+	/* host ident user [time] "request" status bytes parse_us total_us */
+	n = snprintf(buf, sizeof(buf), "%s - - [", peer);
+	log_out(out, buf, (size_t) n);
+	if (time_ok)
+		log_out(out, out->clf_time, out->clf_time_len);
+
+	n = snprintf(buf, sizeof(buf), "] \"%s ", method);
+	log_out(out, buf, (size_t) n);
+	log_out_path(out, access->path, access->path_len);
+
+	n = snprintf(buf, sizeof(buf), "\" %u %llu %llu %llu\n",
+			access->status,
+			(unsigned long long) access->bytes,
+			(unsigned long long) (access->parse_ns / 1000),
+			(unsigned long long) (access->total_ns / 1000));
+	log_out(out, buf, (size_t) n);
+}
+
+static void log_drain(LogRing *ring, LogOut *out)
+{
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	while (tail != head) {
+		size_t pos = tail & (LOG_RING_SIZE - 1);
+		const LogRecord *rec = (const LogRecord *) (ring->buf + pos);
+
+		if (rec->kind == LOG_PAD) {
+			tail += LOG_RING_SIZE - pos;
+			continue;
+		}
+
+		if (rec->kind == LOG_ACCESS) {
+			log_out_access(out, rec);
+			tail += LOG_ALIGN(sizeof(LogRecord) + rec->len);
+			continue;
+		}
+
+		if (rec->kind != LOG_NOTIME)
+			log_out_time(out, rec);
+		if (rec->kind == LOG_ERROR)
+			log_out(out, "[ERROR]: ", 9);
+		log_out(out, rec + 1, rec->len);
+
+		tail += LOG_ALIGN(sizeof(LogRecord) + rec->len);
+	}
+
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+	uint64_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	if (dropped != ring->dropped_seen) {
+		char msg[64];
+		int n = snprintf(msg, sizeof(msg), "[%llu log records dropped]\n",
+				(unsigned long long) (dropped - ring->dropped_seen));
+		log_out(out, msg, (size_t) n);
+		ring->dropped_seen = dropped;
+	}
+}
+
+static void *log_writer_main(void *arg)
+{
+	LogOut *out = arg;
+
+	for ( ;; ) {
+		int stop = atomic_load(&log_writer_stop);
+
+		LogRing *ring = atomic_load_explicit(&log_rings, memory_order_acquire);
+		for ( ; ring; ring = ring->next)
+			log_drain(ring, out);
+		log_out_flush(out);
+
+		/* Everything logged before the stop has been written out */
+		if (stop)
+			break;
+
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_WRITER_SLEEP_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock(&log_wake_lock);
+		if (!atomic_load(&log_writer_stop))
+			(void) pthread_cond_timedwait(&log_wake, &log_wake_lock, &ts);
+		pthread_mutex_unlock(&log_wake_lock);
+	}
+
+	free(out);
+	return NULL;
+}
+
+#endif // WSERVER_ENABLE_LOG
+
+int log_init(void)
+{
 #if WSERVER_ENABLE_LOG
-static void log_fmt_time(void)
-{
-	struct timeval tv;
-	struct tm *tm_val;
-
-	gettimeofday(&tv, NULL);
-	tm_val = localtime(&tv.tv_sec);
-	if (tm_val) {
-		char buffer[64];
-		memset(buffer, 0, sizeof(buffer));
-		strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", tm_val);
-		fprintf(wserver_log_file, "%s.%06d", buffer, tv.tv_usec);
+	const char *format = wserver_settings->access_log;
+	if (!strcmp(format, "off")) {
+		access_format = ACCESS_OFF;
+	} else if (!strcmp(format, "clf")) {
+		access_format = ACCESS_CLF;
+	} else if (!strcmp(format, "json")) {
+		access_format = ACCESS_JSON;
 	} else {
-		fprintf(wserver_log_file, "[UNKNOWN TIME]");
+		fprintf(stderr, "unknown access log format %s, expected off, clf or json\n", format);
+		return -1;
 	}
 
-	fprintf(wserver_log_file, ": ");
-}
+	/* Everything is dropped while there's no log file */
+	if (!wserver_settings->log) {
+		access_format = ACCESS_OFF;
+		return 0;
+	}
+
+	const char *path = wserver_settings->log_file;
+	wserver_log_fd = DEFAULT_LOG_FD;
+
+	if (path) {
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd >= 0)
+			wserver_log_fd = fd;
+		else
+			fprintf(stderr, "failed to open log file (%s): %s\n", path, strerror(errno));
+	}
+
+	LogOut *out = calloc(1, sizeof(LogOut));
+	if (!out) {
+		fprintf(stderr, "failed to start the log writer: out of memory\n");
+		access_format = ACCESS_OFF;
+		return 0;
+	}
+
+	int error = pthread_create(&log_writer, NULL, log_writer_main, out);
+	if (error) {
+		fprintf(stderr, "failed to start the log writer: %s\n", strerror(error));
+		free(out);
+		access_format = ACCESS_OFF;
+		return 0;
+	}
+
+	log_writer_running = 1;
+	atomic_store(&wserver_log_active, 1);
 #endif
+	return 0;
+}
 
 void log_write(MAYBE_UNUSED const char *fmt, ...)
 {
 #if WSERVER_ENABLE_LOG
 	va_list args;
 	va_start(args, fmt);
-
-	log_fmt_time();
-	vfprintf(wserver_log_file, fmt, args);
-
-	fflush(wserver_log_file);
-
+	log_vrecord(LOG_TIME, fmt, args);
 	va_end(args);
 #endif
 }
@@ -77,10 +543,7 @@ void log_write_notime(MAYBE_UNUSED const char *fmt, ...)
 #if WSERVER_ENABLE_LOG
 	va_list args;
 	va_start(args, fmt);
-
-	vfprintf(wserver_log_file, fmt, args);
-	fflush(wserver_log_file);
-
+	log_vrecord(LOG_NOTIME, fmt, args);
 	va_end(args);
 #endif
 }
@@ -90,47 +553,79 @@ void log_error(MAYBE_UNUSED const char *fmt, ...)
 #if WSERVER_ENABLE_LOG
 	va_list args;
 	va_start(args, fmt);
-
-	log_fmt_time();
-	fprintf(wserver_log_file, "[ERROR]: ");
-	vfprintf(wserver_log_file, fmt, args);
-
-	fflush(wserver_log_file);
-
+	log_vrecord(LOG_ERROR, fmt, args);
 	va_end(args);
 #endif
 }
 
-void log_destroy(void)
+int log_access_enabled(void)
 {
 #if WSERVER_ENABLE_LOG
-#ifdef WSERVER_LOG_FILE
-	if (wserver_log_file)
-		fclose(wserver_log_file);
+	return access_format != ACCESS_OFF;
+#else
+	return 0;
 #endif
-	wserver_log_file = NULL;
+}
+
+void log_access(MAYBE_UNUSED const AccessRecord *access)
+{
+#if WSERVER_ENABLE_LOG
+	LogRecord *rec = log_begin(LOG_ACCESS);
+	if (!rec)
+		return;
+
+	size_t path_len = (access->path_len < ACCESS_PATH_MAX) ? access->path_len : ACCESS_PATH_MAX;
+	size_t len = offsetof(AccessRecord, path) + path_len;
+
+	(void) memcpy(rec + 1, access, len);
+	((AccessRecord *) (rec + 1))->path_len = (uint16_t) path_len;
+	rec->len = (uint32_t) len;
+	log_commit(rec);
 #endif
 }
 
+void log_destroy(void)
+{
 #if WSERVER_ENABLE_LOG
-const char *method_types[] = {
-	[HTTP_NONE] = "None",
-	[HTTP_GET]  = "GET",
-	[HTTP_PUT]  = "PUT",
-	[HTTP_POST] = "POST",
-	[HTTP_HEAD] = "HEAD",
-	[HTTP_DELETE] = "DELETE",
-	[HTTP_OPTIONS] = "OPTIONS",
-	[HTTP_TRACE] = "TRACE",
-};
+	/*
+	 * The rings aren't freed, a thread that's still running
+	 * might look at its own one.
+	 */
+	atomic_store(&wserver_log_active, 0);
+
+	if (log_writer_running) {
+		pthread_mutex_lock(&log_wake_lock);
+		atomic_store(&log_writer_stop, 1);
+		pthread_cond_signal(&log_wake);
+		pthread_mutex_unlock(&log_wake_lock);
+
+		(void) pthread_join(log_writer, NULL);
+		log_writer_running = 0;
+	}
+
+	if (wserver_log_fd >= 0 && wserver_log_fd != DEFAULT_LOG_FD)
+		close(wserver_log_fd);
+	wserver_log_fd = -1;
 #endif
+}
 
 void log_bytes(MAYBE_UNUSED uint8_t *buf, MAYBE_UNUSED uint32_t byte_size)
 {
 #if WSERVER_ENABLE_LOG
-	for (uint32_t i = 0; i < byte_size; i++)
-		(void) fputc((int) buf[i], wserver_log_file);
-	fflush(wserver_log_file);
+	/* As many records as it takes */
+	while (byte_size) {
+		LogRecord *rec = log_begin(LOG_NOTIME);
+		if (!rec)
+			return;
+
+		uint32_t len = (byte_size < LOG_MSG_MAX) ? byte_size : LOG_MSG_MAX;
+		(void) memcpy(rec + 1, buf, len);
+		rec->len = len;
+		log_commit(rec);
+
+		buf += len;
+		byte_size -= len;
+	}
 #endif
 }
 
@@ -139,18 +634,11 @@ void log_http_req(MAYBE_UNUSED HttpRequest *req)
 #if WSERVER_ENABLE_LOG
 	if (!req || !req->buf.buf) return;
 
-	fprintf(wserver_log_file, 
+	/* Records of one thread come out in order, in one piece each */
+	log_write_notime(
 			"[HTTP REQUEST] {\n"
 				"\tMethod Type:  %s\n"
-				"\tPath: ",
-			method_types[req->method]
-		);
-
-	if (req->path)
-		log_bytes(req->path, (uint32_t) req->path_len);
-
-	fprintf(wserver_log_file,
-				"\n"
+				"\tPath: %.*s\n"
 				"\tBuffer address:  %lx\n"
 				"\tUsed:            %u\n"
 				"\tSize:            %u\n"
@@ -158,6 +646,9 @@ void log_http_req(MAYBE_UNUSED HttpRequest *req)
 				"\tContent len:     %lu\n"
 				"\tFinished?        %s\n"
 			"}\n",
+			method_types[req->method],
+			req->path ? (int) req->path_len : 0,
+			req->path ? (const char *) req->path : "",
 			(uintptr_t) req->buf.buf,
 			req->buf.used,
 			req->buf.size,
@@ -168,8 +659,6 @@ void log_http_req(MAYBE_UNUSED HttpRequest *req)
 
 	log_bytes(req->buf.buf, req->buf.used);
 
-	fprintf(wserver_log_file, "[END OF HTTP REQUEST]\n");
-
-	fflush(wserver_log_file);
+	log_write_notime("[END OF HTTP REQUEST]\n");
 #endif
 }
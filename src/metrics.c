@@ -0,0 +1,257 @@
+#include <metrics.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static Metrics *metrics_slots;
+static int metrics_count;
+
+static const char *metrics_methods[METRICS_METHODS] = {
+	[HTTP_NONE]    = "NONE",
+	[HTTP_GET]     = "GET",
+	[HTTP_PUT]     = "PUT",
+	[HTTP_POST]    = "POST",
+	[HTTP_HEAD]    = "HEAD",
+	[HTTP_DELETE]  = "DELETE",
+	[HTTP_OPTIONS] = "OPTIONS",
+	[HTTP_TRACE]   = "TRACE",
+};
+
+static const char *metrics_statuses[METRICS_STATUSES] = {
+	[METRICS_STATUS_200]   = "200",
+	[METRICS_STATUS_206]   = "206",
+	[METRICS_STATUS_304]   = "304",
+	[METRICS_STATUS_400]   = "400",
+	[METRICS_STATUS_404]   = "404",
+	[METRICS_STATUS_405]   = "405",
+	[METRICS_STATUS_406]   = "406",
+	[METRICS_STATUS_411]   = "411",
+	[METRICS_STATUS_413]   = "413",
+	[METRICS_STATUS_414]   = "414",
+	[METRICS_STATUS_416]   = "416",
+	[METRICS_STATUS_500]   = "500",
+	[METRICS_STATUS_501]   = "501",
+	[METRICS_STATUS_503]   = "503",
+	[METRICS_STATUS_505]   = "505",
+	[METRICS_STATUS_OTHER] = "other",
+};
+
+int metrics_init(int workers)
+{
+	metrics_slots = aligned_alloc(_Alignof(Metrics), workers * sizeof(Metrics));
+	if (!metrics_slots)
+		return -1;
+
+	(void) memset(metrics_slots, 0, workers * sizeof(Metrics));
+	metrics_count = workers;
+	return 0;
+}
+
+Metrics *metrics_worker(int id)
+{
+	return &metrics_slots[id];
+}
+
+MetricsStatus metrics_status(int status)
+{
+	switch (status) {
+		case 200: return METRICS_STATUS_200;
+		case 206: return METRICS_STATUS_206;
+		case 304: return METRICS_STATUS_304;
+		case 400: return METRICS_STATUS_400;
+		case 404: return METRICS_STATUS_404;
+		case 405: return METRICS_STATUS_405;
+		case 406: return METRICS_STATUS_406;
+		case 411: return METRICS_STATUS_411;
+		case 413: return METRICS_STATUS_413;
+		case 414: return METRICS_STATUS_414;
+		case 416: return METRICS_STATUS_416;
+		case 500: return METRICS_STATUS_500;
+		case 501: return METRICS_STATUS_501;
+		case 503: return METRICS_STATUS_503;
+		case 505: return METRICS_STATUS_505;
+		default:  return METRICS_STATUS_OTHER;
+	}
+}
+
+/*
+ * Values below METRICS_HIST_SUB get a bucket each (group 0), after
+ * that group g holds [SUB << (g - 1), 2 * SUB << (g - 1)).
+ */
+static inline size_t hist_bucket(uint64_t us)
+{
+	if (us < METRICS_HIST_SUB)
+		return (size_t) us;
+
+	int mag = 63 - __builtin_clzll(us);
+	size_t group = (size_t) (mag - METRICS_HIST_SUB_BITS + 1);
+	if (group > METRICS_HIST_GROUPS)
+		return METRICS_HIST_BUCKETS - 1;
+
+	size_t sub = (size_t) (us >> (mag - METRICS_HIST_SUB_BITS)) - METRICS_HIST_SUB;
+	return group * METRICS_HIST_SUB + sub;
+}
+
+/*
+ * Everything in a bucket is below this (in microseconds).
+ */
+static inline uint64_t hist_bucket_end(size_t bucket)
+{
+	size_t group = bucket / METRICS_HIST_SUB;
+	size_t sub = bucket % METRICS_HIST_SUB;
+
+	if (group == 0)
+		return sub + 1;
+	return (uint64_t) (METRICS_HIST_SUB + sub + 1) << (group - 1);
+}
+
+void metrics_hist_add(MetricsHist *hist, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	metrics_add(hist->counts[hist_bucket(us)], 1);
+	metrics_add(hist->sum, us);
+}
+
+#define LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+/*
+ * Add up one histogram of every worker.
+ */
+static void hist_sum(MetricsHist *total, size_t offset)
+{
+	(void) memset(total, 0, sizeof(MetricsHist));
+
+	for (int i = 0; i < metrics_count; i++) {
+		MetricsHist *hist = (MetricsHist *) ((char *) &metrics_slots[i] + offset);
+		for (size_t b = 0; b < METRICS_HIST_BUCKETS; b++)
+			total->counts[b] += LOAD(hist->counts[b]);
+		total->sum += LOAD(hist->sum);
+	}
+}
+
+/*
+ * The end of the bucket the q'th quantile falls in, in microseconds.
+ */
+static uint64_t hist_quantile(const MetricsHist *hist, uint64_t count, double q)
+{
+	uint64_t rank = (uint64_t) (q * (double) count);
+	uint64_t seen = 0;
+
+	for (size_t b = 0; b < METRICS_HIST_BUCKETS - 1; b++) {
+		seen += hist->counts[b];
+		if (seen > rank)
+			return hist_bucket_end(b);
+	}
+	return hist_bucket_end(METRICS_HIST_BUCKETS - 2);
+}
+
+static void render_hist(FILE *out, const char *name, const char *help, size_t offset)
+{
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+	MetricsHist hist;
+	hist_sum(&hist, offset);
+
+	fprintf(out, "# HELP %s_seconds %s\n", name, help);
+	fprintf(out, "# TYPE %s_seconds histogram\n", name);
+
+	uint64_t count = 0;
+	for (size_t b = 0; b < METRICS_HIST_BUCKETS - 1; b++) {
+		count += hist.counts[b];
+		fprintf(out, "%s_seconds_bucket{le=\"%.6f\"} %llu\n", name,
+				(double) hist_bucket_end(b) / 1e6, (unsigned long long) count);
+	}
+	count += hist.counts[METRICS_HIST_BUCKETS - 1];
+	fprintf(out, "%s_seconds_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) count);
+	fprintf(out, "%s_seconds_sum %.6f\n", name, (double) hist.sum / 1e6);
+	fprintf(out, "%s_seconds_count %llu\n", name, (unsigned long long) count);
+
+	/* The usual quantiles, worked out here so they don't need a query */
+	fprintf(out, "# HELP %s_quantile_seconds Quantiles of %s_seconds (the end of their bucket).\n", name, name);
+	fprintf(out, "# TYPE %s_quantile_seconds gauge\n", name);
+	for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		double value = count ? (double) hist_quantile(&hist, count, quantiles[i]) / 1e6 : 0;
+		fprintf(out, "%s_quantile_seconds{quantile=\"%g\"} %.6f\n", name, quantiles[i], value);
+	}
+}
+
+static void render_counter(FILE *out, const char *name, const char *type, const char *help, uint64_t value)
+{
+	fprintf(out, "# HELP %s %s\n", name, help);
+	fprintf(out, "# TYPE %s %s\n", name, type);
+	fprintf(out, "%s %llu\n", name, (unsigned long long) value);
+}
+
+/*
+ * Add up one counter of every worker.
+ */
+static uint64_t counter_sum(size_t offset)
+{
+	uint64_t sum = 0;
+	for (int i = 0; i < metrics_count; i++)
+		sum += LOAD(*(uint64_t *) ((char *) &metrics_slots[i] + offset));
+	return sum;
+}
+
+#define SUM(field) counter_sum(offsetof(Metrics, field))
+
+char *metrics_render(size_t *len)
+{
+	char *buf = NULL;
+	FILE *out = open_memstream(&buf, len);
+	if (!out)
+		return NULL;
+
+	uint64_t accepted = SUM(accepted);
+	uint64_t closed = SUM(closed);
+
+	render_counter(out, "wserver_connections_accepted_total", "counter",
+			"Connections accepted.", accepted);
+	render_counter(out, "wserver_connections_active", "gauge",
+			"Connections open right now.", accepted - closed);
+	render_counter(out, "wserver_connections_timed_out_total", "counter",
+			"Connections closed because they ran out of time.", SUM(timeouts));
+	render_counter(out, "wserver_connections_rejected_total", "counter",
+			"Connections turned away with a 503 because a worker was full.", SUM(rejected));
+	render_counter(out, "wserver_received_bytes_total", "counter",
+			"Bytes received from clients.", SUM(bytes_in));
+	render_counter(out, "wserver_sent_bytes_total", "counter",
+			"Bytes sent to clients.", SUM(bytes_out));
+	render_counter(out, "wserver_parse_errors_total", "counter",
+			"Requests that couldn't be parsed.", SUM(parse_errors));
+	render_counter(out, "wserver_cache_hits_total", "counter",
+			"Files served from memory.", SUM(cache_hits));
+	render_counter(out, "wserver_cache_misses_total", "counter",
+			"Files streamed from disk.", SUM(cache_misses));
+
+	fprintf(out, "# HELP wserver_requests_total Requests answered.\n");
+	fprintf(out, "# TYPE wserver_requests_total counter\n");
+	for (int m = 0; m < METRICS_METHODS; m++) {
+		for (int s = 0; s < METRICS_STATUSES; s++) {
+			uint64_t count = SUM(requests[m][s]);
+			if (!count)
+				continue;
+			fprintf(out, "wserver_requests_total{method=\"%s\",status=\"%s\"} %llu\n",
+					metrics_methods[m], metrics_statuses[s], (unsigned long long) count);
+		}
+	}
+
+	render_hist(out, "wserver_request_parse", "Time from the first byte of a request until it was answered.",
+			offsetof(Metrics, parse_time));
+	render_hist(out, "wserver_request_duration", "Time from the first byte of a request until the last byte of its response.",
+			offsetof(Metrics, total_time));
+
+	if (fclose(out) != 0) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+void metrics_destroy(void)
+{
+	free(metrics_slots);
+	metrics_slots = NULL;
+	metrics_count = 0;
+}
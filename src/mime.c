@@ -0,0 +1,36 @@
+#include <mime.h>
+
+#include <string.h>
+#include <ctype.h>
+
+/* Built from mime.types by mimegen, see src/CMakeLists.txt */
+#include <mime_table.h>
+
+const MimeType *mime_lookup(const uint8_t *ext, size_t len)
+{
+	if (len == 0 || len > MIME_EXT_MAX)
+		return NULL;
+
+	uint8_t lower[MIME_EXT_MAX];
+	for (size_t i = 0; i < len; i++)
+		lower[i] = tolower(ext[i]);
+
+	uint32_t hash = mime_hash(lower, len);
+	uint32_t d = mime_displacements[hash & (MIME_BUCKETS - 1)];
+	const MimeExt *slot = &mime_slots[mime_displace(hash, d) & (MIME_SLOTS - 1)];
+
+	/* Every extension has exactly one slot it can be in, anything else is unknown */
+	if (slot->len != len || memcmp(slot->ext, lower, len) != 0)
+		return NULL;
+	return slot->mime;
+}
+
+const MimeType *mime_of(const char *name)
+{
+	const char *dot = strrchr(name, '.');
+	if (!dot || strchr(dot, '/'))
+		return MIME_OCTET_STREAM;
+
+	const MimeType *mime = mime_lookup((const uint8_t *) dot + 1, strlen(dot + 1));
+	return mime ? mime : MIME_OCTET_STREAM;
+}
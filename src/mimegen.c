@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include <mime.h>
+
+/*
+ * mimegen: turns mime.types into the table mime.c is built with.
+ *
+ *   mimegen mime.types mime_table.h
+ *
+ * Runs at build time (see src/CMakeLists.txt). Extensions go into a
+ * perfect hash with hash and displace: they're hashed into buckets
+ * of about four, then the biggest buckets first, every bucket gets
+ * the first displacement that puts all of its extensions into free
+ * slots.
+ */
+
+/* The longest extension taken, anything longer can't be looked up anyway */
+#define EXT_MAX (15)
+
+/* Extensions per bucket on average, and slots per extension at least */
+#define BUCKET_LOAD (4)
+#define SLOT_SPARE  (1.25)
+
+#define DISPLACE_MAX (UINT16_MAX)
+
+typedef struct {
+	char name[128];
+	const char *type;
+	int compressible;
+} Type;
+
+typedef struct {
+	char ext[EXT_MAX + 1];
+	size_t len;
+	int type;
+	uint32_t hash;
+} Ext;
+
+static Type *types;
+static int types_num, types_cap;
+
+static Ext *exts;
+static int exts_num, exts_cap;
+
+/*
+ * The AcceptTypes (see http.h) of media types Accept can name,
+ * everything else gets the wildcard it falls under.
+ */
+static const struct {
+	const char *name;
+	const char *type;
+} accept_types[] = {
+	{ "text/plain",             "ACCTYPE_TEXT_PLAIN" },
+	{ "text/html",              "ACCTYPE_TEXT_HTML" },
+	{ "text/css",               "ACCTYPE_TEXT_CSS" },
+	{ "text/javascript",        "ACCTYPE_TEXT_JAVASCRIPT" },
+	{ "application/javascript", "ACCTYPE_TEXT_JAVASCRIPT" },
+	{ "text/xml",               "ACCTYPE_TEXT_XML" },
+	{ "application/xml",        "ACCTYPE_TEXT_XML" },
+	{ "image/jpeg",             "ACCTYPE_IMAGE_JPEG" },
+	{ "image/png",              "ACCTYPE_IMAGE_PNG" },
+};
+
+/*
+ * Types that aren't text but compress well all the same.
+ */
+static const char *compressible_types[] = {
+	"application/javascript",
+	"application/json",
+	"application/x-ndjson",
+	"application/json5",
+	"application/xml",
+	"application/xml-dtd",
+	"application/wasm",
+	"application/graphql",
+	"application/postscript",
+	"application/rtf",
+	"application/x-sh",
+	"application/x-csh",
+	"application/x-perl",
+	"application/x-httpd-php",
+	"application/x-latex",
+	"application/x-texinfo",
+	"application/x-subrip",
+	"application/vnd.ms-fontobject",
+	"image/bmp",
+	"image/x-icon",
+	"image/vnd.microsoft.icon",
+	"image/x-xbitmap",
+	"image/x-xpixmap",
+	"font/ttf",
+	"font/otf",
+	"font/collection",
+	"model/obj",
+	"model/stl",
+	"model/vrml",
+};
+
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+static int ends_with(const char *s, const char *suffix)
+{
+	size_t len = strlen(s), suffix_len = strlen(suffix);
+	return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+static const char *accept_type(const char *name)
+{
+	for (size_t i = 0; i < ARRAY_LEN(accept_types); i++) {
+		if (strcmp(accept_types[i].name, name) == 0)
+			return accept_types[i].type;
+	}
+	if (strncmp(name, "text/", 5) == 0)
+		return "ACCTYPE_TEXT_ALL";
+	if (strncmp(name, "image/", 6) == 0)
+		return "ACCTYPE_IMAGE_ALL";
+	return "ACCTYPE_ALL";
+}
+
+static int compressible(const char *name)
+{
+	if (strncmp(name, "text/", 5) == 0 || ends_with(name, "+xml") || ends_with(name, "+json"))
+		return 1;
+	for (size_t i = 0; i < ARRAY_LEN(compressible_types); i++) {
+		if (strcmp(compressible_types[i], name) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+static void *grow(void *array, int *cap, size_t size)
+{
+	*cap = *cap ? *cap * 2 : 64;
+	void *bigger = realloc(array, *cap * size);
+	if (!bigger) {
+		fprintf(stderr, "mimegen: out of memory\n");
+		exit(1);
+	}
+	return bigger;
+}
+
+static int add_type(const char *name)
+{
+	if (strlen(name) >= sizeof(types[0].name))
+		return -1;
+
+	if (types_num == types_cap)
+		types = grow(types, &types_cap, sizeof(Type));
+
+	Type *type = &types[types_num];
+	(void) strcpy(type->name, name);
+	type->type = accept_type(name);
+	type->compressible = compressible(name);
+	return types_num++;
+}
+
+static int find_ext(const char *ext)
+{
+	for (int i = 0; i < exts_num; i++) {
+		if (strcmp(exts[i].ext, ext) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int add_ext(const char *ext, int type, const char *path, int line)
+{
+	size_t len = strlen(ext);
+	if (len == 0 || len > EXT_MAX) {
+		fprintf(stderr, "%s:%d: extension \"%s\" is too long\n", path, line, ext);
+		return -1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (!islower((unsigned char) ext[i]) && !isdigit((unsigned char) ext[i]) &&
+				ext[i] != '-' && ext[i] != '_' && ext[i] != '+') {
+			fprintf(stderr, "%s:%d: extension \"%s\" isn't lowercase letters and digits\n", path, line, ext);
+			return -1;
+		}
+	}
+
+	/* The first type an extension has counts */
+	if (find_ext(ext) >= 0) {
+		fprintf(stderr, "%s:%d: warning: \"%s\" is listed again, keeping the first\n", path, line, ext);
+		return 0;
+	}
+
+	if (exts_num == exts_cap)
+		exts = grow(exts, &exts_cap, sizeof(Ext));
+
+	Ext *e = &exts[exts_num++];
+	(void) strcpy(e->ext, ext);
+	e->len  = len;
+	e->type = type;
+	e->hash = mime_hash((const uint8_t *) ext, len);
+	return 0;
+}
+
+static int read_types(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		return -1;
+	}
+
+	char buf[1024];
+	int line = 0;
+	while (fgets(buf, sizeof(buf), file)) {
+		line++;
+
+		char *comment = strchr(buf, '#');
+		if (comment)
+			*comment = '\0';
+
+		char *name = strtok(buf, " \t\r\n");
+		if (!name)
+			continue;
+
+		int type = add_type(name);
+		if (type < 0) {
+			fprintf(stderr, "%s:%d: media type \"%s\" is too long\n", path, line, name);
+			goto fail;
+		}
+
+		char *ext;
+		while ((ext = strtok(NULL, " \t\r\n"))) {
+			if (add_ext(ext, type, path, line) < 0)
+				goto fail;
+		}
+	}
+
+	(void) fclose(file);
+	return 0;
+
+fail:
+	(void) fclose(file);
+	return -1;
+}
+
+static uint32_t pow2_at_least(double n)
+{
+	uint32_t p = 1;
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+static int *bucket_of;
+static int *bucket_size;
+
+static int by_bucket_size(const void *a, const void *b)
+{
+	int x = *(const int *) a, y = *(const int *) b;
+	if (bucket_size[x] != bucket_size[y])
+		return bucket_size[y] - bucket_size[x];
+	return x - y;
+}
+
+/*
+ * Find a displacement for every bucket.
+ * slot_ext[] gets the extension of every slot, -1 for free ones.
+ */
+static int build_hash(uint32_t buckets, uint32_t slots, uint16_t *displace, int *slot_ext)
+{
+	int *order = malloc(buckets * sizeof(int));
+	int *members = malloc(exts_num * sizeof(int));
+	uint32_t *taken = malloc(exts_num * sizeof(uint32_t));
+	bucket_of = malloc(exts_num * sizeof(int));
+	bucket_size = calloc(buckets, sizeof(int));
+	if (!order || !members || !taken || !bucket_of || !bucket_size) {
+		fprintf(stderr, "mimegen: out of memory\n");
+		return -1;
+	}
+
+	for (int i = 0; i < exts_num; i++) {
+		bucket_of[i] = exts[i].hash & (buckets - 1);
+		bucket_size[bucket_of[i]]++;
+	}
+	for (uint32_t b = 0; b < buckets; b++) {
+		order[b] = b;
+		displace[b] = 0;
+	}
+	for (uint32_t s = 0; s < slots; s++)
+		slot_ext[s] = -1;
+
+	/* The biggest buckets are the hardest to place, they go while there's the most room */
+	qsort(order, buckets, sizeof(int), by_bucket_size);
+
+	for (uint32_t o = 0; o < buckets && bucket_size[order[o]]; o++) {
+		int b = order[o];
+		int n = 0;
+		for (int i = 0; i < exts_num; i++) {
+			if (bucket_of[i] == b)
+				members[n++] = i;
+		}
+
+		uint32_t d;
+		for (d = 0; d <= DISPLACE_MAX; d++) {
+			int fits = 1;
+			for (int m = 0; m < n && fits; m++) {
+				taken[m] = mime_displace(exts[members[m]].hash, d) & (slots - 1);
+				if (slot_ext[taken[m]] >= 0)
+					fits = 0;
+				for (int k = 0; k < m && fits; k++)
+					fits = taken[k] != taken[m];
+			}
+			if (fits)
+				break;
+		}
+
+		if (d > DISPLACE_MAX) {
+			fprintf(stderr, "mimegen: no displacement fits bucket %d\n", b);
+			return -1;
+		}
+
+		displace[b] = d;
+		for (int m = 0; m < n; m++)
+			slot_ext[taken[m]] = members[m];
+	}
+
+	free(order);
+	free(members);
+	free(taken);
+	free(bucket_of);
+	free(bucket_size);
+	return 0;
+}
+
+static int write_table(const char *path, uint32_t buckets, uint32_t slots, const uint16_t *displace,
+		const int *slot_ext, int octet_stream)
+{
+	FILE *out = fopen(path, "w");
+	if (!out) {
+		perror(path);
+		return -1;
+	}
+
+	int *slot_of = malloc(exts_num * sizeof(int));
+	if (!slot_of) {
+		fprintf(stderr, "mimegen: out of memory\n");
+		(void) fclose(out);
+		return -1;
+	}
+	for (uint32_t s = 0; s < slots; s++) {
+		if (slot_ext[s] >= 0)
+			slot_of[slot_ext[s]] = s;
+	}
+
+	size_t ext_max = 0;
+	for (int i = 0; i < exts_num; i++) {
+		if (exts[i].len > ext_max)
+			ext_max = exts[i].len;
+	}
+
+	fprintf(out, "/* Generated by mimegen from mime.types, don't edit */\n\n");
+	fprintf(out, "#define MIME_BUCKETS (%u)\n", buckets);
+	fprintf(out, "#define MIME_SLOTS   (%u)\n", slots);
+	fprintf(out, "#define MIME_EXT_MAX (%zu)\n\n", ext_max);
+
+	fprintf(out, "static const MimeType mime_types[] = {\n");
+	for (int t = 0; t < types_num; t++) {
+		const char *charset = strncmp(types[t].name, "text/", 5) == 0 ? "; charset=utf-8" : "";
+		fprintf(out, "\t{ \"Content-Type: %s%s\\r\\n\", %zu, %s, %d },\n", types[t].name, charset,
+			strlen("Content-Type: \r\n") + strlen(types[t].name) + strlen(charset),
+			types[t].type, types[t].compressible);
+	}
+	fprintf(out, "};\n\n");
+	fprintf(out, "#define MIME_OCTET_STREAM (&mime_types[%d])\n\n", octet_stream);
+
+	fprintf(out, "static const uint16_t mime_displacements[MIME_BUCKETS] = {");
+	for (uint32_t b = 0; b < buckets; b++)
+		fprintf(out, "%s%u,", (b % 16) ? " " : "\n\t", displace[b]);
+	fprintf(out, "\n};\n\n");
+
+	fprintf(out, "static const MimeExt mime_slots[MIME_SLOTS] = {\n");
+	for (uint32_t s = 0; s < slots; s++) {
+		if (slot_ext[s] < 0)
+			continue;
+		const Ext *e = &exts[slot_ext[s]];
+		fprintf(out, "\t[%u] = { \"%s\", %zu, &mime_types[%d] },\n", s, e->ext, e->len, e->type);
+	}
+	fprintf(out, "};\n\n");
+
+	/* In the order of the file, that's the preference when Accept doesn't tell */
+	size_t negotiable = 0;
+	fprintf(out, "const MimeExt *const mime_negotiable[] = {\n");
+	for (int i = 0; i < exts_num; i++) {
+		if (strcmp(types[exts[i].type].type, "ACCTYPE_TEXT_ALL") == 0 ||
+				strcmp(types[exts[i].type].type, "ACCTYPE_IMAGE_ALL") == 0 ||
+				strcmp(types[exts[i].type].type, "ACCTYPE_ALL") == 0)
+			continue;
+		fprintf(out, "\t&mime_slots[%d], /* %s */\n", slot_of[i], exts[i].ext);
+		negotiable++;
+	}
+	fprintf(out, "};\n\n");
+	fprintf(out, "const size_t mime_negotiable_num = %zu;\n", negotiable);
+	free(slot_of);
+
+	if (fclose(out) != 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s MIME_TYPES OUTPUT\n", argv[0]);
+		return 1;
+	}
+
+	if (read_types(argv[1]) < 0)
+		return 1;
+
+	/* What unknown extensions get, it doesn't have to be listed */
+	int octet_stream = -1;
+	for (int t = 0; t < types_num; t++) {
+		if (strcmp(types[t].name, "application/octet-stream") == 0)
+			octet_stream = t;
+	}
+	if (octet_stream < 0 && (octet_stream = add_type("application/octet-stream")) < 0)
+		return 1;
+
+	if (!exts_num) {
+		fprintf(stderr, "%s: no extensions\n", argv[1]);
+		return 1;
+	}
+
+	uint32_t buckets = pow2_at_least((double) exts_num / BUCKET_LOAD);
+	uint32_t slots = pow2_at_least(exts_num * SLOT_SPARE);
+
+	uint16_t *displace = malloc(buckets * sizeof(uint16_t));
+	int *slot_ext = malloc(slots * sizeof(int));
+	if (!displace || !slot_ext) {
+		fprintf(stderr, "mimegen: out of memory\n");
+		return 1;
+	}
+
+	if (build_hash(buckets, slots, displace, slot_ext) < 0)
+		return 1;
+	if (write_table(argv[2], buckets, slots, displace, slot_ext, octet_stream) < 0)
+		return 1;
+
+	free(displace);
+	free(slot_ext);
+	return 0;
+}
@@ -0,0 +1,146 @@
+#include <output.h>
+#include <io.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/uio.h>
+
+static inline OutputSegment *output_push(OutputQueue *queue)
+{
+	if (queue->count == OUTPUT_MAX_SEGMENTS)
+		return NULL;
+	return output_seg(queue, queue->count++);
+}
+
+static inline void output_pop(OutputQueue *queue)
+{
+	OutputSegment *seg = output_seg(queue, 0);
+	if (seg->owned)
+		free((void *) seg->buf);
+	seg->owned = 0;
+	seg->buf = NULL;
+
+	queue->head = (queue->head + 1) % OUTPUT_MAX_SEGMENTS;
+	queue->count--;
+}
+
+int output_push_mem(OutputQueue *queue, const uint8_t *buf, size_t len, int owned)
+{
+	if (len == 0) {
+		if (owned)
+			free((void *) buf);
+		return 0;
+	}
+
+	OutputSegment *seg = output_push(queue);
+	if (!seg)
+		return -1;
+
+	seg->type  = OUTPUT_MEM;
+	seg->owned = owned;
+	seg->buf   = buf;
+	seg->fd    = -1;
+	seg->off   = 0;
+	seg->len   = len;
+
+	queue->queued += len;
+	return 0;
+}
+
+int output_push_file(OutputQueue *queue, int fd, off_t off, size_t len)
+{
+	if (len == 0)
+		return 0;
+
+	OutputSegment *seg = output_push(queue);
+	if (!seg)
+		return -1;
+
+	seg->type  = OUTPUT_FILE;
+	seg->owned = 0;
+	seg->buf   = NULL;
+	seg->fd    = fd;
+	seg->off   = off;
+	seg->len   = len;
+
+	queue->queued += len;
+	return 0;
+}
+
+void output_advance(OutputQueue *queue, size_t sent)
+{
+	queue->sent += sent;
+
+	while (sent) {
+		OutputSegment *seg = output_seg(queue, 0);
+		size_t n = (sent < seg->len) ? sent : seg->len;
+
+		seg->off += n;
+		seg->len -= n;
+		sent     -= n;
+
+		if (seg->len == 0)
+			output_pop(queue);
+	}
+}
+
+int output_gather(OutputQueue *queue, struct iovec *iov)
+{
+	int iov_len = 0;
+
+	for (int i = 0; i < queue->count; i++) {
+		OutputSegment *seg = output_seg(queue, i);
+		if (seg->type != OUTPUT_MEM)
+			break;
+		iov[iov_len].iov_base = (void *) (seg->buf + seg->off);
+		iov[iov_len].iov_len  = seg->len;
+		iov_len++;
+	}
+
+	return iov_len;
+}
+
+/*
+ * Gather every memory segment at the front of the queue
+ * into one writev().
+ */
+static inline ssize_t output_send_mem(OutputQueue *queue, int sock)
+{
+	struct iovec iov[OUTPUT_MAX_SEGMENTS];
+	return writev(sock, iov, output_gather(queue, iov));
+}
+
+int output_flush(OutputQueue *queue, int sock)
+{
+	while (queue->count) {
+		OutputSegment *seg = output_seg(queue, 0);
+		ssize_t sent;
+
+		if (seg->type == OUTPUT_MEM)
+			sent = output_send_mem(queue, sock);
+		else
+			sent = io_sendfile(sock, seg->fd, seg->off, seg->len);
+
+		if (sent > 0) {
+			output_advance(queue, sent);
+			continue;
+		}
+
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (sent < 0 && errno == EINTR)
+			continue;
+
+		/* The socket died, or a file shrunk underneath us */
+		return -1;
+	}
+
+	return 1;
+}
+
+void output_clear(OutputQueue *queue)
+{
+	while (queue->count)
+		output_pop(queue);
+	queue->head = 0;
+}
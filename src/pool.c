@@ -0,0 +1,86 @@
+#include <pool.h>
+
+#include <stdlib.h>
+
+/*
+ * Objects are cache line aligned so neighbours never share a line.
+ */
+#define POOL_ALIGN (64)
+
+#define ALIGN_UP(n, a) (((n) + (a) - 1) & ~((size_t) (a) - 1))
+
+typedef struct PoolSlab {
+	struct PoolSlab *next;
+} PoolSlab;
+
+void pool_init(Pool *pool, size_t obj_size, size_t per_slab)
+{
+	if (obj_size < sizeof(void *))
+		obj_size = sizeof(void *);
+
+	pool->obj_size = ALIGN_UP(obj_size, POOL_ALIGN);
+	pool->per_slab = per_slab ? per_slab : 1;
+	pool->free     = NULL;
+	pool->slabs    = NULL;
+	pool->in_use   = 0;
+}
+
+/*
+ * Allocate a new slab and put all of its objects on the freelist.
+ */
+static int pool_grow(Pool *pool)
+{
+	size_t header = ALIGN_UP(sizeof(PoolSlab), POOL_ALIGN);
+
+	PoolSlab *slab = aligned_alloc(POOL_ALIGN, header + pool->obj_size * pool->per_slab);
+	if (!slab)
+		return -1;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+
+	/* Link them up back to front, so they're handed out in order */
+	char *objs = (char *) slab + header;
+	for (size_t i = pool->per_slab; i-- > 0; ) {
+		void *obj = objs + i * pool->obj_size;
+		*(void **) obj = pool->free;
+		pool->free = obj;
+	}
+
+	return 0;
+}
+
+void *pool_get(Pool *pool)
+{
+	if (!pool->free && pool_grow(pool) < 0)
+		return NULL;
+
+	void *obj = pool->free;
+	pool->free = *(void **) obj;
+	pool->in_use++;
+	return obj;
+}
+
+void pool_put(Pool *pool, void *obj)
+{
+	if (!obj)
+		return;
+
+	*(void **) obj = pool->free;
+	pool->free = obj;
+	pool->in_use--;
+}
+
+void pool_destroy(Pool *pool)
+{
+	PoolSlab *slab = pool->slabs;
+	while (slab) {
+		PoolSlab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
+
+	pool->free   = NULL;
+	pool->slabs  = NULL;
+	pool->in_use = 0;
+}
@@ -1,185 +1,1303 @@
 #include <resource.h>
 #include <config.h>
+#include <settings.h>
 #include <log.h>
 
-typedef struct ResourceLL {
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+
+#if WSERVER_LIVE_RELOAD && defined(__linux__)
+#include <sys/inotify.h>
+#define WSERVER_USE_INOTIFY (1)
+#endif
+
+#if WSERVER_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if WSERVER_HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+typedef struct {
 	char *path;
+	uint32_t path_len;
+	uint32_t hash;
 	Resource resource;
-	struct ResourceLL *next;
-} ResourceLL;
+} ResourceEntry;
+
+/*
+ * A slot of the open addressing index. The hash is kept next to
+ * the entry index so most probes never touch the entry itself.
+ * idx is the entry index + 1, 0 marks an empty slot.
+ */
+typedef struct {
+	uint32_t hash;
+	uint32_t idx;
+} ResourceSlot;
+
+/*
+ * A snapshot of the document root.
+ *
+ * Tables never change once they are published. The watcher copies
+ * the current table, patches the copy and swaps it in, while the
+ * workers keep reading whatever table they had until they reach a
+ * quiescent point (see resource_quiesce()).
+ *
+ * Unchanged entries are shared between tables by value. An entry
+ * that is replaced or removed goes onto the retired list of the
+ * table it was last live in, and is freed along with that table.
+ * Every table holds a reference on the table that replaced it, so
+ * tables are always reclaimed oldest first: a retired entry can't
+ * be freed while an older table might still point at it.
+ */
+struct ResourceTable {
+	atomic_long refs;
+	struct ResourceTable *_Atomic next;
+
+	/* Every resource, stored contiguously */
+	ResourceEntry *entries;
+	uint32_t count;
+	uint32_t cap;
+
+	/* Index into entries, always a power of two, at most half full */
+	ResourceSlot *slots;
+	uint32_t mask;
+
+	/* Entries that stopped being live in the next table */
+	ResourceEntry *retired;
+	uint32_t retired_count;
+	uint32_t retired_cap;
+
+	/* Set on the last table at shutdown, it also owns its live entries */
+	uint8_t final;
+};
 
-static FTS *resource_root;
-static ResourceLL *resource_start;
+/*
+ * Root of the document tree, request paths are relative to it.
+ * File system paths start with the root, cutting off
+ * resource_root_len gives the request path.
+ */
+static const char *resource_root_path;
+static size_t resource_root_len;
 
-static inline ResourceLL *allocate_resource_ll(void)
+/*
+ * The newest table. Only swapped by the watcher (under the lock),
+ * workers only take it under the lock when they have nothing yet.
+ */
+static ResourceTable *resource_current;
+static pthread_mutex_t resource_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The table the calling thread reads from */
+static _Thread_local ResourceTable *resource_local;
+
+/*
+ * Memory used by cached file bodies so far.
+ * Only touched by resource_init() and the watcher.
+ */
+static size_t resource_cache_used;
+
+/*
+ * Memory used by variants compressed here, same as above.
+ */
+static size_t resource_compress_used;
+
+/*
+ * By HttpEncoding: the name in Content-Encoding, and what a file
+ * precompressed in that coding is called (the original + suffix).
+ */
+static const struct {
+	const char *name;
+	const char *suffix;
+} resource_encodings[HTTP_ENCODINGS] = {
+	[HTTP_ENCODING_GZIP] = { "gzip", ".gz" },
+	[HTTP_ENCODING_BR]   = { "br",   ".br" },
+};
+
+/*
+ * Files smaller than this aren't worth compressing.
+ */
+#define COMPRESS_MIN_SIZE (256)
+
+#if WSERVER_USE_INOTIFY
+static int resource_inotify_fd = -1;
+static pthread_t resource_watcher;
+static int resource_watcher_running;
+
+/* Watched directory paths, indexed by watch descriptor */
+static char **resource_watch_paths;
+static int resource_watch_cap;
+#endif
+
+/*
+ * FNV-1a over a request path, stopping at the query string
+ * just like the lookup does. Also gives back the length hashed.
+ */
+static inline uint32_t hash_step(uint32_t hash, uint8_t c)
 {
-	ResourceLL *new_resource;
-	if (!(new_resource = calloc(1, sizeof(ResourceLL)))) {
+	return (hash ^ c) * 16777619u;
+}
+
+static inline uint32_t resource_hash(const uint8_t *path, uint32_t len, uint32_t *hashed_len)
+{
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+	for (i = 0; i < len && path[i] != '?'; i++)
+		hash = hash_step(hash, path[i]);
+	*hashed_len = i;
+	return hash;
+}
+
+/*
+ * Read a whole file into a buffer.
+ */
+static inline int read_whole(int fd, uint8_t *buf, size_t size)
+{
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = pread(fd, buf + done, size - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static inline uint64_t stat_mtime_ns(const struct stat *s)
+{
+#ifdef __APPLE__
+	return (uint64_t) s->st_mtimespec.tv_sec * 1000000000 + (uint64_t) s->st_mtimespec.tv_nsec;
+#else
+	return (uint64_t) s->st_mtim.tv_sec * 1000000000 + (uint64_t) s->st_mtim.tv_nsec;
+#endif
+}
+
+/*
+ * A strong ETag out of the file the bytes of a variant come from:
+ * any change to it changes the inode, mtime or size. Variants that
+ * were compressed here add their coding to the original's.
+ */
+static void variant_etag(ResourceVariant *variant, const struct stat *s, HttpEncoding encoding)
+{
+	int len = snprintf(variant->etag, sizeof(variant->etag), "\"%" PRIx64 "-%" PRIx64 "-%" PRIx64 "%s%s\"",
+		(uint64_t) s->st_ino, stat_mtime_ns(s), (uint64_t) s->st_size,
+		encoding != HTTP_ENCODING_IDENTITY ? "-" : "",
+		encoding != HTTP_ENCODING_IDENTITY ? resource_encodings[encoding].name : "");
+	variant->etag_len = (len > 0 && (size_t) len < sizeof(variant->etag)) ? len : 0;
+}
+
+/*
+ * Build the prebuilt responses of a variant (fd, size and the ETag
+ * have to be set): the 200 and the 304 after it. A body that's passed
+ * in (a compressed one) is always kept. A file's body is cached along
+ * with it if the file is small enough and there's still room in the
+ * cache.
+ */
+static int variant_prepare(const Resource *resource, ResourceVariant *variant, HttpEncoding encoding,
+		int vary, const uint8_t *body)
+{
+	char date[HTTP_DATE_LEN + 1];
+	http_format_date(date, resource->last_modified);
+
+	/* What both have to say about the body */
+	char validators[256];
+	int validators_len = snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-Modified: %s\r\n%s",
+			variant->etag, date, vary ? "Vary: Accept-Encoding\r\n" : "");
+	if (validators_len < 0 || (size_t) validators_len >= sizeof(validators))
+		return -1;
+
+	/*
+	 * Content-Type has to come first, multipart responses leave it
+	 * out. Ranges are only served of the identity variant, see
+	 * answer_request().
+	 */
+	char extra[384];
+	if (encoding != HTTP_ENCODING_IDENTITY)
+		(void) snprintf(extra, sizeof(extra), "%sContent-Encoding: %s\r\n%s", resource->mime->line,
+				resource_encodings[encoding].name, validators);
+	else
+		(void) snprintf(extra, sizeof(extra), "%sAccept-Ranges: bytes\r\n%s", resource->mime->line,
+				validators);
+
+	char headers[512];
+	int header_len = http_response_headers_extra(headers, sizeof(headers), 200, variant->size, extra);
+	if (header_len < 0 || (size_t) header_len >= sizeof(headers))
+		return -1;
+
+	char not_modified[512];
+	int not_modified_len = http_response_headers_extra(not_modified, sizeof(not_modified), 304,
+			variant->size, validators);
+	if (not_modified_len < 0 || (size_t) not_modified_len >= sizeof(not_modified))
+		return -1;
+
+	int cache = body ||
+		(variant->size <= (size_t) wserver_settings->cache_max_file * 1024 &&
+		 resource_cache_used + variant->size <= (size_t) wserver_settings->cache_max_size * 1024);
+
+	size_t response_len = header_len + (cache ? variant->size : 0);
+	uint8_t *response = malloc(response_len + not_modified_len);
+	if (!response) {
 		log_error("ran out of memory for resources!\n");
+		return -1;
+	}
+
+	(void) memcpy(response, headers, header_len);
+	if (body) {
+		(void) memcpy(response + header_len, body, variant->size);
+		resource_compress_used += variant->size;
+	} else if (cache) {
+		if (read_whole(variant->fd, response + header_len, variant->size) < 0) {
+			cache = 0;
+			response_len = header_len;
+		} else {
+			resource_cache_used += variant->size;
+		}
+	}
+	(void) memcpy(response + response_len, not_modified, not_modified_len);
+
+	variant->response         = response;
+	variant->header_len       = header_len;
+	variant->response_len     = response_len;
+	variant->cached           = cache;
+	variant->fields_off       = strstr(headers, extra) - headers;
+	variant->not_modified     = response + response_len;
+	variant->not_modified_len = not_modified_len;
+	return 0;
+}
+
+#if WSERVER_HAVE_ZLIB
+static size_t compress_gzip(const uint8_t *in, size_t len, uint8_t *out, size_t cap)
+{
+	z_stream zs;
+	(void) memset(&zs, 0, sizeof(zs));
+
+	/* 16 + the window bits asks for a gzip header instead of zlib's */
+	if (deflateInit2(&zs, WSERVER_GZIP_LEVEL, Z_DEFLATED, 16 + 15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+
+	zs.next_in   = (Bytef *) in;
+	zs.avail_in  = len;
+	zs.next_out  = out;
+	zs.avail_out = cap;
+
+	size_t out_len = (deflate(&zs, Z_FINISH) == Z_STREAM_END) ? zs.total_out : 0;
+	(void) deflateEnd(&zs);
+	return out_len;
+}
+#endif
+
+#if WSERVER_HAVE_BROTLI
+static size_t compress_br(const uint8_t *in, size_t len, uint8_t *out, size_t cap)
+{
+	size_t out_len = cap;
+	if (!BrotliEncoderCompress(WSERVER_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+			len, in, &out_len, out))
+		return 0;
+	return out_len;
+}
+#endif
+
+/*
+ * Compress a file into an in-memory variant. Returns the size of
+ * the compressed body, 0 if it wasn't smaller (or the coding isn't
+ * compiled in).
+ */
+static size_t compress_body(HttpEncoding encoding, const uint8_t *in, size_t len, uint8_t *out, size_t cap)
+{
+	switch (encoding) {
+#if WSERVER_HAVE_ZLIB
+		case HTTP_ENCODING_GZIP:
+			return compress_gzip(in, len, out, cap);
+#endif
+#if WSERVER_HAVE_BROTLI
+		case HTTP_ENCODING_BR:
+			return compress_br(in, len, out, cap);
+#endif
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Open the precompressed file of a coding next to fs_path.
+ */
+static int variant_open(const Resource *resource, ResourceVariant *variant, const char *fs_path,
+		HttpEncoding encoding)
+{
+	char path[PATH_MAX];
+	int len = snprintf(path, sizeof(path), "%s%s", fs_path, resource_encodings[encoding].suffix);
+	if (len < 0 || (size_t) len >= sizeof(path))
+		return -1;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	struct stat s;
+	if (fstat(fd, &s) < 0 || !S_ISREG(s.st_mode)) {
+		close(fd);
+		return -1;
+	}
+
+	variant->fd = fd;
+	variant->size = s.st_size;
+	variant_etag(variant, &s, HTTP_ENCODING_IDENTITY);
+	if (variant_prepare(resource, variant, encoding, 1, NULL) < 0) {
+		close(fd);
+		variant->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Find or make the coded variants of a text file: a precompressed
+ * file next to it wins, the others are compressed here once, for as
+ * long as there's room for them.
+ */
+static void entry_encode(ResourceEntry *entry, const char *fs_path, const struct stat *s)
+{
+	Resource *resource = &entry->resource;
+	ResourceVariant *identity = &resource->variants[HTTP_ENCODING_IDENTITY];
+	int missing = 0;
+
+	for (int e = HTTP_ENCODING_IDENTITY + 1; e < HTTP_ENCODINGS; e++) {
+		if (variant_open(resource, &resource->variants[e], fs_path, e) < 0)
+			missing = 1;
+	}
+
+	size_t budget = (size_t) wserver_settings->compress_max_size * 1024;
+	if (!missing || !wserver_settings->compress || identity->size < COMPRESS_MIN_SIZE ||
+			identity->size > UINT32_MAX || resource_compress_used + identity->size > budget)
+		return;
+
+	/* Only worth it if it's smaller */
+	uint8_t *in = malloc(identity->size);
+	uint8_t *out = malloc(identity->size);
+	if (!in || !out || read_whole(identity->fd, in, identity->size) < 0)
+		goto done;
+
+	for (int e = HTTP_ENCODING_IDENTITY + 1; e < HTTP_ENCODINGS; e++) {
+		ResourceVariant *variant = &resource->variants[e];
+		if (variant->response)
+			continue;
+
+		size_t out_len = compress_body(e, in, identity->size, out, identity->size - 1);
+		if (!out_len || resource_compress_used + out_len > budget)
+			continue;
+
+		variant->size = out_len;
+		variant_etag(variant, s, e);
+		if (variant_prepare(resource, variant, e, 1, out) < 0)
+			log_error("failed to keep the %s variant of %s\n", resource_encodings[e].name, entry->path);
+	}
+
+done:
+	free(in);
+	free(out);
+}
+
+/*
+ * Give back what an entry's variants took from the caches.
+ */
+static void entry_uncount(ResourceEntry *entry)
+{
+	for (int e = 0; e < HTTP_ENCODINGS; e++) {
+		ResourceVariant *variant = &entry->resource.variants[e];
+		if (!variant->cached)
+			continue;
+		if (variant->fd >= 0)
+			resource_cache_used -= variant->size;
+		else
+			resource_compress_used -= variant->size;
+	}
+}
+
+/*
+ * Free everything an entry owns.
+ */
+static void entry_free(ResourceEntry *entry)
+{
+	free(entry->path);
+	for (int e = 0; e < HTTP_ENCODINGS; e++) {
+		ResourceVariant *variant = &entry->resource.variants[e];
+		if (variant->fd >= 0)
+			close(variant->fd);
+		free(variant->response);
+	}
+}
+
+/*
+ * Load a file into an entry (not yet part of any table).
+ */
+static int entry_load(ResourceEntry *entry, const char *fs_path)
+{
+	(void) memset(entry, 0, sizeof(ResourceEntry));
+	for (int e = 0; e < HTTP_ENCODINGS; e++)
+		entry->resource.variants[e].fd = -1;
+
+	/*
+	 * Skip the root of the path, for example:
+	 * ./test
+	 * would be
+	 * /test
+	 */
+	const char *path = fs_path + resource_root_len;
+	entry->path = strdup(path);
+	if (!entry->path) {
+		log_error("ran out of memory for resources!\n");
+		return -1;
+	}
+
+	ResourceVariant *identity = &entry->resource.variants[HTTP_ENCODING_IDENTITY];
+	struct stat s;
+
+	entry->hash = resource_hash((const uint8_t *) path, strlen(path), &entry->path_len);
+	identity->fd = open(fs_path, O_RDONLY);
+	if (identity->fd < 0) {
+		log_error("open(%s) failed: %s\n", fs_path, strerror(errno));
+		entry_free(entry);
+		return -1;
+	}
+	if (fstat(identity->fd, &s) < 0 || !S_ISREG(s.st_mode)) {
+		log_error("failed to prepare resource %s\n", path);
+		entry_free(entry);
+		return -1;
+	}
+	identity->size = s.st_size;
+	variant_etag(identity, &s, HTTP_ENCODING_IDENTITY);
+	entry->resource.mime = mime_of(entry->path);
+	entry->resource.last_modified = s.st_mtime;
+
+	/* Only text and the like are worth compressing, everything else already is */
+	if (entry->resource.mime->compressible)
+		entry_encode(entry, fs_path, &s);
+
+	/* The response depends on Accept-Encoding as soon as there's a choice */
+	int vary = 0;
+	for (int e = HTTP_ENCODING_IDENTITY + 1; e < HTTP_ENCODINGS; e++)
+		vary |= entry->resource.variants[e].response != NULL;
+
+	if (variant_prepare(&entry->resource, identity, HTTP_ENCODING_IDENTITY, vary, NULL) < 0) {
+		log_error("failed to prepare resource %s\n", path);
+		entry_uncount(entry);
+		entry_free(entry);
+		return -1;
+	}
+
+	return 0;
+}
+
+static ResourceTable *table_alloc(uint32_t cap, uint32_t slots)
+{
+	ResourceTable *table = calloc(1, sizeof(ResourceTable));
+	if (!table)
+		goto no_mem;
+
+	atomic_init(&table->refs, 1);
+	atomic_init(&table->next, NULL);
+
+	table->cap = cap;
+	table->entries = malloc(cap * sizeof(ResourceEntry));
+	table->slots = calloc(slots, sizeof(ResourceSlot));
+	table->mask = slots - 1;
+	if (!table->entries || !table->slots)
+		goto no_mem;
+
+	return table;
+
+no_mem:
+	log_error("ran out of memory for resources!\n");
+	if (table) {
+		free(table->entries);
+		free(table->slots);
+		free(table);
+	}
+	return NULL;
+}
+
+static void table_free(ResourceTable *table)
+{
+	for (uint32_t i = 0; i < table->retired_count; i++)
+		entry_free(&table->retired[i]);
+	if (table->final) {
+		for (uint32_t i = 0; i < table->count; i++)
+			entry_free(&table->entries[i]);
+	}
+
+	free(table->retired);
+	free(table->entries);
+	free(table->slots);
+	free(table);
+}
+
+static inline void table_ref(ResourceTable *table)
+{
+	atomic_fetch_add_explicit(&table->refs, 1, memory_order_relaxed);
+}
+
+/*
+ * Drop a reference. The last one frees the table, which in turn
+ * drops the reference it held on its successor.
+ */
+static void table_release(ResourceTable *table)
+{
+	while (table) {
+		if (atomic_fetch_sub_explicit(&table->refs, 1, memory_order_acq_rel) != 1)
+			return;
+
+		ResourceTable *next = atomic_load_explicit(&table->next, memory_order_acquire);
+		table_free(table);
+		table = next;
+	}
+}
+
+/*
+ * Take an entry out of circulation. It lives on until the
+ * table it was live in (old) is reclaimed. Entries that were
+ * never published (no old table) are freed straight away.
+ */
+static void table_retire(ResourceTable *old, ResourceEntry *entry)
+{
+	entry_uncount(entry);
+
+	if (!old) {
+		entry_free(entry);
+		return;
+	}
+
+	if (old->retired_count == old->retired_cap) {
+		uint32_t cap = old->retired_cap ? old->retired_cap * 2 : 16;
+		ResourceEntry *retired = realloc(old->retired, cap * sizeof(ResourceEntry));
+		if (!retired) {
+			/* Leaking beats freeing something a worker might still use */
+			log_error("ran out of memory retiring %s\n", entry->path);
+			return;
+		}
+		old->retired = retired;
+		old->retired_cap = cap;
+	}
+
+	old->retired[old->retired_count++] = *entry;
+}
+
+static void table_reindex(ResourceTable *table, ResourceSlot *slots, uint32_t size)
+{
+	free(table->slots);
+	table->slots = slots;
+	table->mask = size - 1;
+
+	for (uint32_t i = 0; i < table->count; i++) {
+		uint32_t pos = table->entries[i].hash & table->mask;
+		while (table->slots[pos].idx)
+			pos = (pos + 1) & table->mask;
+		table->slots[pos].hash = table->entries[i].hash;
+		table->slots[pos].idx  = i + 1;
+	}
+}
+
+/*
+ * Find the slot of a path.
+ * Returns UINT32_MAX if there's no such resource.
+ */
+static uint32_t table_find(ResourceTable *table, const uint8_t *path, uint32_t len)
+{
+	uint32_t path_len;
+	uint32_t hash = resource_hash(path, len, &path_len);
+
+	for (uint32_t pos = hash & table->mask; table->slots[pos].idx; pos = (pos + 1) & table->mask) {
+		if (table->slots[pos].hash != hash)
+			continue;
+
+		ResourceEntry *entry = &table->entries[table->slots[pos].idx - 1];
+		if (entry->path_len == path_len && memcmp(entry->path, path, path_len) == 0)
+			return pos;
+	}
+
+	return UINT32_MAX;
+}
+
+static int table_insert(ResourceTable *table, ResourceEntry *entry)
+{
+	if (table->count == table->cap) {
+		uint32_t cap = table->cap * 2;
+		ResourceEntry *entries = realloc(table->entries, cap * sizeof(ResourceEntry));
+		if (!entries) {
+			log_error("ran out of memory for resources!\n");
+			return -1;
+		}
+		table->entries = entries;
+		table->cap = cap;
+	}
+
+	uint32_t size = table->mask + 1;
+	if ((table->count + 1) * 2 > size) {
+		ResourceSlot *slots = calloc(size * 2, sizeof(ResourceSlot));
+		if (!slots) {
+			log_error("ran out of memory for the resource index!\n");
+			return -1;
+		}
+		table_reindex(table, slots, size * 2);
+	}
+
+	uint32_t idx = table->count++;
+	table->entries[idx] = *entry;
+
+	uint32_t pos = entry->hash & table->mask;
+	while (table->slots[pos].idx)
+		pos = (pos + 1) & table->mask;
+	table->slots[pos].hash = entry->hash;
+	table->slots[pos].idx  = idx + 1;
+	return 0;
+}
+
+/*
+ * Remove the entry at a slot, retiring it into old.
+ */
+static void table_remove(ResourceTable *table, ResourceTable *old, uint32_t pos)
+{
+	uint32_t idx = table->slots[pos].idx - 1;
+	table_retire(old, &table->entries[idx]);
+
+	/* Backward shift deletion, keeps every probe chain intact */
+	uint32_t hole = pos;
+	for (uint32_t i = (pos + 1) & table->mask; table->slots[i].idx; i = (i + 1) & table->mask) {
+		uint32_t home = table->slots[i].hash & table->mask;
+		int stays = (hole <= i) ? (hole < home && home <= i) : (hole < home || home <= i);
+		if (stays)
+			continue;
+		table->slots[hole] = table->slots[i];
+		hole = i;
+	}
+	table->slots[hole].hash = 0;
+	table->slots[hole].idx  = 0;
+
+	/* Keep the entries contiguous by moving the last one in */
+	uint32_t last = table->count - 1;
+	if (idx != last) {
+		uint32_t i = table->entries[last].hash & table->mask;
+		while (table->slots[i].idx != last + 1)
+			i = (i + 1) & table->mask;
+		table->slots[i].idx = idx + 1;
+		table->entries[idx] = table->entries[last];
+	}
+	table->count--;
+}
+
+/*
+ * Copy a table, sharing every entry.
+ */
+static ResourceTable *table_clone(ResourceTable *table)
+{
+	ResourceTable *clone = table_alloc(table->count + 64, table->mask + 1);
+	if (!clone)
 		return NULL;
+
+	clone->count = table->count;
+	(void) memcpy(clone->entries, table->entries, table->count * sizeof(ResourceEntry));
+	(void) memcpy(clone->slots, table->slots, (table->mask + 1) * sizeof(ResourceSlot));
+	return clone;
+}
+
+/*
+ * (Re)load one file into a table that isn't published yet.
+ */
+static void table_update(ResourceTable *table, ResourceTable *old, const char *fs_path)
+{
+	ResourceEntry entry;
+	if (entry_load(&entry, fs_path) < 0) {
+		/* Whatever was there before isn't valid anymore */
+		const char *path = fs_path + resource_root_len;
+		uint32_t pos = table_find(table, (const uint8_t *) path, strlen(path));
+		if (pos != UINT32_MAX)
+			table_remove(table, old, pos);
+		return;
 	}
 
-	new_resource->resource.fd = -1;
+	uint32_t pos = table_find(table, (const uint8_t *) entry.path, entry.path_len);
+	if (pos != UINT32_MAX) {
+		ResourceEntry *live = &table->entries[table->slots[pos].idx - 1];
+		table_retire(old, live);
+		*live = entry;
+		return;
+	}
 
-	return new_resource;
+	if (table_insert(table, &entry) < 0)
+		table_retire(NULL, &entry);
 }
 
-static const struct file_ext {
-	const char *s;
-	AcceptType t;
-} file_extensions[] = {
-	{"txt",   ACCTYPE_TEXT_PLAIN},
-	{"html",  ACCTYPE_TEXT_HTML},
-	{"htm",   ACCTYPE_TEXT_HTML},
-	{"css",   ACCTYPE_TEXT_CSS},
-	{"js",    ACCTYPE_TEXT_JAVASCRIPT},
-	{"xml",   ACCTYPE_TEXT_XML},
+#if WSERVER_USE_INOTIFY
+/*
+ * A .gz / .br file is also a variant of the file next to it,
+ * that one is reloaded along with it.
+ */
+static void table_update_base(ResourceTable *table, ResourceTable *old, const char *fs_path)
+{
+	size_t len = strlen(fs_path);
 
-	{"jpeg",  ACCTYPE_IMAGE_JPEG},
-	{"jpg",   ACCTYPE_IMAGE_JPEG},
-	{"png",   ACCTYPE_IMAGE_PNG},
-};
+	for (int e = HTTP_ENCODING_IDENTITY + 1; e < HTTP_ENCODINGS; e++) {
+		const char *suffix = resource_encodings[e].suffix;
+		size_t suffix_len = strlen(suffix);
+		if (len <= resource_root_len + suffix_len || strcmp(fs_path + len - suffix_len, suffix) != 0)
+			continue;
 
-#define FILE_EXT_NUM (sizeof(file_extensions) / sizeof(struct file_ext))
-
-static inline AcceptType get_file_type(char *name)
-{
-	char *file_ext = name;
-	for (; *file_ext != '\0'; file_ext++);
-	for (; file_ext != name && *file_ext != '.'; file_ext--);
-	if (file_ext == name) {
-		// Ex. "test"
-		// would be considered plain text
-		return ACCTYPE_TEXT_PLAIN;
-	} else {
-		file_ext++;
-		for (size_t i = 0; i < FILE_EXT_NUM; i++) {
-			if (strcmp(file_extensions[i].s, file_ext) == 0)
-				return file_extensions[i].t;
+		char base[PATH_MAX];
+		(void) memcpy(base, fs_path, len - suffix_len);
+		base[len - suffix_len] = '\0';
+
+		const char *path = base + resource_root_len;
+		if (table_find(table, (const uint8_t *) path, strlen(path)) != UINT32_MAX)
+			table_update(table, old, base);
+		return;
+	}
+}
+
+static void watch_add(const char *dir)
+{
+	const uint32_t mask =
+		IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+		IN_MOVED_TO | IN_ONLYDIR;
+
+	int wd = inotify_add_watch(resource_inotify_fd, dir, mask);
+	if (wd < 0) {
+		log_error("inotify_add_watch(%s) failed: %s\n", dir, strerror(errno));
+		return;
+	}
+
+	if (wd >= resource_watch_cap) {
+		int cap = resource_watch_cap ? resource_watch_cap : 64;
+		while (cap <= wd)
+			cap *= 2;
+		char **paths = realloc(resource_watch_paths, cap * sizeof(char *));
+		if (!paths) {
+			log_error("ran out of memory watching %s\n", dir);
+			return;
 		}
+		(void) memset(paths + resource_watch_cap, 0, (cap - resource_watch_cap) * sizeof(char *));
+		resource_watch_paths = paths;
+		resource_watch_cap = cap;
 	}
 
-	// TODO: uhh fix this
-	return ACCTYPE_TEXT_PLAIN;
+	/* Events are joined as dir + "/" + name, so no slash at the end */
+	size_t len = strlen(dir);
+	while (len > 0 && dir[len - 1] == '/')
+		len--;
+
+	/* The same directory (moved around) gives back the same wd */
+	free(resource_watch_paths[wd]);
+	resource_watch_paths[wd] = strndup(dir, len);
 }
 
-int resource_init(void)
+/*
+ * Forget every watch on a directory and everything under it.
+ */
+static void watch_remove_tree(const char *dir)
 {
-	char *root_path[] = {".", NULL};
+	size_t len = strlen(dir);
+	for (int wd = 0; wd < resource_watch_cap; wd++) {
+		char *path = resource_watch_paths[wd];
+		if (!path || strncmp(path, dir, len) != 0)
+			continue;
+		if (path[len] != '\0' && path[len] != '/')
+			continue;
+
+		(void) inotify_rm_watch(resource_inotify_fd, wd);
+		free(path);
+		resource_watch_paths[wd] = NULL;
+	}
+}
+#endif
+
+/*
+ * Walk a directory and (re)load every file in it.
+ */
+static int table_scan(ResourceTable *table, ResourceTable *old, const char *dir)
+{
+	char *root_path[] = {(char *) dir, NULL};
 	int fts_opts = FTS_COMFOLLOW | FTS_LOGICAL | FTS_NOCHDIR;
 
-	resource_root = fts_open((char * const *) root_path, fts_opts, NULL);
-	if (!resource_root) {
+	FTS *root = fts_open((char * const *) root_path, fts_opts, NULL);
+	if (!root) {
 		log_error("failed to load resources: fts_open(): %s\n", strerror(errno));
 		return -1;
 	}
 
-	if (!fts_children(resource_root, 0))
-		return 0;
+	FTSENT *idx;
+	while ((idx = fts_read(root))) {
+		switch (idx->fts_info) {
+#if WSERVER_USE_INOTIFY
+			case FTS_D:
+				watch_add(idx->fts_path);
+				break;
+#endif
+			case FTS_F:
+				table_update(table, old, idx->fts_path);
+				break;
+		}
+	}
 
-	resource_start = allocate_resource_ll();
-	if (!resource_start)
-		return -1;
+	fts_close(root);
+	return 0;
+}
 
-	ResourceLL **chosen = &resource_start;
-				
-	FTSENT *idx;
-	while ((idx = fts_read(resource_root))) {
-		if (idx->fts_info == FTS_F) {
-			if (!(*chosen)) {
-				*chosen = allocate_resource_ll();
-				if (!(*chosen))
-					continue;
-			}
+/*
+ * Remove everything under a directory.
+ */
+static void table_remove_tree(ResourceTable *table, ResourceTable *old, const char *dir)
+{
+	const char *prefix = dir + resource_root_len;
+	size_t len = strlen(prefix);
 
-			/*
-			 * Skip the + 1 on pathlen because
-			 * we're skipping the preceding dot of the path.
-			 *
-			 * for example:
-			 * ./test
-			 * would be
-			 * /test
-			 */
-			char *path = calloc(idx->fts_pathlen, 1);
-			if (!path) {
-				free(*chosen);
-				*chosen = NULL;
-				continue;
-			}
+	for (uint32_t i = table->count; i-- > 0; ) {
+		ResourceEntry *entry = &table->entries[i];
+		if (strncmp(entry->path, prefix, len) != 0 || entry->path[len] != '/')
+			continue;
 
-			(void) strcpy(path, idx->fts_path + 1);
+		uint32_t pos = table_find(table, (const uint8_t *) entry->path, entry->path_len);
+		if (pos != UINT32_MAX)
+			table_remove(table, old, pos);
+	}
+}
 
-			(*chosen)->path = path;
-			(*chosen)->resource.fd = open(idx->fts_path, O_RDONLY);
-			if ((*chosen)->resource.fd < 0) {
-				log_error("open(%s) failed: %s\n", path, strerror(errno));
-				free(path);
-				free(*chosen);
-				*chosen = NULL;
-				continue;
-			}
-			(*chosen)->resource.type = get_file_type(path);
+/*
+ * Swap in a new table. The old one goes away once the
+ * last worker moved past it.
+ */
+static void table_publish(ResourceTable *table)
+{
+	pthread_mutex_lock(&resource_lock);
+	ResourceTable *old = resource_current;
+	if (old) {
+		/* One reference for resource_current, one for old->next */
+		table_ref(table);
+		atomic_store_explicit(&old->next, table, memory_order_release);
+	}
+	resource_current = table;
+	pthread_mutex_unlock(&resource_lock);
+
+	if (old)
+		table_release(old);
+}
+
+#if WSERVER_USE_INOTIFY
+static void watch_apply(ResourceTable *table, ResourceTable *old, struct inotify_event *ev)
+{
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/* We lost track of what changed, start over */
+		log_write("inotify queue overflowed, rescanning resources\n");
+		for (uint32_t i = 0; i < table->count; i++)
+			table_retire(old, &table->entries[i]);
+		table->count = 0;
+		(void) memset(table->slots, 0, (table->mask + 1) * sizeof(ResourceSlot));
+		(void) table_scan(table, old, resource_root_path);
+		return;
+	}
+
+	if (ev->mask & IN_IGNORED) {
+		if (ev->wd < resource_watch_cap) {
+			free(resource_watch_paths[ev->wd]);
+			resource_watch_paths[ev->wd] = NULL;
+		}
+		return;
+	}
+
+	if (ev->wd < 0 || ev->wd >= resource_watch_cap || !resource_watch_paths[ev->wd] || !ev->len)
+		return;
+
+	char fs_path[PATH_MAX];
+	int len = snprintf(fs_path, sizeof(fs_path), "%s/%s", resource_watch_paths[ev->wd], ev->name);
+	if (len < 0 || (size_t) len >= sizeof(fs_path))
+		return;
 
-			chosen = &(*chosen)->next;
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			watch_remove_tree(fs_path);
+			table_remove_tree(table, old, fs_path);
 		}
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+			(void) table_scan(table, old, fs_path);
+		return;
 	}
 
+	if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+		const char *path = fs_path + resource_root_len;
+		uint32_t pos = table_find(table, (const uint8_t *) path, strlen(path));
+		if (pos != UINT32_MAX)
+			table_remove(table, old, pos);
+	}
+	if (ev->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO))
+		table_update(table, old, fs_path);
+
+	table_update_base(table, old, fs_path);
+}
+
+/*
+ * The watcher thread. Every read() gives a batch of changes,
+ * which are all patched into one new table.
+ */
+static void *resource_watch(void *arg)
+{
+	(void) arg;
+
+	char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	for ( ;; ) {
+		ssize_t len = read(resource_inotify_fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			log_error("inotify read() failed: %s\n", strerror(errno));
+			return NULL;
+		}
+
+		int state;
+		(void) pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+		/* Only this thread ever swaps resource_current */
+		ResourceTable *old = resource_current;
+		ResourceTable *table = table_clone(old);
+		if (table) {
+			for (char *p = buf; p < buf + len; ) {
+				struct inotify_event *ev = (struct inotify_event *) p;
+				watch_apply(table, old, ev);
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+			table_publish(table);
+		}
+
+		(void) pthread_setcancelstate(state, NULL);
+	}
+
+	return NULL;
+}
+#endif
+
+int resource_init(void)
+{
+	/* fts gives back paths as root + "/...", drop the slashes at the end */
+	resource_root_path = wserver_settings->root;
+	resource_root_len = strlen(resource_root_path);
+	while (resource_root_len > 0 && resource_root_path[resource_root_len - 1] == '/')
+		resource_root_len--;
+
+	struct stat st;
+	if (stat(resource_root_path, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		log_error("document root %s isn't a directory\n", resource_root_path);
+		return -1;
+	}
+
+	ResourceTable *table = table_alloc(64, 128);
+	if (!table)
+		return -1;
+
+#if WSERVER_USE_INOTIFY
+	if (wserver_settings->live_reload) {
+		resource_inotify_fd = inotify_init1(IN_CLOEXEC);
+		if (resource_inotify_fd < 0)
+			log_error("inotify_init1() failed, resources won't be reloaded: %s\n", strerror(errno));
+	}
+#endif
+
+	if (table_scan(table, NULL, resource_root_path) < 0) {
+		table_free(table);
+		return -1;
+	}
+
+	table_publish(table);
+
+#if WSERVER_USE_INOTIFY
+	if (resource_inotify_fd >= 0) {
+		int error = pthread_create(&resource_watcher, NULL, resource_watch, NULL);
+		if (error)
+			log_error("failed to start resource watcher: %s\n", strerror(error));
+		else
+			resource_watcher_running = 1;
+	}
+#endif
+
 	return 0;
 }
 
+void resource_quiesce(void)
+{
+	ResourceTable *table = resource_local;
+
+	if (!table) {
+		pthread_mutex_lock(&resource_lock);
+		table = resource_current;
+		if (table)
+			table_ref(table);
+		pthread_mutex_unlock(&resource_lock);
+
+		resource_local = table;
+		return;
+	}
+
+	ResourceTable *next = atomic_load_explicit(&table->next, memory_order_acquire);
+	if (!next)
+		return;
+
+	/*
+	 * Everything after our table is kept alive by it,
+	 * so the chain can be walked without the lock.
+	 */
+	ResourceTable *newer;
+	while ((newer = atomic_load_explicit(&next->next, memory_order_acquire)))
+		next = newer;
+
+	table_ref(next);
+	resource_local = next;
+	table_release(table);
+}
+
+ResourceTable *resource_pin(void)
+{
+	ResourceTable *table = resource_local;
+	if (table)
+		table_ref(table);
+	return table;
+}
+
+void resource_unpin(ResourceTable *table)
+{
+	if (table)
+		table_release(table);
+}
+
 void resource_list(void)
 {
-	struct ResourceLL *idx;
-	for (idx = resource_start; idx != NULL; idx = idx->next)
-		log_write("resource: %s\n", idx->path);
+	pthread_mutex_lock(&resource_lock);
+	ResourceTable *table = resource_current;
+	for (uint32_t i = 0; table && i < table->count; i++) {
+		ResourceEntry *entry = &table->entries[i];
+		const ResourceVariant *variants = entry->resource.variants;
+
+		char codings[64];
+		size_t len = 0;
+		codings[0] = '\0';
+		for (int e = HTTP_ENCODING_IDENTITY + 1; e < HTTP_ENCODINGS; e++) {
+			if (variants[e].response && len < sizeof(codings))
+				len += snprintf(codings + len, sizeof(codings) - len, ", %s %zu",
+						resource_encodings[e].name, variants[e].size);
+		}
+
+		log_write("resource: %s (%zu bytes%s%s)\n",
+			entry->path, variants[HTTP_ENCODING_IDENTITY].size,
+			variants[HTTP_ENCODING_IDENTITY].cached ? ", cached" : "", codings);
+	}
+	pthread_mutex_unlock(&resource_lock);
 }
 
-static int resource_cmp(ResourceLL *resource, uint8_t *path, uint8_t len)
+/*
+ * If-None-Match: "*" or a list of entity tags, compared the weak
+ * way (a W/ in front doesn't matter), like the RFC says for GET.
+ */
+static int etag_listed(const ResourceVariant *variant, const uint8_t *list, uint32_t len)
 {
-	char *rpath = resource->path;
-	uint8_t pcount = 0;
-	while (*rpath != '\0' && pcount < len && *path != '?') {
-		if (*rpath != *path)
-			return 0;
-		rpath++;
-		pcount++;
-		path++;
+	const uint8_t *end = list + len;
+
+	while (list < end) {
+		const uint8_t *elem_end = memchr(list, ',', end - list);
+		if (!elem_end)
+			elem_end = end;
+
+		const uint8_t *tag = list;
+		const uint8_t *tag_end = elem_end;
+		for (; tag < tag_end && (*tag == ' ' || *tag == '\t'); tag++);
+		for (; tag_end > tag && (tag_end[-1] == ' ' || tag_end[-1] == '\t'); tag_end--);
+
+		if (tag_end - tag == 1 && *tag == '*')
+			return 1;
+		if (tag_end - tag >= 2 && tag[0] == 'W' && tag[1] == '/')
+			tag += 2;
+		if (variant->etag_len && (size_t) (tag_end - tag) == variant->etag_len &&
+				memcmp(tag, variant->etag, variant->etag_len) == 0)
+			return 1;
+
+		list = elem_end + (elem_end < end);
 	}
+	return 0;
+}
 
-	if (*rpath == '\0' && (pcount == len || *path == '?'))
-		return 1;
+int resource_not_modified(const Resource *resource, const ResourceVariant *variant, const HttpRequest *req)
+{
+	if (req->if_none_match)
+		return etag_listed(variant, req->if_none_match, req->if_none_match_len);
+	if (req->if_modified_since)
+		return resource->last_modified <= req->if_modified_since;
 	return 0;
 }
 
-Resource *resource_get(uint8_t *path, uint8_t len)
+/*
+ * If-Range: the client's copy is still good if it has the ETag
+ * (compared the strong way, a weak one never matches) or the date
+ * of the last change.
+ */
+static int if_range_matches(const Resource *resource, const ResourceVariant *variant, const HttpRequest *req)
 {
-	struct ResourceLL *idx = resource_start;
-	while (idx) {
-		if (resource_cmp(idx, path, len))
-			return &idx->resource;
+	if (req->if_range_len && req->if_range[0] == '"')
+		return variant->etag_len && req->if_range_len == variant->etag_len &&
+			memcmp(req->if_range, variant->etag, variant->etag_len) == 0;
+	return http_parse_date(req->if_range, req->if_range_len) == resource->last_modified;
+}
 
-		idx = idx->next;
+int resource_ranges(const Resource *resource, const ResourceVariant *variant, const HttpRequest *req,
+		HttpRange *ranges)
+{
+	if (!req->ranges_len || req->method != HTTP_GET)
+		return 0;
+	if (req->if_range && !if_range_matches(resource, variant, req))
+		return 0;
+
+	uint64_t size = variant->size;
+	int n = 0;
+
+	for (int i = 0; i < req->ranges_len; i++) {
+		HttpRange range = req->ranges[i];
+
+		if (range.suffix) {
+			if (!range.last || !size)
+				continue;
+			range.first = (range.last < size) ? size - range.last : 0;
+			range.last = size - 1;
+			range.suffix = 0;
+		} else {
+			if (range.first >= size)
+				continue;
+			if (range.last >= size)
+				range.last = size - 1;
+		}
+
+		int j = n++;
+		for (; j > 0 && ranges[j - 1].first > range.first; j--)
+			ranges[j] = ranges[j - 1];
+		ranges[j] = range;
 	}
 
-	return NULL;
+	if (!n)
+		return -1;
+
+	/* Asking for the same bytes over and over doesn't get them sent more than once */
+	int merged = 0;
+	for (int i = 1; i < n; i++) {
+		if (ranges[i].first <= ranges[merged].last + 1) {
+			if (ranges[i].last > ranges[merged].last)
+				ranges[merged].last = ranges[i].last;
+		} else {
+			ranges[++merged] = ranges[i];
+		}
+	}
+	return merged + 1;
 }
 
-void resource_destroy(void)
+Resource *resource_get(uint8_t *path, uint16_t len)
+{
+	ResourceTable *table = resource_local;
+	if (!table) {
+		resource_quiesce();
+		if (!(table = resource_local))
+			return NULL;
+	}
+
+	uint32_t pos = table_find(table, path, len);
+	if (pos == UINT32_MAX)
+		return NULL;
+	return &table->entries[table->slots[pos].idx - 1].resource;
+}
+
+int resource_negotiate(uint8_t *path, uint16_t len, const AcceptField *accept, Resource **resource)
 {
-	if (!resource_start) return;
+	ResourceTable *table = resource_local;
+	*resource = NULL;
+	if (!table)
+		return 404;
+
+	uint32_t stem_len;
+	uint32_t stem_hash = resource_hash(path, len, &stem_len);
 
-	struct ResourceLL *tmp;
-	while (resource_start) {
-		tmp = resource_start->next;
-		if (resource_start->path)
-			free(resource_start->path);
-		if (resource_start->resource.fd >= 0)
-			close(resource_start->resource.fd);
-		free(resource_start);
-		resource_start = tmp;
+	/* Only a file name without an extension, "/logo" but not "/logo.png" or "/img/" */
+	if (!stem_len || path[stem_len - 1] == '/')
+		return 404;
+	for (uint32_t i = stem_len; i > 0 && path[i - 1] != '/'; i--) {
+		if (path[i - 1] == '.')
+			return 404;
 	}
+	stem_hash = hash_step(stem_hash, '.');
 
-	fts_close(resource_root);
+	Resource *best = NULL;
+	int best_rank = 0;
+	int found = 0;
+
+	for (size_t i = 0; i < mime_negotiable_num; i++) {
+		const MimeExt *ext = mime_negotiable[i];
+		uint32_t hash = stem_hash;
+		for (uint32_t c = 0; c < ext->len; c++)
+			hash = hash_step(hash, ext->ext[c]);
+
+		/* table_find() of the stem and the extension, without putting them together */
+		for (uint32_t pos = hash & table->mask; table->slots[pos].idx; pos = (pos + 1) & table->mask) {
+			if (table->slots[pos].hash != hash)
+				continue;
+
+			ResourceEntry *entry = &table->entries[table->slots[pos].idx - 1];
+			if (entry->path_len != stem_len + 1 + ext->len || memcmp(entry->path, path, stem_len) != 0 ||
+					entry->path[stem_len] != '.' || memcmp(entry->path + stem_len + 1, ext->ext, ext->len) != 0)
+				continue;
+
+			found = 1;
+			int rank = http_accept_rank(accept, entry->resource.mime->type);
+			if (rank >= 0 && (!best || rank < best_rank)) {
+				best = &entry->resource;
+				best_rank = rank;
+			}
+			break;
+		}
+	}
+
+	*resource = best;
+	if (best)
+		return 200;
+	return found ? 406 : 404;
 }
 
+void resource_destroy(void)
+{
+#if WSERVER_USE_INOTIFY
+	if (resource_watcher_running) {
+		(void) pthread_cancel(resource_watcher);
+		(void) pthread_join(resource_watcher, NULL);
+		resource_watcher_running = 0;
+	}
+	if (resource_inotify_fd >= 0)
+		close(resource_inotify_fd);
+	resource_inotify_fd = -1;
+
+	for (int wd = 0; wd < resource_watch_cap; wd++)
+		free(resource_watch_paths[wd]);
+	free(resource_watch_paths);
+	resource_watch_paths = NULL;
+	resource_watch_cap = 0;
+#endif
+
+	pthread_mutex_lock(&resource_lock);
+	ResourceTable *table = resource_current;
+	resource_current = NULL;
+	pthread_mutex_unlock(&resource_lock);
+
+	if (resource_local) {
+		table_release(resource_local);
+		resource_local = NULL;
+	}
+
+	if (table) {
+		table->final = 1;
+		table_release(table);
+	}
+
+	resource_cache_used = 0;
+	resource_compress_used = 0;
+}
@@ -0,0 +1,182 @@
+#include <scan.h>
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WSERVER_SCAN_X86 (1)
+#endif
+
+#define IS_TOKEN(c) ((c) > 32 && (c) < 127)
+
+/*
+ * Plain C, used for the tails of the vector versions too.
+ */
+
+static const uint8_t *scalar_cr(const uint8_t *p, const uint8_t *end)
+{
+	for (; p != end && *p != '\r'; p++);
+	return p;
+}
+
+static const uint8_t *scalar_token(const uint8_t *p, const uint8_t *end)
+{
+	for (; p != end && IS_TOKEN(*p); p++);
+	return p;
+}
+
+#if WSERVER_SCAN_X86
+
+/*
+ * SSE4.2: pcmpestri does the matching, it gives back the index of
+ * the first match in a 16 byte block (or 16 if there is none).
+ */
+
+#define SSE_CR_FLAGS \
+	(_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT)
+
+#define SSE_TOKEN_FLAGS \
+	(_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | \
+	 _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT)
+
+__attribute__((target("sse4.2")))
+static const uint8_t *sse42_cr(const uint8_t *p, const uint8_t *end)
+{
+	const __m128i cr = _mm_setr_epi8('\r', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		int idx = _mm_cmpestri(cr, 1, v, 16, SSE_CR_FLAGS);
+		if (idx != 16)
+			return p + idx;
+	}
+	return scalar_cr(p, end);
+}
+
+__attribute__((target("sse4.2")))
+static const uint8_t *sse42_token(const uint8_t *p, const uint8_t *end)
+{
+	const __m128i range = _mm_setr_epi8(33, 126, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) p);
+		int idx = _mm_cmpestri(range, 2, v, 16, SSE_TOKEN_FLAGS);
+		if (idx != 16)
+			return p + idx;
+	}
+	return scalar_token(p, end);
+}
+
+/*
+ * AVX2: compare 32 bytes at once, movemask and count the zeros.
+ */
+
+__attribute__((target("avx2")))
+static const uint8_t *avx2_cr(const uint8_t *p, const uint8_t *end)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	return scalar_cr(p, end);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *avx2_token(const uint8_t *p, const uint8_t *end)
+{
+	/*
+	 * Signed compares: everything >= 128 is negative,
+	 * so it fails the > 32 check like it should.
+	 */
+	const __m256i lo = _mm256_set1_epi8(32);
+	const __m256i hi = _mm256_set1_epi8(127);
+
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) p);
+		__m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo), _mm256_cmpgt_epi8(hi, v));
+		unsigned mask = ~(unsigned) _mm256_movemask_epi8(ok);
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	return scalar_token(p, end);
+}
+
+#endif // WSERVER_SCAN_X86
+
+const uint8_t *(*scan_cr)(const uint8_t *, const uint8_t *)    = scalar_cr;
+const uint8_t *(*scan_token)(const uint8_t *, const uint8_t *) = scalar_token;
+
+typedef struct {
+	const char *name;
+	int (*supported)(void);
+	const uint8_t *(*cr)(const uint8_t *, const uint8_t *);
+	const uint8_t *(*token)(const uint8_t *, const uint8_t *);
+} ScanImpl;
+
+#if WSERVER_SCAN_X86
+/* __builtin_cpu_supports() only takes a string literal */
+static int avx2_supported(void)  { return __builtin_cpu_supports("avx2"); }
+static int sse42_supported(void) { return __builtin_cpu_supports("sse4.2"); }
+#endif
+
+/*
+ * Fastest first.
+ */
+static const ScanImpl scan_impls[] = {
+#if WSERVER_SCAN_X86
+	{ "avx2",   avx2_supported,  avx2_cr,   avx2_token },
+	{ "sse4.2", sse42_supported, sse42_cr,  sse42_token },
+#endif
+	{ "scalar", NULL,            scalar_cr, scalar_token },
+};
+
+#define NUM_SCAN_IMPLS (sizeof(scan_impls) / sizeof(scan_impls[0]))
+
+static const char *scan_impl = "scalar";
+
+static inline int impl_supported(const ScanImpl *impl)
+{
+#if WSERVER_SCAN_X86
+	__builtin_cpu_init();
+#endif
+	return !impl->supported || impl->supported();
+}
+
+static inline void impl_use(const ScanImpl *impl)
+{
+	scan_cr    = impl->cr;
+	scan_token = impl->token;
+	scan_impl  = impl->name;
+}
+
+void scan_init(void)
+{
+	for (size_t i = 0; i < NUM_SCAN_IMPLS; i++) {
+		if (impl_supported(&scan_impls[i])) {
+			impl_use(&scan_impls[i]);
+			return;
+		}
+	}
+}
+
+int scan_use(const char *name)
+{
+	for (size_t i = 0; i < NUM_SCAN_IMPLS; i++) {
+		if (strcmp(scan_impls[i].name, name))
+			continue;
+		if (!impl_supported(&scan_impls[i]))
+			return -1;
+		impl_use(&scan_impls[i]);
+		return 0;
+	}
+	return -1;
+}
+
+const char *scan_impl_name(void)
+{
+	return scan_impl;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,44 +7,234 @@
 
 #include <fcntl.h>
 #include <unistd.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
 
-#if defined(__FreeBSD__) || defined(__NetBSD__) || \
-	defined(__OpenBSD__) || defined(__DragonFly__) || \
-	(defined(__APPLE__) && defined(__MACH__))
+#ifdef __linux__
+#include <sched.h>
+#endif
 
-#define WSERVER_USE_KQUEUE (1)
+#include <http.h>
+#include <log.h>
+#include <resource.h>
+#include <event.h>
+#include <scan.h>
+#include <output.h>
+#include <pool.h>
+#include <uring.h>
+#include <config.h>
+#include <settings.h>
+#include <metrics.h>
+#include <timer.h>
 
-#else
+/*
+ * Every worker is its own reactor: it owns a listening socket
+ * (bound with SO_REUSEPORT so the kernel balances connections
+ * between them), an event queue and all of its connections.
+ * Nothing is shared between workers on the hot path.
+ */
+typedef struct {
+	pthread_t thread;
+	int id;
+
+	/* Listening socket */
+	int lsocket;
+
+	/* Event file descriptor */
+	int efd;
+
+	/* Connection objects and receive buffers, reused */
+	Pool connections;
+	Pool buffers;
+
+	/* Access log lines waiting on their response */
+	Pool access;
+
+	/* Only written by this worker */
+	Metrics *metrics;
+
+	/*
+	 * Open connections. Accepting is paused while the worker is
+	 * full (or out of file descriptors), until fewer than
+	 * paused_at are left.
+	 */
+	uint32_t nconns;
+	uint32_t paused_at;
+	uint8_t accept_paused;
+
+	/* Deadlines of the connections, and the time the loop woke up (ms) */
+	TimerWheel timers;
+	uint64_t now_ms;
+
+#if WSERVER_HAVE_URING
+	/* Only used by the io_uring backend */
+	Uring ring;
+	struct UringRx *rx;
+	struct Connection *starved;
+	uint8_t bufs_returned;
+	uint8_t accept_armed;
+	uint8_t accept_cancelling;
+#endif
+} Worker;
 
-#error "WServer currently only supports the KQUEUE event system."
+static Worker *wserver_workers;
+static int wserver_nworkers;
 
-#endif
+/*
+ * 1 if the workers run on io_uring instead of event.h.
+ */
+static int wserver_use_uring;
+
+/*
+ * 1 if every response goes into the access log.
+ */
+static int wserver_access_log;
 
-#if WSERVER_USE_KQUEUE
-#include <sys/event.h>
+/*
+ * 1 if WSERVER_METRICS_PATH is served.
+ */
+static int wserver_metrics;
+
+/*
+ * 1 if requests are timed, for either of the above.
+ */
+static int wserver_timing;
+
+/*
+ * A client connection, this is what the event system
+ * hands back to us through udata.
+ */
+typedef struct Connection {
+	int fd;
+	HttpRequest request;
+
+	/*
+	 * Everything of the response that the socket hasn't
+	 * taken yet. Only drained when the socket is writable.
+	 */
+	OutputQueue out;
+
+	/*
+	 * The resource snapshot the queued response points into,
+	 * pinned while it waits on the socket.
+	 */
+	ResourceTable *pinned;
+
+	/* EVENT_READ or EVENT_WRITE, whatever is registered right now */
+	uint32_t interest;
+
+	/* Close once everything queued went out */
+	uint8_t closing;
+
+	/* The client is done sending, close once everything is answered */
+	uint8_t eof;
+
+	/*
+	 * The deadline of what the connection waits on, which of the
+	 * TIMEOUT_* that is, and the requests answered when it was set
+	 * (see connection_timeout()).
+	 */
+	Timer timer;
+	uint8_t timeout;
+	uint32_t answered;
+	uint32_t timeout_answered;
+
+	/*
+	 * Access log only: the responses waiting for their last byte
+	 * to go out, when the request being parsed started coming in
+	 * (0 if it didn't yet), when bytes last came in, and who the
+	 * client is.
+	 */
+	struct PendingAccess *access_head;
+	struct PendingAccess *access_tail;
+	uint64_t req_start;
+	uint64_t recv_time;
+	uint8_t peer_family;
+	uint8_t peer[16];
+
+#if WSERVER_HAVE_URING
+	/*
+	 * io_uring only: received buffers that weren't copied into
+	 * the request buffer yet, linked through worker->rx.
+	 */
+	uint16_t rx_head;
+	uint16_t rx_tail;
+	uint16_t rx_count;
+
+	/* Submissions that still post a completion */
+	uint16_t inflight;
+
+	/* SQEs left of the send chain in flight, 0 if none */
+	uint8_t sending;
+
+	uint8_t recv_armed;
+	uint8_t cancelling;
+	uint8_t starved;
+	uint8_t dead;
+	struct Connection *next_starved;
+
+	/* Files are spliced through a pipe, made once it's needed */
+	int pipe[2];
+	uint32_t pipe_size;
+	uint32_t piped;
+
+	/* Has to stay put while the sendmsg is in flight */
+	struct msghdr msg;
+	struct iovec iov[OUTPUT_MAX_SEGMENTS];
 #endif
+} Connection;
 
+/*
+ * The size of a receive buffer, every request has to fit in one.
+ */
+#define RECV_BUF_SIZE ((uint32_t) wserver_settings->max_buf * 1024)
 
-#include <http.h>
-#include <log.h>
-#include <resource.h>
-#include <config.h>
+/*
+ * How many objects the pools allocate at once.
+ */
+#define CONN_PER_SLAB   (64)
+#define BUFS_PER_SLAB   (16)
+#define ACCESS_PER_SLAB (64)
 
-/* Listening socket */
-static int wserver_lsocket = -1;
+/*
+ * An access log line of a response that's still being sent.
+ * Its bytes are start to end of everything ever queued on the
+ * connection (see OutputQueue), it's done once those went out.
+ */
+typedef struct PendingAccess {
+	struct PendingAccess *next;
+	uint64_t start;
+	uint64_t end;
+	uint64_t req_start;
+	AccessRecord rec;
+} PendingAccess;
+
+/*
+ * The most segments answer_request() queues for one response,
+ * but for multipart ones: a negotiated status line, the prebuilt
+ * response and the body from the file.
+ */
+#define RESPONSE_MAX_SEGMENTS (3)
 
-/* Event file descriptor */
-static int wserver_efd     = -1;
+/*
+ * A multipart/byteranges response takes a part header and a body
+ * for every range, and the closing boundary.
+ */
+#define MULTIRANGE_SEGMENTS(n) (2 * (n) + 1)
+#if MULTIRANGE_SEGMENTS(HTTP_MAX_RANGES) > OUTPUT_MAX_SEGMENTS
+#error "HTTP_MAX_RANGES ranges don't fit into an output queue"
+#endif
 
 /*
  * ASCII art from patorjk.com
@@ -57,13 +249,22 @@ static const char *wserver_title_text =
 "    \\_/\\_/   |____/ |_____||_| \\_\\  \\_/   |_____||_| \\_\\\n"
 "\tIt's a web server!\n";
 
+static inline int make_nonblock(int asocket)
+{
+	int fl = fcntl(asocket, F_GETFL, 0);
+	if (fl < 0) return fl;
+	if (fcntl(asocket, F_SETFL, fl | O_NONBLOCK) < 0)
+		return -1;
+	return 0;
+}
+
 /*
  * Set the socket options for the listening socket.
  */
-static inline int lsocket_set_opts(void)
+static inline int lsocket_set_opts(Worker *worker)
 {
 	if (setsockopt(
-			wserver_lsocket,
+			worker->lsocket,
 			SOL_SOCKET,
 			SO_REUSEADDR,
 			&(int){1},
@@ -72,13 +273,40 @@ static inline int lsocket_set_opts(void)
 		return -1;
 	}
 
+	/*
+	 * Every worker binds its own listening socket to the same port.
+	 * FreeBSD only load balances between them with SO_REUSEPORT_LB.
+	 */
+#ifdef SO_REUSEPORT_LB
+	const int reuseport = SO_REUSEPORT_LB;
+	const char *reuseport_name = "SO_REUSEPORT_LB";
+#else
+	const int reuseport = SO_REUSEPORT;
+	const char *reuseport_name = "SO_REUSEPORT";
+#endif
+
 	if (setsockopt(
-			wserver_lsocket,
+			worker->lsocket,
 			SOL_SOCKET,
-			SO_REUSEPORT,
+			reuseport,
+			&(int){1},
+			sizeof(int)) < 0) {
+		log_error("setsockopt(%s) failed: %s\n", reuseport_name, strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * Responses go out in one write (or one chain), Nagle only holds
+	 * back the next one behind a delayed ACK. Accepted sockets
+	 * inherit this from the listening socket.
+	 */
+	if (setsockopt(
+			worker->lsocket,
+			IPPROTO_TCP,
+			TCP_NODELAY,
 			&(int){1},
 			sizeof(int)) < 0) {
-		log_error("setsockopt(SO_REUSEPORT) failed: %s\n", strerror(errno));
+		log_error("setsockopt(TCP_NODELAY) failed: %s\n", strerror(errno));
 		return -1;
 	}
 
@@ -88,10 +316,11 @@ static inline int lsocket_set_opts(void)
 /*
  * Initialize the listening socket based on configuration.
  */
-static inline int lsocket_init(void)
+static inline int lsocket_init(Worker *worker)
 {
 	struct addrinfo hint;
 	struct addrinfo *ll, *start;
+	char port[8];
 	int error;
 
 	memset(&hint, 0, sizeof(hint));
@@ -99,31 +328,33 @@ static inline int lsocket_init(void)
 	hint.ai_family   = AF_INET;
 	hint.ai_socktype = SOCK_STREAM;
 
-	if ((error = getaddrinfo(NULL, WSERVER_PORT, &hint, &start)) != 0) {
+	(void) snprintf(port, sizeof(port), "%d", wserver_settings->port);
+
+	if ((error = getaddrinfo(NULL, port, &hint, &start)) != 0) {
 		log_error("getaddrinfo() failed: %s\n", gai_strerror(error));
 		return -1;
 	}
 
 	for (ll = start; ll != NULL; ll = ll->ai_next) {
-		wserver_lsocket = socket(
+		worker->lsocket = socket(
 			ll->ai_family,
 			ll->ai_socktype,
 			ll->ai_protocol
 		);
-		if (wserver_lsocket < 0) {
+		if (worker->lsocket < 0) {
 			log_write("socket() failed: %s\n", strerror(errno));
 			continue;
 		}
 
-		if (lsocket_set_opts() < 0) {
+		if (lsocket_set_opts(worker) < 0) {
 			log_write("setsocketopt()'s failed: %s\n", strerror(errno));
-			close(wserver_lsocket);
+			close(worker->lsocket);
 			continue;
 		}
 
-		if (bind(wserver_lsocket, ll->ai_addr, ll->ai_addrlen) < 0) {
+		if (bind(worker->lsocket, ll->ai_addr, ll->ai_addrlen) < 0) {
 			log_write("bind() failed: %s\n", strerror(errno));
-			close(wserver_lsocket);
+			close(worker->lsocket);
 			continue;
 		}
 
@@ -134,15 +365,23 @@ static inline int lsocket_init(void)
 
 	if (ll == NULL) {
 		log_error("failed to find socket.\n");
-		wserver_lsocket = -1;
+		worker->lsocket = -1;
 		return -1;
 	}
 
 
-	if (listen(wserver_lsocket, WSERVER_MAX_CON) < 0) {
+	if (listen(worker->lsocket, wserver_settings->backlog) < 0) {
 		log_error("listen() failed: %s\n", strerror(errno));
-		close(wserver_lsocket);
-		wserver_lsocket = -1;
+		close(worker->lsocket);
+		worker->lsocket = -1;
+		return -1;
+	}
+
+	/* Events are edge-triggered, accept() until it runs dry */
+	if (make_nonblock(worker->lsocket) < 0) {
+		log_error("failed to make listening socket nonblocking: %s\n", strerror(errno));
+		close(worker->lsocket);
+		worker->lsocket = -1;
 		return -1;
 	}
 
@@ -153,299 +392,1868 @@ static inline int lsocket_init(void)
 /*
  * Initialize the event system.
  */
-static inline int event_init(void)
+static inline int event_init(Worker *worker)
 {
-	wserver_efd = kqueue();
-	if (wserver_efd < 0) {
-		log_error("kqueue() failed: %s\n", strerror(errno));
+	worker->efd = event_create();
+	if (worker->efd < 0) {
+		log_error("event_create() failed: %s\n", strerror(errno));
 		return -1;
 	}
 
-	const struct kevent add_event = {
-		.ident  = wserver_lsocket,
-		.filter = EVFILT_READ,
-		.flags  = EV_ADD,
-		.fflags = 0,
-		.data   = 0,
-		.udata  = NULL
-	};
-	if (kevent(wserver_efd, &add_event, 1, NULL, 0, NULL) < 0) {
-		log_error("kevent() failed, unable to add listening socket to queue.\n");
-		close(wserver_efd);
+	/* The listening socket is the only one registered without udata */
+	if (event_add(worker->efd, worker->lsocket, EVENT_READ, NULL) < 0) {
+		log_error("event_add() failed, unable to add listening socket to queue.\n");
+		event_destroy(worker->efd);
+		worker->efd = -1;
 		return -1;
 	}
 
 	return 0;
 }
 
+static inline int is_metrics_path(HttpRequest *req)
+{
+	return req->path_len == sizeof(WSERVER_METRICS_PATH) - 1 &&
+		!memcmp(req->path, WSERVER_METRICS_PATH, req->path_len);
+}
+
 /*
- * Read a buffer from a resource
+ * Answer with the metrics of every worker.
+ * Returns -1 if that couldn't be done.
  */
-static inline void *read_resource(Resource *resource, size_t *size)
+static int answer_metrics(Connection *conn, int head)
 {
-	int rfd = resource->fd;
-	if (rfd < 0)
-		return NULL;
+	size_t body_len;
+	char *body = metrics_render(&body_len);
+	if (!body)
+		return -1;
 
-	struct stat s;
-	if (fstat(rfd, &s) < 0)
-		return NULL;
+	char headers[256];
+	int header_len = snprintf(headers, sizeof(headers),
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: Keep-Alive\r\n"
+		"Server: WServer\r\n"
+		"\r\n",
+		body_len
+	);
+
+	size_t response_len = header_len + (head ? 0 : body_len);
+	uint8_t *response = malloc(response_len);
+	if (!response) {
+		free(body);
+		return -1;
+	}
 
-	*size = s.st_size;
+	(void) memcpy(response, headers, header_len);
+	if (!head)
+		(void) memcpy(response + header_len, body, body_len);
+	free(body);
 
-	void *buf = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, rfd, 0);
-	if (buf == MAP_FAILED)
-		return NULL;
-	return buf;
+	(void) output_push_mem(&conn->out, response, response_len, 1);
+	return 0;
 }
 
 /*
- * Answer a request on a connection
+ * Queue a response without a body, with extra header lines
+ * (each ending in CRLF). If it's the last one on the connection,
+ * it says so.
  */
-static void answer_request(int asocket, HttpRequest *req)
-{
-	if (!req) return;
-
-	if (req->method == HTTP_GET) {
-		int status = 200;
-		Resource *resource = NULL;
-		uint8_t *buf = NULL;
-		size_t content_len = 0;
-
-		if (req->parser_status) {
-			status = req->parser_status;
-		} else {
-			resource = resource_get(req->path, req->path_len);
-			if (resource) {
-				buf = read_resource(resource, &content_len);
-			} else {
-				content_len = 0;
-				status = 404;
-			}
-		}
+static void answer_headers(OutputQueue *out, int status, const char *extra, int closing)
+{
+	char response[256];
+	int response_len = closing ?
+		http_response_headers_close(response, sizeof(response), status, 0, extra) :
+		http_response_headers_extra(response, sizeof(response), status, 0, extra);
+
+	uint8_t *copy = malloc(response_len);
+	if (!copy) {
+		log_error("ran out of memory for a response\n");
+		return;
+	}
+	(void) memcpy(copy, response, response_len);
+	(void) output_push_mem(out, copy, response_len, 1);
+}
+
+/*
+ * Byte ranges
+ *
+ * Only the headers of a 206 are made per response, taking the header
+ * lines after Content-Length from the prebuilt 200. The bytes of a
+ * range are sent straight out of the cached response, or from the
+ * file like any other uncached body. More than one range make a
+ * multipart/byteranges body, with a part header in front of each.
+ */
+
+static inline void push_range(OutputQueue *out, const ResourceVariant *variant, const HttpRange *range)
+{
+	size_t len = range->last - range->first + 1;
 
-		const char *status_msg = http_status_msg(status);
-		size_t status_len = strlen(status_msg);
+	if (variant->cached)
+		(void) output_push_mem(out, variant->response + variant->header_len + range->first, len, 0);
+	else
+		(void) output_push_file(out, variant->fd, range->first, len);
+}
 
-		const char headers[] =
-			"HTTP/1.1 %s\r\n"
-			"Content-Length: %lu\r\n"
-			"Connection: Keep-Alive\r\n"
-			"Server: WServer\r\n"
-			"\r\n"
-		;
+static int answer_range(OutputQueue *out, const ResourceVariant *variant, const HttpRange *range,
+		const char *vary)
+{
+	const uint8_t *fields = variant->response + variant->fields_off;
+	size_t fields_len = variant->header_len - variant->fields_off;
+
+	char head[160];
+	int head_len = snprintf(head, sizeof(head),
+		"HTTP/1.1 %s\r\n"
+		"Content-Length: %" PRIu64 "\r\n"
+		"Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%zu\r\n"
+		"%s",
+		http_status_msg(206), range->last - range->first + 1,
+		range->first, range->last, variant->size, vary
+	);
+
+	uint8_t *headers = malloc(head_len + fields_len);
+	if (!headers) {
+		log_error("ran out of memory for a response\n");
+		return 206;
+	}
+	(void) memcpy(headers, head, head_len);
+	(void) memcpy(headers + head_len, fields, fields_len);
 
-		char response[status_len + sizeof(headers) + 40];
+	(void) output_push_mem(out, headers, head_len + fields_len, 1);
+	push_range(out, variant, range);
+	return 206;
+}
 
-		(void) sprintf(
-			response,
-			headers,
-			status_msg,
-			content_len
+static int answer_multirange(OutputQueue *out, const Resource *resource, const ResourceVariant *variant,
+		const HttpRange *ranges, int n, const char *vary)
+{
+	/* The Content-Type is the one of the parts here */
+	const uint8_t *fields = variant->response + variant->fields_off + resource->mime->line_len;
+	size_t fields_len = variant->header_len - variant->fields_off - resource->mime->line_len;
+
+	/* Only has to be unlikely to turn up in the file */
+	uint64_t boundary = (out->queued ^ (uintptr_t) out ^ (uint64_t) time(NULL)) * 0x9E3779B97F4A7C15ull;
+
+	char parts[HTTP_MAX_RANGES][256];
+	int part_len[HTTP_MAX_RANGES];
+	size_t parts_len = 0;
+	uint64_t body_len = 0;
+
+	for (int i = 0; i < n; i++) {
+		part_len[i] = snprintf(parts[i], sizeof(parts[i]),
+			"\r\n--%016" PRIx64 "\r\n"
+			"%s"
+			"Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%zu\r\n"
+			"\r\n",
+			boundary, resource->mime->line, ranges[i].first, ranges[i].last, variant->size
 		);
+		parts_len += part_len[i];
+		body_len += part_len[i] + (ranges[i].last - ranges[i].first + 1);
+	}
+
+	char end[32];
+	int end_len = snprintf(end, sizeof(end), "\r\n--%016" PRIx64 "--\r\n", boundary);
+	body_len += end_len;
+
+	char head[192];
+	int head_len = snprintf(head, sizeof(head),
+		"HTTP/1.1 %s\r\n"
+		"Content-Length: %" PRIu64 "\r\n"
+		"Content-Type: multipart/byteranges; boundary=%016" PRIx64 "\r\n"
+		"%s",
+		http_status_msg(206), body_len, boundary, vary
+	);
+
+	/*
+	 * Everything but the ranges goes into one allocation, freed by
+	 * the segment that's sent last: the closing boundary, which is
+	 * why that one comes first in it.
+	 */
+	uint8_t *mem = malloc(end_len + head_len + fields_len + parts_len);
+	if (!mem) {
+		log_error("ran out of memory for a response\n");
+		return 206;
+	}
+	(void) memcpy(mem, end, end_len);
 
-		(void) send(asocket, response, strlen(response), 0);
-		(void) send(asocket, buf, content_len, 0);
+	uint8_t *p = mem + end_len;
+	(void) memcpy(p, head, head_len);
+	(void) memcpy(p + head_len, fields, fields_len);
+	size_t len = head_len + fields_len;
 
-		(void) munmap(buf, content_len);
+	for (int i = 0; i < n; i++) {
+		(void) memcpy(p + len, parts[i], part_len[i]);
+		(void) output_push_mem(out, p, len + part_len[i], 0);
+		push_range(out, variant, &ranges[i]);
+
+		p += len + part_len[i];
+		len = 0;
 	}
+
+	(void) output_push_mem(out, mem, end_len, 1);
+	return 206;
 }
 
 /*
- * Read a request into a buffer from a socket connection.
+ * Negotiated responses (see resource_negotiate()) depend on Accept,
+ * they get these in place of the prebuilt status line.
  */
-static int read_request_buf(int asocket, HttpRequest *req)
-{
-	if (asocket < 0 || !req)
-		return -1;
+static const char negotiated_ok[] = "HTTP/1.1 200 OK\r\nVary: Accept\r\n";
+static const char negotiated_not_modified[] = "HTTP/1.1 304 Not Modified\r\nVary: Accept\r\n";
 
-	HttpBuffer *buf = &req->buf;
-	const size_t block_size = (1000);
-	const char *no_more_mem = "Ran out of memory. Unable to allocate request.\n";
+/*
+ * Queue (the front of) a prebuilt response, with another status
+ * line if there is one.
+ */
+static inline void push_prebuilt(OutputQueue *out, const uint8_t *response, size_t len, const char *status)
+{
+	if (status) {
+		size_t skip = (const uint8_t *) memchr(response, '\n', len) + 1 - response;
+		(void) output_push_mem(out, (const uint8_t *) status, strlen(status), 0);
+		response += skip;
+		len -= skip;
+	}
+	(void) output_push_mem(out, response, len, 0);
+}
 
-	if (!buf->buf) {
-		buf->buf = malloc(block_size);
-		if (!buf->buf) {
-			log_error(no_more_mem);
-			return -1;
+/*
+ * Answer a request on a connection
+ *
+ * Nothing is sent from here, the response is only queued up on
+ * conn->out. Bodies that aren't cached are queued as a file range
+ * and go out with io_sendfile().
+ *
+ * Returns the status code of the response.
+ */
+static int answer_request(Worker *worker, Connection *conn)
+{
+	HttpRequest *req = &conn->request;
+	OutputQueue *out = &conn->out;
+
+	int status = 200;
+	Resource *resource = NULL;
+	int negotiated = 0;
+
+	if (req->parser_status) {
+		status = req->parser_status;
+	} else if (req->method != HTTP_GET && req->method != HTTP_HEAD) {
+		/* We only serve files */
+		status = 405;
+	} else if (wserver_metrics && is_metrics_path(req)) {
+		if (answer_metrics(conn, req->method == HTTP_HEAD) == 0)
+			return status;
+		status = 500;
+	} else {
+		resource = resource_get(req->path, req->path_len);
+		if (!resource) {
+			status = resource_negotiate(req->path, req->path_len, &req->accept_field, &resource);
+			negotiated = resource != NULL;
 		}
-		buf->size = block_size;
 	}
 
-	uint32_t bytes_left = buf->size - buf->used;
-	if (bytes_left == 0) {
-		buf->size += block_size;
-		uint8_t *realloc_buf = realloc(buf->buf, buf->size);
-		if (!realloc_buf) {
-			log_error(no_more_mem);
-			return -1;
+	if (resource) {
+		/*
+		 * Ranges are of the bytes as they are, whoever asks for
+		 * some gets the identity variant. That way the offsets
+		 * mean the same no matter what the client accepts.
+		 */
+		const ResourceVariant *variant = (req->ranges_len && req->method == HTTP_GET) ?
+			&resource->variants[HTTP_ENCODING_IDENTITY] : resource_variant(resource, req->accept_encoding);
+
+		/* The client has it already, nothing to read or send but headers */
+		if (resource_not_modified(resource, variant, req)) {
+			push_prebuilt(out, variant->not_modified, variant->not_modified_len,
+					negotiated ? negotiated_not_modified : NULL);
+			return 304;
+		}
+
+		if (variant->cached)
+			metrics_add(worker->metrics->cache_hits, 1);
+		else
+			metrics_add(worker->metrics->cache_misses, 1);
+
+		/*
+		 * The status line and headers are prebuilt, and
+		 * for cached files so is the body.
+		 */
+		const char *status_line = negotiated ? negotiated_ok : NULL;
+		if (req->method == HTTP_HEAD) {
+			push_prebuilt(out, variant->response, variant->header_len, status_line);
+			return status;
+		}
+
+		const char *vary = negotiated ? "Vary: Accept\r\n" : "";
+		HttpRange ranges[HTTP_MAX_RANGES];
+		int nranges = resource_ranges(resource, variant, req, ranges);
+		if (nranges == 1)
+			return answer_range(out, variant, &ranges[0], vary);
+		if (nranges > 1)
+			return answer_multirange(out, resource, variant, ranges, nranges, vary);
+		if (nranges < 0) {
+			char extra[96];
+			(void) snprintf(extra, sizeof(extra), "Content-Range: bytes */%zu\r\n%s", variant->size, vary);
+			answer_headers(out, 416, extra, conn->closing);
+			return 416;
 		}
-		buf->buf = realloc_buf;
-		bytes_left = block_size;
+
+		push_prebuilt(out, variant->response, variant->response_len, status_line);
+
+		if (!variant->cached)
+			(void) output_push_file(out, variant->fd, 0, variant->size);
+		return status;
 	}
 
-	uint8_t *end = buf->buf + buf->used;
+	/* What's not acceptable depends on Accept as well */
+	answer_headers(out, status, status == 406 ? "Vary: Accept\r\n" : "", conn->closing);
+	return status;
+}
 
-	ssize_t bytes_recvd;
-	switch ((bytes_recvd = recv(asocket, end, bytes_left, 0))) {
-		case 0:
-		case -1:
-			return -1;
-		default:
-			buf->used += bytes_recvd;
+/*
+ * Request timing, for the access log and the latency histograms
+ *
+ * Every answered request gets a PendingAccess on its connection,
+ * done once the last byte of the response left (or when the
+ * connection closes before that). Times come from the monotonic
+ * clock and start when the first byte of the request came in.
+ */
+
+static inline uint64_t clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * Remember the address of the client.
+ */
+static void connection_peer(Connection *conn)
+{
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+
+	if (getpeername(conn->fd, (struct sockaddr *) &addr, &len) < 0)
+		return;
+
+	if (addr.ss_family == AF_INET) {
+		(void) memcpy(conn->peer, &((struct sockaddr_in *) &addr)->sin_addr, 4);
+		conn->peer_family = AF_INET;
+	} else if (addr.ss_family == AF_INET6) {
+		(void) memcpy(conn->peer, &((struct sockaddr_in6 *) &addr)->sin6_addr, 16);
+		conn->peer_family = AF_INET6;
 	}
+}
 
-	if (buf->used >= (WSERVER_MAX_BUF * block_size))
-		buf->progress = 1;
+/*
+ * Bytes came in on a connection.
+ */
+static inline void connection_received(Connection *conn)
+{
+	conn->recv_time = clock_ns();
+	if (!conn->req_start)
+		conn->req_start = conn->recv_time;
+}
 
-	return 0;
+/*
+ * Bytes of the output queue that actually left through the socket
+ * (io_uring counts file bytes as sent once they're in the pipe).
+ */
+static inline uint64_t connection_sent(Connection *conn)
+{
+#if WSERVER_HAVE_URING
+	return conn->out.sent - conn->piped;
+#else
+	return conn->out.sent;
+#endif
 }
 
-static inline int make_nonblock(int asocket)
+/*
+ * Answer the request at the front, and count and time it.
+ */
+static void connection_answer(Worker *worker, Connection *conn)
 {
-	int fl = fcntl(asocket, F_GETFL, 0);
-	if (fl < 0) return fl;
-	if (fcntl(asocket, F_SETFL, fl | O_NONBLOCK) < 0)
-		return fl;
-	return 0;
+	HttpRequest *req = &conn->request;
+	uint64_t start = conn->out.queued;
+	int status = answer_request(worker, conn);
+
+	conn->answered++;
+
+	metrics_add(worker->metrics->requests[req->method][metrics_status(status)], 1);
+
+	if (!wserver_timing)
+		return;
+
+	uint64_t now = clock_ns();
+	if (wserver_metrics)
+		metrics_hist_add(&worker->metrics->parse_time, now - (conn->req_start ? conn->req_start : now));
+
+	PendingAccess *access = pool_get(&worker->access);
+	if (!access)
+		return;
+
+	access->next      = NULL;
+	access->start     = start;
+	access->end       = conn->out.queued;
+	access->req_start = conn->req_start ? conn->req_start : now;
+
+	AccessRecord *rec = &access->rec;
+	rec->parse_ns    = now - access->req_start;
+	rec->status      = (uint16_t) status;
+	rec->method      = (uint8_t) req->method;
+	rec->peer_family = conn->peer_family;
+	(void) memcpy(rec->peer, conn->peer, sizeof(rec->peer));
+
+	rec->path_len = 0;
+	if (req->path) {
+		rec->path_len = (req->path_len < ACCESS_PATH_MAX) ? req->path_len : ACCESS_PATH_MAX;
+		(void) memcpy(rec->path, req->path, rec->path_len);
+	}
+
+	if (conn->access_tail)
+		conn->access_tail->next = access;
+	else
+		conn->access_head = access;
+	conn->access_tail = access;
 }
 
 /*
- * The main event loop of the server.
+ * Finish every response whose last byte went out. If the connection
+ * is closing, the rest are logged with whatever was sent of them
+ * (but they're not part of the latencies).
+ */
+static void connection_responses_sent(Worker *worker, Connection *conn, int closing)
+{
+	PendingAccess *access = conn->access_head;
+	if (!access)
+		return;
+
+	uint64_t sent = connection_sent(conn);
+	uint64_t now = clock_ns();
+
+	while (access && (closing || access->end <= sent)) {
+		PendingAccess *next = access->next;
+		uint64_t end = (access->end < sent) ? access->end : sent;
+
+		access->rec.bytes    = (end > access->start) ? end - access->start : 0;
+		access->rec.total_ns = now - access->req_start;
+
+		if (wserver_access_log)
+			log_access(&access->rec);
+		if (wserver_metrics && access->end <= sent)
+			metrics_hist_add(&worker->metrics->total_time, access->rec.total_ns);
+
+		pool_put(&worker->access, access);
+		access = next;
+	}
+
+	conn->access_head = access;
+	if (!access)
+		conn->access_tail = NULL;
+}
+
+/*
+ * Timeouts
+ *
+ * A connection always waits on one thing, with its own deadline:
+ *
+ *   TIMEOUT_HEADER     the headers of a request, counted from its
+ *                      first byte (from the accept for the first
+ *                      request). Bytes trickling in don't buy more
+ *                      time, so a slow client can't hold on forever.
+ *   TIMEOUT_KEEPALIVE  the next request, on an idle connection.
+ *   TIMEOUT_IDLE       a request body or a response to move, pushed
+ *                      back every time it does.
+ *
+ * Deadlines sit in the worker's timing wheel. The event loop sleeps
+ * until the next one is due and advances the wheel after every round,
+ * closing the connections whose time ran out.
+ */
+enum {
+	TIMEOUT_NONE,
+	TIMEOUT_HEADER,
+	TIMEOUT_KEEPALIVE,
+	TIMEOUT_IDLE,
+};
+
+#define TIMER_CONN(t) ((Connection *) ((char *) (t) - offsetof(Connection, timer)))
+
+static inline uint64_t clock_ms(void)
+{
+	return clock_ns() / 1000000;
+}
+
+/*
+ * Some of a response still has to go out.
+ */
+static inline int connection_sending(Connection *conn)
+{
+#if WSERVER_HAVE_URING
+	if (conn->sending || conn->piped)
+		return 1;
+#endif
+	return !output_empty(&conn->out);
+}
+
+/*
+ * Set the deadline of whatever the connection waits on now,
+ * called after every event on it.
  */
-static inline void lsocket_mainloop(void)
+static void connection_timeout(Worker *worker, Connection *conn)
 {
-	if (event_init() < 0)
+	HttpRequest *req = &conn->request;
+	uint8_t timeout;
+	int secs;
+
+	if (connection_sending(conn) || (req->buf.used && req->parser.state >= HTTP_PARSE_BODY)) {
+		timeout = TIMEOUT_IDLE;
+		secs = wserver_settings->idle_timeout;
+	} else if (req->buf.used || !conn->answered) {
+		timeout = TIMEOUT_HEADER;
+		secs = wserver_settings->header_timeout;
+	} else {
+		timeout = TIMEOUT_KEEPALIVE;
+		secs = wserver_settings->keepalive_timeout;
+	}
+
+	/* The header deadline only moves on with the next request */
+	if (timeout == TIMEOUT_HEADER && conn->timeout == TIMEOUT_HEADER &&
+			conn->answered == conn->timeout_answered)
 		return;
 
-	struct kevent events[WSERVER_MAX_CON];
+	conn->timeout = timeout;
+	conn->timeout_answered = conn->answered;
+
+	if (secs)
+		timer_set(&worker->timers, &conn->timer, worker->now_ms + (uint64_t) secs * 1000);
+	else
+		timer_cancel(&worker->timers, &conn->timer);
+}
+
+/*
+ * Make closing a connection reset it, instead of leaving what it
+ * didn't read queued in the kernel. That's for the ones stuck on a
+ * request or a response (TIMEOUT_HEADER, TIMEOUT_IDLE): an idle
+ * keep-alive connection has nothing left unread and gets a plain FIN,
+ * so a client whose next request crossed it can tell and retry.
+ */
+static inline void connection_abort(Connection *conn)
+{
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	(void) setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+}
+
+/*
+ * What read_request_buf() ran into.
+ */
+#define READ_DRAINED (0)
+#define READ_FULL    (1)
+#define READ_EOF     (2)
+
+/*
+ * Read a request into a buffer from a socket connection.
+ *
+ * Events are edge-triggered, so this keeps reading until the
+ * socket runs dry (or the buffer is full). The buffer comes from
+ * the worker's pool, it's only held while there's unanswered data.
+ *
+ * Returns one of READ_*, or -1 on error.
+ */
+static int read_request_buf(Worker *worker, Connection *conn)
+{
+	HttpRequest *req = &conn->request;
+	HttpBuffer *buf = &req->buf;
+	int asocket = conn->fd;
+
+	if (!buf->buf) {
+		buf->buf = pool_get(&worker->buffers);
+		if (!buf->buf) {
+			log_error("Ran out of memory. Unable to allocate request.\n");
+			return -1;
+		}
+		buf->size = RECV_BUF_SIZE;
+	}
 
 	for ( ;; ) {
-		int new_events;
-		new_events = kevent(wserver_efd, NULL, 0, events, WSERVER_MAX_CON, NULL);
-		if (new_events < 0) {
-			log_error("failed to get new events: kevent(): %s", strerror(errno));
-			continue;
+		uint32_t bytes_left = buf->size - buf->used;
+		if (bytes_left == 0) {
+			/* Make room by dropping the requests that were answered */
+			http_compact_req(req);
+			bytes_left = buf->size - buf->used;
 		}
+		if (bytes_left == 0)
+			return READ_FULL;
 
-		for (int i = 0; i < new_events; i++) {
-			int selected_socket = events[i].ident;
-
-			if (selected_socket == wserver_lsocket) {
-				struct sockaddr sa;
-				socklen_t sa_len;
-				int asocket;
-
-				asocket = accept(wserver_lsocket, &sa, &sa_len);
-				if (asocket < 0) {
-					log_error("accept() failed: %s\n", strerror(errno));
-					continue;
-				}
-
-				if (make_nonblock(asocket) < 0) {
-					close(asocket);
-					continue;
-				}
-
-				HttpRequest *request = http_alloc_req();
-				if (!request) {
-					log_error("http_alloc_req() failed\n");
-					close(asocket);
-					continue;
-				}
-
-				struct kevent add_event;
-				EV_SET(&add_event, asocket, EVFILT_READ, EV_ADD, 0, 0, request);
-				if (kevent(wserver_efd, (const struct kevent *) &add_event, 1, NULL, 0, NULL) < 0) {
-					log_error("kevent() failed\n");
-					http_free_req(request);
-					close(asocket);
-					continue;
-				}
-			} else {
-				if (events[i].flags & EV_ERROR) continue;
-
-				switch (events[i].filter) {
-					case EVFILT_READ:; {
-						HttpRequest *request = (HttpRequest *) events[i].udata;
-						int err_status;
-
-						if (read_request_buf(selected_socket, request) < 0)
-							goto read_error;
-
-						if ((err_status = http_check_done(request))) {
-							log_write("http_check_done() returned status code %d\n", err_status);
-							request->parser_status = err_status;
-						}
-
-						if (request->buf.progress) {
-							events[i].filter = EVFILT_WRITE;
-							events[i].flags  = EV_ADD;
-							if (kevent(wserver_efd, (const struct kevent *) &events[i], 1, NULL, 0, NULL) < 0)
-								goto read_error;
-						}
-
-						break;
-					read_error:
-						http_reset_req(request);
-						http_free_req(request);
-						close(selected_socket);
-						break;
-					}
-					case EVFILT_WRITE:; {
-						HttpRequest *request = (HttpRequest *) events[i].udata;
-						answer_request(selected_socket, request);
-
-						http_reset_req(request);
-
-						events[i].filter = EVFILT_READ;
-						events[i].flags  = EV_ADD;
-						if (kevent(wserver_efd, (const struct kevent *) &events[i], 1, NULL, 0, NULL) < 0) {
-							http_free_req(request);
-							close(selected_socket);
-						}
-						break;
-					}
-				}
-			}
+		uint8_t *end = buf->buf + buf->used;
+
+		ssize_t bytes_recvd = recv(asocket, end, bytes_left, 0);
+		if (bytes_recvd > 0) {
+			buf->used += bytes_recvd;
+			metrics_add(worker->metrics->bytes_in, bytes_recvd);
+			if (wserver_timing)
+				connection_received(conn);
+			continue;
 		}
+
+		if (bytes_recvd == 0)
+			return READ_EOF;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return READ_DRAINED;
+		if (errno == EINTR)
+			continue;
+		return -1;
 	}
 }
 
 /*
- * Cleanup the listening socket.
+ * Give the receive buffer back to the pool once everything
+ * in it was answered, so idle connections don't hold one.
  */
-static void lsocket_destroy(void)
+static inline void connection_release_buf(Worker *worker, Connection *conn)
+{
+	HttpBuffer *buf = &conn->request.buf;
+	if (!buf->buf || buf->used)
+		return;
+
+	pool_put(&worker->buffers, buf->buf);
+	buf->buf = NULL;
+	buf->size = 0;
+}
+
+/*
+ * Free a connection and close its socket.
+ * Closing the socket also removes it from the event queue.
+ */
+static void connection_close(Worker *worker, Connection *conn)
 {
-	if (wserver_lsocket != -1)
-		close(wserver_lsocket);
-	wserver_lsocket = -1;
-	log_write("Successfully destroyed listening socket.\n");
+	timer_cancel(&worker->timers, &conn->timer);
+	connection_responses_sent(worker, conn, 1);
+	pool_put(&worker->buffers, conn->request.buf.buf);
+	output_clear(&conn->out);
+	resource_unpin(conn->pinned);
+	close(conn->fd);
+	pool_put(&worker->connections, conn);
+	worker->nconns--;
+	metrics_add(worker->metrics->closed, 1);
 }
 
-static void general_cleanup(void)
+/*
+ * Overload
+ *
+ * Every worker keeps at most max-connections open. Past that a new
+ * connection gets a prebuilt 503 and is closed right away, which
+ * costs next to nothing, so a flood of connections can't push the
+ * latency of the ones being served. With pause-accept they're left
+ * in the kernel's backlog instead, until a connection closes.
+ *
+ * Running out of file descriptors pauses accepting the same way,
+ * whatever the setting.
+ */
+static const char overload_response[] =
+	"HTTP/1.1 503 Service Unavailable\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"Retry-After: 1\r\n"
+	"Server: WServer\r\n"
+	"\r\n";
+
+static inline int worker_full(const Worker *worker)
 {
-	lsocket_destroy();
-	resource_destroy();
-	log_destroy();
+	int max = wserver_settings->max_connections;
+	return max && worker->nconns >= (uint32_t) max;
 }
 
-int main(int argc, char **argv)
+/*
+ * Stop accepting until a connection closed.
+ */
+static inline void worker_pause_accept(Worker *worker)
 {
-	(void) argc; (void) argv;
+	if (worker->accept_paused)
+		return;
+	worker->accept_paused = 1;
+	worker->paused_at = worker->nconns;
+}
 
-	atexit(general_cleanup);
+static inline int worker_can_resume(const Worker *worker)
+{
+	return worker->accept_paused && worker->nconns < worker->paused_at;
+}
 
-	log_init();
+/*
+ * Answer a connection the worker has no room for, without waiting
+ * on the socket: if the 503 doesn't fit, the client doesn't get it.
+ */
+static void connection_reject(Worker *worker, int asocket)
+{
+	(void) send(asocket, overload_response, sizeof(overload_response) - 1, MSG_DONTWAIT);
+	close(asocket);
+	metrics_add(worker->metrics->rejected, 1);
+}
 
-	resource_init();
+/*
+ * Accept every pending connection on the listening socket,
+ * or as many as the worker has room for.
+ */
+static void lsocket_accept(Worker *worker)
+{
+	worker->accept_paused = 0;
 
-	log_write_notime("%s\n", wserver_title_text);
-	log_write("Starting...\n");
+	for ( ;; ) {
+		if (wserver_settings->pause_accept && worker_full(worker)) {
+			worker_pause_accept(worker);
+			return;
+		}
 
-	if (lsocket_init() < 0)
-		return -1;
+#ifdef SOCK_NONBLOCK
+		int asocket = accept4(worker->lsocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+		int asocket = accept(worker->lsocket, NULL, NULL);
+#endif
+		if (asocket < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno == EMFILE || errno == ENFILE) {
+				log_error("accept() failed: %s, pausing\n", strerror(errno));
+				worker_pause_accept(worker);
+				return;
+			}
+			log_error("accept() failed: %s\n", strerror(errno));
+			return;
+		}
+
+#ifndef SOCK_NONBLOCK
+		if (make_nonblock(asocket) < 0) {
+			close(asocket);
+			continue;
+		}
+#endif
+
+		if (worker_full(worker)) {
+			connection_reject(worker, asocket);
+			continue;
+		}
+
+		Connection *conn = pool_get(&worker->connections);
+		if (!conn) {
+			log_error("failed to allocate connection\n");
+			close(asocket);
+			continue;
+		}
+		(void) memset(conn, 0, sizeof(Connection));
+		conn->fd = asocket;
+		conn->interest = EVENT_READ;
+		if (wserver_access_log)
+			connection_peer(conn);
+
+		if (event_add(worker->efd, asocket, EVENT_READ, conn) < 0) {
+			log_error("event_add() failed: %s\n", strerror(errno));
+			pool_put(&worker->connections, conn);
+			close(asocket);
+			continue;
+		}
+		worker->nconns++;
+		metrics_add(worker->metrics->accepted, 1);
+		connection_timeout(worker, conn);
+	}
+}
+
+/*
+ * Parse and answer every complete request in the buffer (pipelined
+ * requests come in together), for as long as the output queue has
+ * room. The responses are only queued, not sent.
+ */
+static void connection_process(Worker *worker, Connection *conn)
+{
+	HttpRequest *request = &conn->request;
+
+	while (!conn->closing && output_room(&conn->out) >= RESPONSE_MAX_SEGMENTS) {
+		int err_status;
+
+		if ((err_status = http_check_done(request))) {
+			log_write("http_check_done() returned status code %d\n", err_status);
+			metrics_add(worker->metrics->parse_errors, 1);
+			request->parser_status = err_status;
+
+			/*
+			 * Answer with the error. There's no telling where
+			 * the next request would start, so that's the end.
+			 */
+			request->buf.progress = 1;
+			conn->closing = 1;
+		}
+
+		if (!request->buf.progress)
+			break;
+
+		/* A multipart response waits for room for all of its parts */
+		if (request->ranges_len > 1 && output_room(&conn->out) < MULTIRANGE_SEGMENTS(request->ranges_len))
+			break;
+
+		connection_answer(worker, conn);
+		http_next_req(request);
+
+		/* A pipelined request that's left came in with the last read at the latest */
+		if (wserver_timing)
+			conn->req_start = request->buf.used ? conn->recv_time : 0;
+	}
+}
+
+/*
+ * Switch the event interest of a connection, if it changed.
+ */
+static inline int connection_want(Worker *worker, Connection *conn, uint32_t interest)
+{
+	if (conn->interest == interest)
+		return 0;
+	conn->interest = interest;
+	return event_mod(worker->efd, conn->fd, interest, conn);
+}
+
+/*
+ * Send everything that's queued in as few writes as possible,
+ * answering more buffered requests whenever room frees up.
+ *
+ * Waits for write readiness if the socket is full, and only goes
+ * back to reading once everything went out.
+ * Returns -1 if the connection has to be closed.
+ */
+static int connection_flush(Worker *worker, Connection *conn)
+{
+	for ( ;; ) {
+		uint64_t sent = conn->out.sent;
+		int ret = output_flush(&conn->out, conn->fd);
+		metrics_add(worker->metrics->bytes_out, conn->out.sent - sent);
+		connection_responses_sent(worker, conn, 0);
+
+		switch (ret) {
+			case 0:
+				if (!conn->pinned)
+					conn->pinned = resource_pin();
+				return connection_want(worker, conn, EVENT_WRITE);
+			case -1:
+				return -1;
+		}
+
+		resource_unpin(conn->pinned);
+		conn->pinned = NULL;
+
+		if (conn->closing)
+			return -1;
+
+		connection_process(worker, conn);
+		if (output_empty(&conn->out))
+			break;
+	}
+
+	/* Everything that came in before the end was answered */
+	if (conn->eof)
+		return -1;
+
+	connection_release_buf(worker, conn);
+	return connection_want(worker, conn, EVENT_READ);
+}
+
+/*
+ * Handle a readiness event on a client connection.
+ */
+static inline void connection_event(Worker *worker, Connection *conn, uint32_t flags)
+{
+	HttpRequest *request = &conn->request;
+
+	if (flags & EVENT_ERROR)
+		goto close_conn;
+
+	if ((flags & EVENT_READ) && conn->interest == EVENT_READ) {
+		for ( ;; ) {
+			int ret = read_request_buf(worker, conn);
+			if (ret < 0)
+				goto close_conn;
+
+			/* The client is done sending, answer what we have */
+			if (ret == READ_EOF)
+				conn->eof = 1;
+
+			connection_process(worker, conn);
+
+			if (ret != READ_FULL || conn->closing)
+				break;
+
+			if (output_empty(&conn->out)) {
+				/* The buffer is full of one request that's still incomplete */
+				request->parser_status = 413;
+				request->buf.progress = 1;
+				conn->closing = 1;
+				connection_answer(worker, conn);
+				break;
+			}
+
+			/* Send the answers to make room, then keep reading */
+			if (connection_flush(worker, conn) < 0)
+				goto close_conn;
+
+			/* Reading resumes once the socket took everything */
+			if (conn->interest == EVENT_WRITE)
+				goto done;
+		}
+
+		if (connection_flush(worker, conn) < 0)
+			goto close_conn;
+	} else if ((flags & EVENT_WRITE) && conn->interest == EVENT_WRITE) {
+		if (connection_flush(worker, conn) < 0)
+			goto close_conn;
+	} else if ((flags & EVENT_EOF) || ((flags & EVENT_RDHUP) && conn->interest == EVENT_READ)) {
+		/*
+		 * A client that's only done sending still gets the rest of
+		 * what's queued, reading resumes (and sees the end) after.
+		 */
+		goto close_conn;
+	}
+
+done:
+	connection_timeout(worker, conn);
+	return;
+
+close_conn:
+	connection_close(worker, conn);
+}
+
+/*
+ * A connection's time ran out.
+ */
+static void lsocket_conn_expired(Timer *timer, void *arg)
+{
+	Worker *worker = arg;
+	Connection *conn = TIMER_CONN(timer);
+
+	metrics_add(worker->metrics->timeouts, 1);
+	if (conn->timeout != TIMEOUT_KEEPALIVE)
+		connection_abort(conn);
+	connection_close(worker, conn);
+}
+
+/*
+ * The main event loop of the server.
+ */
+static void *lsocket_mainloop(void *arg)
+{
+	Worker *worker = arg;
+
+	if (event_init(worker) < 0)
+		return NULL;
+
+	pool_init(&worker->connections, sizeof(Connection), CONN_PER_SLAB);
+	pool_init(&worker->buffers, RECV_BUF_SIZE, BUFS_PER_SLAB);
+	pool_init(&worker->access, sizeof(PendingAccess), ACCESS_PER_SLAB);
+
+	worker->now_ms = clock_ms();
+	timer_wheel_init(&worker->timers, worker->now_ms);
+
+	Event events[WSERVER_MAX_EVENTS];
+
+	for ( ;; ) {
+		int timeout = timer_next(&worker->timers, worker->now_ms);
+		int new_events = event_wait(worker->efd, events, WSERVER_MAX_EVENTS, timeout);
+		worker->now_ms = clock_ms();
+
+		if (new_events < 0) {
+			log_error("failed to get new events: event_wait(): %s", strerror(errno));
+			continue;
+		}
+
+		/*
+		 * Nothing from the last round points into resources
+		 * anymore, pick up the newest snapshot.
+		 */
+		resource_quiesce();
+
+		for (int i = 0; i < new_events; i++) {
+			if (events[i].udata == NULL)
+				lsocket_accept(worker);
+			else
+				connection_event(worker, (Connection *) events[i].udata, events[i].flags);
+		}
+
+		timer_advance(&worker->timers, worker->now_ms, lsocket_conn_expired, worker);
+
+		/* Events are edge-triggered, what's pending won't come up again */
+		if (worker_can_resume(worker))
+			lsocket_accept(worker);
+	}
+}
+
+#if WSERVER_HAVE_URING
+
+/*
+ * The io_uring backend
+ *
+ * Completion based instead of readiness based: the listening socket
+ * has one multishot accept, every connection one multishot recv that
+ * picks buffers out of a ring shared by the worker, and responses go
+ * out as linked sendmsg / splice chains. One io_uring_enter() both
+ * submits everything and waits for the next batch of completions.
+ *
+ * Received bytes are copied from the shared buffers into the pooled
+ * request buffer, since the parser needs a request in one piece. The
+ * shared buffer goes straight back to the kernel after that.
+ */
+
+#define URING_ENTRIES  (1024)
+#define URING_BUFS     (1024)
+#define URING_BUF_SIZE (4096)
+
+/*
+ * Received buffers a connection can sit on before its recv is
+ * cancelled, so one client can't take the whole ring.
+ */
+#define URING_CONN_BUFS (8)
+
+#define URING_NO_BUF (0xffff)
+
+/*
+ * What a completion is for, in the low bits of user_data
+ * (connections are cache line aligned, so those are free).
+ */
+enum {
+	URING_ACCEPT,
+	URING_RECV,
+	URING_SEND,
+	URING_SPLICE_IN,
+	URING_SPLICE_OUT,
+	URING_CANCEL,
+	URING_ACCEPT_CANCEL,
+};
+
+#define URING_TAG_MASK (7)
+
+#define URING_DATA(conn, tag) ((uint64_t) (uintptr_t) (conn) | (tag))
+
+/*
+ * The part of a received buffer that wasn't copied yet.
+ */
+struct UringRx {
+	uint16_t next;
+	uint16_t off;
+	uint16_t len;
+};
+
+static int uring_arm_accept(Worker *worker)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+	if (!sqe)
+		return -1;
+
+	/* Sockets stay blocking, splice() into them has to wait for room */
+	uring_prep(sqe, IORING_OP_ACCEPT, worker->lsocket, NULL, 0, 0,
+			URING_DATA(NULL, URING_ACCEPT));
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+
+	worker->accept_armed = 1;
+	return 0;
+}
+
+/*
+ * Keep the accept armed while accepting isn't paused, and cancel
+ * it while it is. Called once every round.
+ */
+static void uring_update_accept(Worker *worker)
+{
+	if (worker_can_resume(worker))
+		worker->accept_paused = 0;
+
+	if (!worker->accept_paused) {
+		if (!worker->accept_armed && uring_arm_accept(worker) < 0)
+			log_error("failed to queue an accept\n");
+		return;
+	}
+
+	if (!worker->accept_armed || worker->accept_cancelling)
+		return;
+
+	struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+	if (!sqe)
+		return;
+
+	uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1,
+			(void *) (uintptr_t) URING_DATA(NULL, URING_ACCEPT), 0, 0,
+			URING_DATA(NULL, URING_ACCEPT_CANCEL));
+	worker->accept_cancelling = 1;
+}
+
+static int uring_arm_recv(Worker *worker, Connection *conn)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+	if (!sqe)
+		return -1;
+
+	uring_prep(sqe, IORING_OP_RECV, conn->fd, NULL, 0, 0,
+			URING_DATA(conn, URING_RECV));
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+
+	conn->recv_armed = 1;
+	conn->inflight++;
+	return 0;
+}
+
+static void uring_cancel_recv(Worker *worker, Connection *conn)
+{
+	if (!conn->recv_armed || conn->cancelling)
+		return;
+
+	struct io_uring_sqe *sqe = uring_sqe(&worker->ring);
+	if (!sqe)
+		return;
+
+	uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1,
+			(void *) (uintptr_t) URING_DATA(conn, URING_RECV), 0, 0,
+			URING_DATA(conn, URING_CANCEL));
+
+	conn->cancelling = 1;
+	conn->inflight++;
+}
+
+/*
+ * Start a new connection on an accepted socket.
+ */
+static void uring_conn_open(Worker *worker, int asocket)
+{
+	/*
+	 * With pause-accept, what the kernel accepted before the cancel
+	 * went through still gets in, over the limit.
+	 */
+	if (worker_full(worker)) {
+		if (!wserver_settings->pause_accept) {
+			connection_reject(worker, asocket);
+			return;
+		}
+		worker_pause_accept(worker);
+	}
+
+	Connection *conn = pool_get(&worker->connections);
+	if (!conn) {
+		log_error("failed to allocate connection\n");
+		close(asocket);
+		return;
+	}
+	(void) memset(conn, 0, sizeof(Connection));
+	conn->fd = asocket;
+	conn->rx_head = URING_NO_BUF;
+	conn->rx_tail = URING_NO_BUF;
+	conn->pipe[0] = -1;
+	conn->pipe[1] = -1;
+	if (wserver_access_log)
+		connection_peer(conn);
+
+	if (uring_arm_recv(worker, conn) < 0) {
+		log_error("failed to queue a recv\n");
+		close(asocket);
+		pool_put(&worker->connections, conn);
+		return;
+	}
+	worker->nconns++;
+	metrics_add(worker->metrics->accepted, 1);
+	connection_timeout(worker, conn);
+
+	if (wserver_settings->pause_accept && worker_full(worker))
+		worker_pause_accept(worker);
+}
+
+/*
+ * Start closing a connection. It's only freed (by uring_conn_free())
+ * once every submission on it completed.
+ */
+static void uring_conn_close(Worker *worker, Connection *conn)
+{
+	if (conn->dead)
+		return;
+	conn->dead = 1;
+	timer_cancel(&worker->timers, &conn->timer);
+
+	/*
+	 * Wakes up a send that still waits on the socket (the recv is
+	 * cancelled). Without one the FIN, or the reset of an aborted
+	 * connection, is left to the close in uring_conn_free().
+	 */
+	(void) shutdown(conn->fd, (conn->sending || conn->piped) ? SHUT_RDWR : SHUT_RD);
+	uring_cancel_recv(worker, conn);
+}
+
+static void uring_conn_free(Worker *worker, Connection *conn)
+{
+	if (!conn->dead || conn->inflight || conn->starved)
+		return;
+
+	while (conn->rx_head != URING_NO_BUF) {
+		uint16_t bid = conn->rx_head;
+		conn->rx_head = worker->rx[bid].next;
+		uring_buf_put(&worker->ring, bid);
+		worker->bufs_returned = 1;
+	}
+
+	if (conn->pipe[0] >= 0) {
+		close(conn->pipe[0]);
+		close(conn->pipe[1]);
+	}
+
+	connection_responses_sent(worker, conn, 1);
+	pool_put(&worker->buffers, conn->request.buf.buf);
+	output_clear(&conn->out);
+	resource_unpin(conn->pinned);
+	close(conn->fd);
+	pool_put(&worker->connections, conn);
+	worker->nconns--;
+	metrics_add(worker->metrics->closed, 1);
+}
+
+/*
+ * Receive again after the recv ended (cancelled, out of buffers),
+ * once the connection is ready for more.
+ */
+static void uring_conn_rearm(Worker *worker, Connection *conn)
+{
+	if (conn->dead || conn->eof || conn->recv_armed || conn->starved || conn->rx_count)
+		return;
+	if (uring_arm_recv(worker, conn) < 0)
+		uring_conn_close(worker, conn);
+}
+
+/*
+ * Copy received buffers into the request buffer, as far as they fit.
+ * Returns the amount of bytes copied, or -1 on error.
+ */
+static ssize_t uring_conn_copy(Worker *worker, Connection *conn)
+{
+	HttpRequest *req = &conn->request;
+	HttpBuffer *buf = &req->buf;
+	ssize_t copied = 0;
+
+	while (conn->rx_head != URING_NO_BUF) {
+		if (!buf->buf) {
+			buf->buf = pool_get(&worker->buffers);
+			if (!buf->buf) {
+				log_error("Ran out of memory. Unable to allocate request.\n");
+				return -1;
+			}
+			buf->size = RECV_BUF_SIZE;
+		}
+
+		uint32_t room = buf->size - buf->used;
+		if (room == 0) {
+			http_compact_req(req);
+			room = buf->size - buf->used;
+		}
+		if (room == 0)
+			break;
+
+		uint16_t bid = conn->rx_head;
+		struct UringRx *rx = &worker->rx[bid];
+		uint32_t n = (rx->len < room) ? rx->len : room;
+
+		(void) memcpy(buf->buf + buf->used, uring_buf(&worker->ring, bid) + rx->off, n);
+		buf->used += n;
+		rx->off   += n;
+		rx->len   -= n;
+		copied    += n;
+
+		if (rx->len == 0) {
+			conn->rx_head = rx->next;
+			if (conn->rx_head == URING_NO_BUF)
+				conn->rx_tail = URING_NO_BUF;
+			conn->rx_count--;
+
+			uring_buf_put(&worker->ring, bid);
+			worker->bufs_returned = 1;
+		}
+	}
+
+	return copied;
+}
+
+static void uring_send(Worker *, Connection *);
+
+/*
+ * Answer whatever came in, as far as the output queue allows,
+ * then send it or decide the connection is done.
+ */
+static void uring_conn_feed(Worker *worker, Connection *conn)
+{
+	if (conn->dead)
+		return;
+
+	for ( ;; ) {
+		ssize_t copied = uring_conn_copy(worker, conn);
+		if (copied < 0) {
+			uring_conn_close(worker, conn);
+			return;
+		}
+
+		connection_process(worker, conn);
+
+		/* Answering requests freed room for more */
+		if (copied == 0 || conn->rx_head == URING_NO_BUF)
+			break;
+	}
+
+	if (conn->sending || !output_empty(&conn->out)) {
+		uring_send(worker, conn);
+		return;
+	}
+
+	if (conn->closing || (conn->eof && conn->rx_head == URING_NO_BUF)) {
+		uring_conn_close(worker, conn);
+		return;
+	}
+
+	if (conn->rx_head != URING_NO_BUF) {
+		/* The buffer is full of one request that's still incomplete */
+		HttpRequest *request = &conn->request;
+		request->parser_status = 413;
+		request->buf.progress = 1;
+		conn->closing = 1;
+		connection_answer(worker, conn);
+		uring_send(worker, conn);
+		return;
+	}
+
+	connection_release_buf(worker, conn);
+	uring_conn_rearm(worker, conn);
+}
+
+/*
+ * Splice a file into the socket through the connection's pipe.
+ */
+static int uring_conn_pipe(Connection *conn)
+{
+	if (conn->pipe[0] >= 0)
+		return 0;
+
+	if (pipe2(conn->pipe, O_CLOEXEC) < 0) {
+		log_error("pipe2() failed: %s\n", strerror(errno));
+		conn->pipe[0] = conn->pipe[1] = -1;
+		return -1;
+	}
+
+	int size = fcntl(conn->pipe[1], F_GETPIPE_SZ);
+	conn->pipe_size = (size > 0) ? (uint32_t) size : 4096;
+	return 0;
+}
+
+static void uring_prep_splice(struct io_uring_sqe *sqe, int fd_in, uint64_t off_in,
+		int fd_out, uint32_t len, uint64_t user_data)
+{
+	uring_prep(sqe, IORING_OP_SPLICE, fd_out, NULL, len, (uint64_t) -1, user_data);
+	sqe->splice_fd_in  = fd_in;
+	sqe->splice_off_in = off_in;
+}
+
+/*
+ * Queue the next chain of sends for a connection: the memory segments
+ * at the front in one sendmsg, linked to the next file segment
+ * (spliced into the pipe, then out of it).
+ *
+ * A short send breaks the chain, the rest comes back as -ECANCELED
+ * and is sent again by the next chain.
+ */
+static void uring_send(Worker *worker, Connection *conn)
+{
+	OutputQueue *out = &conn->out;
+
+	if (conn->dead || conn->sending)
+		return;
+	if (output_empty(out) && !conn->piped)
+		return;
+
+	if (uring_reserve(&worker->ring, 3) < 0) {
+		uring_conn_close(worker, conn);
+		return;
+	}
+
+	if (!conn->pinned)
+		conn->pinned = resource_pin();
+
+	struct io_uring_sqe *sqe = NULL;
+	uint8_t count = 0;
+
+	if (conn->piped) {
+		/* Whatever is left in the pipe goes first */
+		sqe = uring_sqe(&worker->ring);
+		uring_prep_splice(sqe, conn->pipe[0], (uint64_t) -1, conn->fd, conn->piped,
+				URING_DATA(conn, URING_SPLICE_OUT));
+		count = 1;
+		goto submit;
+	}
+
+	int iovcnt = output_gather(out, conn->iov);
+	if (iovcnt) {
+		(void) memset(&conn->msg, 0, sizeof(conn->msg));
+		conn->msg.msg_iov    = conn->iov;
+		conn->msg.msg_iovlen = iovcnt;
+
+		sqe = uring_sqe(&worker->ring);
+		uring_prep(sqe, IORING_OP_SENDMSG, conn->fd, &conn->msg, 1, 0,
+				URING_DATA(conn, URING_SEND));
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		count++;
+	}
+
+	if (iovcnt < out->count) {
+		OutputSegment *seg = output_seg(out, iovcnt);
+		if (uring_conn_pipe(conn) < 0) {
+			if (!count) {
+				uring_conn_close(worker, conn);
+				return;
+			}
+			goto submit;
+		}
+
+		uint32_t len = (seg->len < conn->pipe_size) ? seg->len : conn->pipe_size;
+
+		if (sqe)
+			sqe->flags |= IOSQE_IO_LINK;
+
+		sqe = uring_sqe(&worker->ring);
+		uring_prep_splice(sqe, seg->fd, seg->off, conn->pipe[1], len,
+				URING_DATA(conn, URING_SPLICE_IN));
+		sqe->flags |= IOSQE_IO_LINK;
+
+		sqe = uring_sqe(&worker->ring);
+		uring_prep_splice(sqe, conn->pipe[0], (uint64_t) -1, conn->fd, len,
+				URING_DATA(conn, URING_SPLICE_OUT));
+		count += 2;
+	}
+
+submit:
+	conn->sending = count;
+	conn->inflight += count;
+}
+
+/*
+ * The last completion of a send chain came in.
+ */
+static void uring_send_done(Worker *worker, Connection *conn)
+{
+	if (conn->dead)
+		return;
+
+	if (!output_empty(&conn->out) || conn->piped) {
+		uring_send(worker, conn);
+		return;
+	}
+
+	resource_unpin(conn->pinned);
+	conn->pinned = NULL;
+
+	uring_conn_feed(worker, conn);
+}
+
+static void uring_on_recv(Worker *worker, Connection *conn, int res, uint32_t flags)
+{
+	if (!(flags & IORING_CQE_F_MORE)) {
+		conn->recv_armed = 0;
+		conn->inflight--;
+	}
+
+	if (res > 0) {
+		uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if (conn->dead) {
+			uring_buf_put(&worker->ring, bid);
+			worker->bufs_returned = 1;
+			return;
+		}
+
+		worker->rx[bid] = (struct UringRx) { URING_NO_BUF, 0, (uint16_t) res };
+		metrics_add(worker->metrics->bytes_in, res);
+		if (wserver_timing)
+			connection_received(conn);
+		if (conn->rx_tail == URING_NO_BUF)
+			conn->rx_head = bid;
+		else
+			worker->rx[conn->rx_tail].next = bid;
+		conn->rx_tail = bid;
+		conn->rx_count++;
+
+		if (conn->rx_count >= URING_CONN_BUFS)
+			uring_cancel_recv(worker, conn);
+	} else if (res == 0) {
+		conn->eof = 1;
+	} else if (res == -ENOBUFS) {
+		/* Out of buffers, try again once some come back */
+		if (!conn->recv_armed && !conn->dead && !conn->starved) {
+			conn->starved = 1;
+			conn->next_starved = worker->starved;
+			worker->starved = conn;
+		}
+		return;
+	} else if (res != -ECANCELED) {
+		uring_conn_close(worker, conn);
+		return;
+	}
+
+	uring_conn_feed(worker, conn);
+}
+
+/*
+ * A completion for one of the send chain's SQEs.
+ */
+static void uring_on_send(Worker *worker, Connection *conn, int tag, int res)
+{
+	conn->sending--;
+	conn->inflight--;
+
+	if (conn->dead)
+		return;
+
+	if (res == -ECANCELED) {
+		/* An earlier part of the chain came up short */
+	} else if (res < 0 || (res == 0 && tag == URING_SPLICE_IN)) {
+		/* The socket died, or a file shrunk underneath us */
+		uring_conn_close(worker, conn);
+		return;
+	} else if (tag == URING_SEND) {
+		output_advance(&conn->out, res);
+		metrics_add(worker->metrics->bytes_out, res);
+	} else if (tag == URING_SPLICE_IN) {
+		output_advance(&conn->out, res);
+		conn->piped += res;
+	} else {
+		conn->piped -= res;
+		metrics_add(worker->metrics->bytes_out, res);
+	}
+
+	connection_responses_sent(worker, conn, 0);
+
+	if (!conn->sending)
+		uring_send_done(worker, conn);
+}
+
+static void uring_complete(Worker *worker, uint64_t user_data, int res, uint32_t flags)
+{
+	int tag = user_data & URING_TAG_MASK;
+	Connection *conn = (Connection *) (uintptr_t) (user_data & ~(uint64_t) URING_TAG_MASK);
+
+	if (tag == URING_ACCEPT) {
+		/* Armed again by uring_update_accept() */
+		if (!(flags & IORING_CQE_F_MORE))
+			worker->accept_armed = 0;
+
+		if (res >= 0) {
+			uring_conn_open(worker, res);
+		} else if (res == -EMFILE || res == -ENFILE) {
+			log_error("accept failed: %s, pausing\n", strerror(-res));
+			worker_pause_accept(worker);
+		} else if (res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+			log_error("accept failed: %s\n", strerror(-res));
+		}
+		return;
+	}
+
+	if (tag == URING_ACCEPT_CANCEL) {
+		worker->accept_cancelling = 0;
+		return;
+	}
+
+	switch (tag) {
+		case URING_RECV:
+			uring_on_recv(worker, conn, res, flags);
+			break;
+		case URING_SEND:
+		case URING_SPLICE_IN:
+		case URING_SPLICE_OUT:
+			uring_on_send(worker, conn, tag, res);
+			break;
+		case URING_CANCEL:
+			conn->cancelling = 0;
+			conn->inflight--;
+			uring_conn_rearm(worker, conn);
+			break;
+	}
+
+	if (!conn->dead)
+		connection_timeout(worker, conn);
+	uring_conn_free(worker, conn);
+}
+
+/*
+ * A connection's time ran out.
+ */
+static void uring_conn_expired(Timer *timer, void *arg)
+{
+	Worker *worker = arg;
+	Connection *conn = TIMER_CONN(timer);
+
+	metrics_add(worker->metrics->timeouts, 1);
+	if (conn->timeout != TIMEOUT_KEEPALIVE)
+		connection_abort(conn);
+	uring_conn_close(worker, conn);
+}
+
+/*
+ * Receive again on every connection that ran out of buffers,
+ * now that some came back.
+ */
+static void uring_wake_starved(Worker *worker)
+{
+	if (!worker->bufs_returned)
+		return;
+	worker->bufs_returned = 0;
+
+	Connection *conn = worker->starved;
+	worker->starved = NULL;
+
+	while (conn) {
+		Connection *next = conn->next_starved;
+		conn->starved = 0;
+		conn->next_starved = NULL;
+
+		if (conn->dead)
+			uring_conn_free(worker, conn);
+		else
+			uring_conn_feed(worker, conn);
+		conn = next;
+	}
+}
+
+/*
+ * The main loop of a worker on io_uring.
+ */
+static void *uring_mainloop(void *arg)
+{
+	Worker *worker = arg;
+
+	if (uring_init(&worker->ring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE) < 0) {
+		log_error("failed to set up io_uring: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	worker->rx = calloc(URING_BUFS, sizeof(struct UringRx));
+	if (!worker->rx) {
+		log_error("failed to allocate the receive buffer list\n");
+		return NULL;
+	}
+
+	pool_init(&worker->connections, sizeof(Connection), CONN_PER_SLAB);
+	pool_init(&worker->buffers, RECV_BUF_SIZE, BUFS_PER_SLAB);
+	pool_init(&worker->access, sizeof(PendingAccess), ACCESS_PER_SLAB);
+
+	if (uring_arm_accept(worker) < 0) {
+		log_error("failed to queue an accept\n");
+		return NULL;
+	}
+
+	worker->now_ms = clock_ms();
+	timer_wheel_init(&worker->timers, worker->now_ms);
+
+	for ( ;; ) {
+		int timeout = timer_next(&worker->timers, worker->now_ms);
+		int ret = uring_wait(&worker->ring, timeout);
+		worker->now_ms = clock_ms();
+
+		if (ret < 0) {
+			log_error("failed to get completions: io_uring_enter(): %s\n", strerror(errno));
+			continue;
+		}
+
+		/* Responses in flight are pinned, see uring_send() */
+		resource_quiesce();
+
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_cqe(&worker->ring))) {
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			uint32_t flags = cqe->flags;
+
+			uring_cqe_seen(&worker->ring);
+			uring_complete(worker, user_data, res, flags);
+		}
+
+		uring_wake_starved(worker);
+		timer_advance(&worker->timers, worker->now_ms, uring_conn_expired, worker);
+		uring_update_accept(worker);
+	}
+}
+
+#endif // WSERVER_HAVE_URING
+
+/*
+ * Cleanup the listening sockets.
+ */
+static void lsocket_destroy(void)
+{
+	for (int i = 0; i < wserver_nworkers; i++) {
+		Worker *worker = &wserver_workers[i];
+		if (worker->lsocket != -1)
+			close(worker->lsocket);
+		worker->lsocket = -1;
+	}
+	log_write("Successfully destroyed listening sockets.\n");
+}
+
+static void general_cleanup(void)
+{
+	lsocket_destroy();
+	free(wserver_workers);
+	wserver_workers = NULL;
+	wserver_nworkers = 0;
+	metrics_destroy();
+	resource_destroy();
+	log_destroy();
+	settings_destroy();
+}
+
+/*
+ * How many workers to start, based on configuration.
+ */
+static inline int worker_count(void)
+{
+	if (wserver_settings->workers > 0)
+		return wserver_settings->workers;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return (cpus > 0) ? (int) cpus : 1;
+}
+
+/*
+ * Pin a worker to a CPU, if configured (and supported).
+ */
+static inline void worker_pin(Worker *worker)
+{
+#if defined(__linux__)
+	if (!wserver_settings->pin_workers)
+		return;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus <= 0)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(worker->id % cpus, &set);
+
+	int error = pthread_setaffinity_np(worker->thread, sizeof(set), &set);
+	if (error)
+		log_error("failed to pin worker %d: %s\n", worker->id, strerror(error));
+#else
+	(void) worker;
+#endif
+}
+
+#if WSERVER_USE_EPOLL
+#define NATIVE_BACKEND "epoll"
+#else
+#define NATIVE_BACKEND "kqueue"
+#endif
+
+/*
+ * Pick the backend by name ("auto", "uring" or the native one),
+ * falling back to the native one if io_uring isn't usable.
+ *
+ * Returns the name of the backend in use, or NULL for an unknown name.
+ */
+static const char *backend_select(const char *name)
+{
+	int want_uring = !strcmp(name, "uring");
+	if (!want_uring && strcmp(name, "auto") && strcmp(name, NATIVE_BACKEND))
+		return NULL;
+
+	wserver_use_uring = 0;
+	if (!want_uring && strcmp(name, "auto"))
+		return NATIVE_BACKEND;
+
+#if WSERVER_HAVE_URING
+	if (uring_supported()) {
+		wserver_use_uring = 1;
+		return "io_uring";
+	}
+#endif
+
+	if (want_uring)
+		log_error("io_uring isn't supported here, falling back to %s\n", NATIVE_BACKEND);
+	return NATIVE_BACKEND;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = settings_init(argc, argv);
+	if (ret) {
+		settings_destroy();
+		return (ret < 0) ? -1 : 0;
+	}
+
+	atexit(general_cleanup);
+
+	/* A client going away mid-response shows up as EPIPE instead */
+	(void) signal(SIGPIPE, SIG_IGN);
+
+	if (log_init() < 0)
+		return -1;
+	wserver_access_log = log_access_enabled();
+	wserver_metrics = wserver_settings->metrics;
+	wserver_timing = wserver_access_log || wserver_metrics;
+
+	if (resource_init() < 0)
+		return -1;
+
+	log_write_notime("%s\n", wserver_title_text);
+	log_write("Starting...\n");
+
+	scan_init();
+	log_write("Using %s request scanning.\n", scan_impl_name());
+
+	const char *backend_name = backend_select(wserver_settings->backend);
+	if (!backend_name) {
+		log_error("unknown backend %s, expected auto, uring or %s\n",
+				wserver_settings->backend, NATIVE_BACKEND);
+		return -1;
+	}
+	log_write("Using the %s backend.\n", backend_name);
+
+	wserver_nworkers = worker_count();
+	wserver_workers = calloc(wserver_nworkers, sizeof(Worker));
+	if (!wserver_workers || metrics_init(wserver_nworkers) < 0) {
+		log_error("failed to allocate workers\n");
+		return -1;
+	}
+
+	/*
+	 * Bind every listening socket before starting any thread,
+	 * so a bad port fails up front.
+	 */
+	for (int i = 0; i < wserver_nworkers; i++) {
+		Worker *worker = &wserver_workers[i];
+		worker->id = i;
+		worker->metrics = metrics_worker(i);
+		worker->lsocket = -1;
+		worker->efd = -1;
+	}
+
+	for (int i = 0; i < wserver_nworkers; i++) {
+		if (lsocket_init(&wserver_workers[i]) < 0)
+			return -1;
+	}
+
+	for (int i = 0; i < wserver_nworkers; i++) {
+		Worker *worker = &wserver_workers[i];
+		void *(*mainloop)(void *) = lsocket_mainloop;
+#if WSERVER_HAVE_URING
+		if (wserver_use_uring)
+			mainloop = uring_mainloop;
+#endif
+		int error = pthread_create(&worker->thread, NULL, mainloop, worker);
+		if (error) {
+			log_error("pthread_create() failed: %s\n", strerror(error));
+			return -1;
+		}
+		worker_pin(worker);
+	}
+
+	log_write("Started %d worker(s).\n", wserver_nworkers);
+
+	for (int i = 0; i < wserver_nworkers; i++)
+		pthread_join(wserver_workers[i].thread, NULL);
 
-	lsocket_mainloop();
 	return 0;
 }
@@ -0,0 +1,406 @@
+#include <settings.h>
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <ctype.h>
+#include <getopt.h>
+
+typedef enum {
+	SETTING_INT,
+	SETTING_BOOL,
+	SETTING_STR,
+} SettingType;
+
+typedef struct {
+	const char *name;
+	int short_name;
+	SettingType type;
+	size_t offset;
+
+	/* Range of SETTING_INT values */
+	long min, max;
+
+	const char *help;
+} SettingDef;
+
+#define INT_SETTING(name, short_name, field, min, max, help) \
+	{ name, short_name, SETTING_INT, offsetof(Settings, field), min, max, help }
+
+#define BOOL_SETTING(name, short_name, field, help) \
+	{ name, short_name, SETTING_BOOL, offsetof(Settings, field), 0, 1, help }
+
+#define STR_SETTING(name, short_name, field, help) \
+	{ name, short_name, SETTING_STR, offsetof(Settings, field), 0, 0, help }
+
+static const SettingDef setting_defs[] = {
+	INT_SETTING("port", 'p', port, 1, 65535,
+			"port to listen on"),
+	INT_SETTING("backlog", 0, backlog, 1, INT_MAX,
+			"pending connections queued by the kernel"),
+	INT_SETTING("max-connections", 0, max_connections, 0, INT_MAX,
+			"open connections per worker, 0 for no limit"),
+	BOOL_SETTING("pause-accept", 0, pause_accept,
+			"stop accepting past max-connections instead of answering 503"),
+	INT_SETTING("max-buf", 0, max_buf, 1, 1024 * 1024,
+			"receive buffer size in KiB, a request has to fit in it"),
+	INT_SETTING("header-timeout", 0, header_timeout, 0, 86400,
+			"seconds a client gets to send a request head, 0 for no limit"),
+	INT_SETTING("keepalive-timeout", 0, keepalive_timeout, 0, 86400,
+			"seconds an idle keep-alive connection stays open, 0 for no limit"),
+	INT_SETTING("idle-timeout", 0, idle_timeout, 0, 86400,
+			"seconds without progress on a body or response, 0 for no limit"),
+	BOOL_SETTING("log", 0, log,
+			"write a log at all"),
+	STR_SETTING("log-file", 'l', log_file,
+			"file to log to instead of stdout"),
+	STR_SETTING("access-log", 0, access_log,
+			"access log format: off, clf or json"),
+	BOOL_SETTING("metrics", 0, metrics,
+			"serve Prometheus metrics at " WSERVER_METRICS_PATH),
+	INT_SETTING("workers", 'w', workers, 0, 1024,
+			"worker threads, 0 for one per online CPU"),
+	BOOL_SETTING("pin-workers", 0, pin_workers,
+			"pin every worker to its own CPU"),
+	STR_SETTING("backend", 'b', backend,
+			"I/O backend: auto, uring, epoll or kqueue"),
+	STR_SETTING("root", 'r', root,
+			"document root"),
+	BOOL_SETTING("live-reload", 0, live_reload,
+			"pick up changes to the document root"),
+	INT_SETTING("cache-max-file", 0, cache_max_file, 0, INT_MAX,
+			"files up to this size (KiB) are kept in memory"),
+	INT_SETTING("cache-max-size", 0, cache_max_size, 0, INT_MAX,
+			"memory (KiB) used for cached files at most"),
+	BOOL_SETTING("compress", 0, compress,
+			"gzip / brotli text files that have no .gz / .br next to them"),
+	INT_SETTING("compress-max-size", 0, compress_max_size, 0, INT_MAX,
+			"memory (KiB) used for compressed files at most"),
+};
+
+#define NUM_SETTINGS (sizeof(setting_defs) / sizeof(setting_defs[0]))
+
+static Settings settings;
+const Settings *wserver_settings = &settings;
+
+static inline void *setting_field(const SettingDef *def)
+{
+	return (char *) &settings + def->offset;
+}
+
+static const SettingDef *setting_find(const char *name)
+{
+	for (size_t i = 0; i < NUM_SETTINGS; i++) {
+		if (!strcmp(setting_defs[i].name, name))
+			return &setting_defs[i];
+	}
+	return NULL;
+}
+
+static int parse_bool(const char *value, int *out)
+{
+	static const char *yes[] = {"1", "yes", "on", "true"};
+	static const char *no[]  = {"0", "no", "off", "false"};
+
+	for (size_t i = 0; i < sizeof(yes) / sizeof(yes[0]); i++) {
+		if (!strcasecmp(value, yes[i])) {
+			*out = 1;
+			return 0;
+		}
+		if (!strcasecmp(value, no[i])) {
+			*out = 0;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Set one setting from its text value. `where` says where the
+ * value came from, for the error message.
+ */
+static int setting_set(const SettingDef *def, const char *value, const char *where)
+{
+	switch (def->type) {
+		case SETTING_INT: {
+			char *end;
+			errno = 0;
+			long n = strtol(value, &end, 10);
+			if (errno || end == value || *end || n < def->min || n > def->max) {
+				fprintf(stderr, "%s: invalid %s '%s' (expected %ld to %ld)\n",
+						where, def->name, value, def->min, def->max);
+				return -1;
+			}
+			*(int *) setting_field(def) = (int) n;
+			return 0;
+		}
+		case SETTING_BOOL:
+			if (parse_bool(value, (int *) setting_field(def)) < 0) {
+				fprintf(stderr, "%s: invalid %s '%s' (expected yes or no)\n",
+						where, def->name, value);
+				return -1;
+			}
+			return 0;
+		case SETTING_STR: {
+			char **field = setting_field(def);
+			char *copy = strdup(value);
+			if (!copy) {
+				fprintf(stderr, "%s: out of memory\n", where);
+				return -1;
+			}
+			free(*field);
+			*field = copy;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int settings_defaults(void)
+{
+	settings.port              = WSERVER_PORT;
+	settings.backlog           = WSERVER_BACKLOG;
+	settings.max_connections   = WSERVER_MAX_CONNECTIONS;
+	settings.pause_accept      = WSERVER_PAUSE_ACCEPT;
+	settings.max_buf           = WSERVER_MAX_BUF;
+	settings.header_timeout    = WSERVER_HEADER_TIMEOUT;
+	settings.keepalive_timeout = WSERVER_KEEPALIVE_TIMEOUT;
+	settings.idle_timeout      = WSERVER_IDLE_TIMEOUT;
+	settings.log               = 1;
+	settings.metrics           = WSERVER_METRICS;
+	settings.workers           = WSERVER_WORKERS;
+	settings.pin_workers       = WSERVER_PIN_WORKERS;
+	settings.live_reload       = WSERVER_LIVE_RELOAD;
+	settings.cache_max_file    = WSERVER_CACHE_MAX_FILE;
+	settings.cache_max_size    = WSERVER_CACHE_MAX_SIZE;
+	settings.compress          = WSERVER_COMPRESS;
+	settings.compress_max_size = WSERVER_COMPRESS_MAX_SIZE;
+
+	settings.backend    = strdup(WSERVER_BACKEND);
+	settings.root       = strdup(WSERVER_ROOT);
+	settings.access_log = strdup(WSERVER_ACCESS_LOG);
+	if (!settings.backend || !settings.root || !settings.access_log)
+		return -1;
+
+#ifdef WSERVER_LOG_FILE
+	settings.log_file = strdup(WSERVER_LOG_FILE);
+	if (!settings.log_file)
+		return -1;
+#endif
+	return 0;
+}
+
+static char *trim(char *s)
+{
+	while (isspace((unsigned char) *s))
+		s++;
+
+	char *end = s + strlen(s);
+	while (end > s && isspace((unsigned char) end[-1]))
+		end--;
+	*end = '\0';
+	return s;
+}
+
+/*
+ * Read "name = value" lines. Everything after a '#' is a comment,
+ * and '_' can be used instead of '-' in names.
+ */
+static int settings_load(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "failed to open config file %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char line[1024];
+	int line_no = 0;
+	int ret = 0;
+
+	while (fgets(line, sizeof(line), file)) {
+		char where[PATH_MAX + 32];
+		(void) snprintf(where, sizeof(where), "%s:%d", path, ++line_no);
+
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		char *name = trim(line);
+		if (!*name)
+			continue;
+
+		char *eq = strchr(name, '=');
+		if (!eq) {
+			fprintf(stderr, "%s: expected name = value\n", where);
+			ret = -1;
+			break;
+		}
+		*eq = '\0';
+		name = trim(name);
+		char *value = trim(eq + 1);
+
+		for (char *c = name; *c; c++) {
+			if (*c == '_')
+				*c = '-';
+		}
+
+		const SettingDef *def = setting_find(name);
+		if (!def) {
+			fprintf(stderr, "%s: unknown setting '%s'\n", where, name);
+			ret = -1;
+			break;
+		}
+
+		if (setting_set(def, value, where) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	fclose(file);
+	return ret;
+}
+
+static void settings_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [options]\n\n", prog);
+	fprintf(stderr, "  %-26s  %s\n", "-c, --config FILE", "read settings from FILE (name = value lines)");
+	fprintf(stderr, "  %-26s  %s\n", "-h, --help", "show this");
+
+	for (size_t i = 0; i < NUM_SETTINGS; i++) {
+		const SettingDef *def = &setting_defs[i];
+		char opt[64];
+		const char *arg = (def->type == SETTING_INT) ? "N" :
+			(def->type == SETTING_BOOL) ? "yes|no" : "VALUE";
+
+		if (def->short_name)
+			(void) snprintf(opt, sizeof(opt), "-%c, --%s %s", def->short_name, def->name, arg);
+		else
+			(void) snprintf(opt, sizeof(opt), "    --%s %s", def->name, arg);
+		fprintf(stderr, "  %-26s  %s\n", opt, def->help);
+	}
+}
+
+/* getopt_long() hands back these for settings without a short option */
+#define LONG_ONLY_BASE (256)
+
+int settings_init(int argc, char **argv)
+{
+	if (settings_defaults() < 0) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	struct option long_opts[NUM_SETTINGS + 3];
+	char short_opts[2 * NUM_SETTINGS + 8] = "c:h";
+	size_t short_len = strlen(short_opts);
+
+	for (size_t i = 0; i < NUM_SETTINGS; i++) {
+		const SettingDef *def = &setting_defs[i];
+		long_opts[i] = (struct option) {
+			def->name, required_argument, NULL,
+			def->short_name ? def->short_name : LONG_ONLY_BASE + (int) i
+		};
+		if (def->short_name) {
+			short_opts[short_len++] = (char) def->short_name;
+			short_opts[short_len++] = ':';
+		}
+	}
+	short_opts[short_len] = '\0';
+	long_opts[NUM_SETTINGS]     = (struct option) { "config", required_argument, NULL, 'c' };
+	long_opts[NUM_SETTINGS + 1] = (struct option) { "help", no_argument, NULL, 'h' };
+	long_opts[NUM_SETTINGS + 2] = (struct option) { 0 };
+
+	/*
+	 * The config file goes first wherever -c is, so remember
+	 * the command line settings and apply them after it.
+	 */
+	const SettingDef **defs = calloc(argc, sizeof(*defs));
+	char **values = calloc(argc, sizeof(*values));
+	const char *config = NULL;
+	int count = 0;
+	int ret = 0;
+
+	if (!defs || !values) {
+		fprintf(stderr, "out of memory\n");
+		ret = -1;
+		goto out;
+	}
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, short_opts, long_opts, NULL)) != -1) {
+		if (opt == 'c') {
+			config = optarg;
+			continue;
+		}
+		if (opt == 'h') {
+			settings_usage(argv[0]);
+			ret = 1;
+			goto out;
+		}
+
+		const SettingDef *def = NULL;
+		if (opt >= LONG_ONLY_BASE && opt < LONG_ONLY_BASE + (int) NUM_SETTINGS) {
+			def = &setting_defs[opt - LONG_ONLY_BASE];
+		} else {
+			for (size_t i = 0; i < NUM_SETTINGS && opt != '?'; i++) {
+				if (setting_defs[i].short_name == opt)
+					def = &setting_defs[i];
+			}
+		}
+
+		if (!def) {
+			settings_usage(argv[0]);
+			ret = -1;
+			goto out;
+		}
+
+		defs[count] = def;
+		values[count] = optarg;
+		count++;
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, "unexpected argument '%s'\n", argv[optind]);
+		settings_usage(argv[0]);
+		ret = -1;
+		goto out;
+	}
+
+	if (config && settings_load(config) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	for (int i = 0; i < count; i++) {
+		char where[64];
+		(void) snprintf(where, sizeof(where), "--%s", defs[i]->name);
+		if (setting_set(defs[i], values[i], where) < 0) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+out:
+	free(defs);
+	free(values);
+	return ret;
+}
+
+void settings_destroy(void)
+{
+	for (size_t i = 0; i < NUM_SETTINGS; i++) {
+		const SettingDef *def = &setting_defs[i];
+		if (def->type == SETTING_STR) {
+			char **field = setting_field(def);
+			free(*field);
+			*field = NULL;
+		}
+	}
+}
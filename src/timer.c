@@ -0,0 +1,169 @@
+#include <timer.h>
+#include <config.h>
+
+#include <limits.h>
+
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+
+/* Ticks a level covers, and the furthest a timer can be set */
+#define LEVEL_SPAN(l) (1ull << (TIMER_SLOT_BITS * (l)))
+#define TIMER_MAX     (LEVEL_SPAN(TIMER_LEVELS) - 1)
+
+static inline uint64_t ms_to_tick(uint64_t ms)
+{
+	return ms / WSERVER_TIMER_TICK_MS;
+}
+
+void timer_wheel_init(TimerWheel *wheel, uint64_t now_ms)
+{
+	wheel->now = ms_to_tick(now_ms);
+	wheel->count = 0;
+
+	for (int l = 0; l < TIMER_LEVELS; l++) {
+		wheel->occupied[l] = 0;
+		for (int s = 0; s < TIMER_SLOTS; s++) {
+			Timer *head = &wheel->slots[l][s];
+			head->next = head->prev = head;
+		}
+	}
+}
+
+static inline void timer_unlink(TimerWheel *wheel, Timer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+
+	/*
+	 * It was the only timer of its slot if both neighbours are
+	 * the same, that has to be the head then.
+	 */
+	if (timer->next == timer->prev) {
+		size_t idx = (size_t) (timer->next - &wheel->slots[0][0]);
+		wheel->occupied[idx / TIMER_SLOTS] &= ~(1ull << (idx % TIMER_SLOTS));
+	}
+
+	timer->next = timer->prev = NULL;
+	wheel->count--;
+}
+
+/*
+ * Put a timer into the slot of its expiry, on the lowest level that
+ * reaches it. An expiry of right now goes into the slot that's
+ * about to be expired (only happens while cascading).
+ */
+static void timer_insert(TimerWheel *wheel, Timer *timer)
+{
+	uint64_t delta = timer->expires - wheel->now;
+
+	int l = 0;
+	while (l < TIMER_LEVELS - 1 && delta >= LEVEL_SPAN(l + 1))
+		l++;
+
+	size_t s = (timer->expires >> (TIMER_SLOT_BITS * l)) & TIMER_SLOT_MASK;
+	Timer *head = &wheel->slots[l][s];
+
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+
+	wheel->occupied[l] |= 1ull << s;
+	wheel->count++;
+}
+
+void timer_set(TimerWheel *wheel, Timer *timer, uint64_t expires_ms)
+{
+	if (timer_pending(timer))
+		timer_unlink(wheel, timer);
+
+	/* Round up, a timer never goes off early */
+	uint64_t expires = ms_to_tick(expires_ms + WSERVER_TIMER_TICK_MS - 1);
+	if (expires <= wheel->now)
+		expires = wheel->now + 1;
+	if (expires - wheel->now > TIMER_MAX)
+		expires = wheel->now + TIMER_MAX;
+
+	timer->expires = expires;
+	timer_insert(wheel, timer);
+}
+
+void timer_cancel(TimerWheel *wheel, Timer *timer)
+{
+	if (timer_pending(timer))
+		timer_unlink(wheel, timer);
+}
+
+/*
+ * Move every timer of a slot down to where it belongs now.
+ */
+static void timer_cascade(TimerWheel *wheel, int l, size_t s)
+{
+	Timer *head = &wheel->slots[l][s];
+
+	while (head->next != head) {
+		Timer *timer = head->next;
+		timer_unlink(wheel, timer);
+		timer_insert(wheel, timer);
+	}
+}
+
+void timer_advance(TimerWheel *wheel, uint64_t now_ms, void (*expired)(Timer *, void *), void *arg)
+{
+	uint64_t target = ms_to_tick(now_ms);
+
+	while (wheel->now < target) {
+		/* Nothing to go through on the way */
+		if (!wheel->count) {
+			wheel->now = target;
+			return;
+		}
+
+		wheel->now++;
+
+		/* Every time a level wrapped around, the next one moves down a slot */
+		for (int l = 1; l < TIMER_LEVELS; l++) {
+			if (wheel->now & (LEVEL_SPAN(l) - 1))
+				break;
+			timer_cascade(wheel, l, (wheel->now >> (TIMER_SLOT_BITS * l)) & TIMER_SLOT_MASK);
+		}
+
+		Timer *head = &wheel->slots[0][wheel->now & TIMER_SLOT_MASK];
+		while (head->next != head) {
+			Timer *timer = head->next;
+			timer_unlink(wheel, timer);
+			expired(timer, arg);
+		}
+	}
+}
+
+int timer_next(const TimerWheel *wheel, uint64_t now_ms)
+{
+	if (!wheel->count)
+		return -1;
+
+	/* The first timer on the lowest level, at most a full turn away */
+	uint64_t ticks = TIMER_SLOTS;
+	uint64_t occupied = wheel->occupied[0];
+	if (occupied) {
+		unsigned from = (unsigned) ((wheel->now + 1) & TIMER_SLOT_MASK);
+		uint64_t rotated = from ? (occupied >> from) | (occupied << (TIMER_SLOTS - from)) : occupied;
+		ticks = (uint64_t) __builtin_ctzll(rotated) + 1;
+	}
+
+	/* Timers further up can only come due after their level moved down */
+	for (int l = 1; l < TIMER_LEVELS; l++) {
+		if (!wheel->occupied[l])
+			continue;
+		uint64_t cascade = LEVEL_SPAN(l) - (wheel->now & (LEVEL_SPAN(l) - 1));
+		if (cascade < ticks)
+			ticks = cascade;
+		break;
+	}
+
+	uint64_t at_ms = (wheel->now + ticks) * WSERVER_TIMER_TICK_MS;
+	if (at_ms <= now_ms)
+		return 0;
+	if (at_ms - now_ms > INT_MAX)
+		return INT_MAX;
+	return (int) (at_ms - now_ms);
+}
@@ -0,0 +1,301 @@
+#include <uring.h>
+
+#if WSERVER_HAVE_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/time_types.h>
+
+static inline int sys_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags, const void *arg, size_t argsz)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static inline int sys_uring_register(int fd, unsigned op, const void *arg, unsigned nr_args)
+{
+	return (int) syscall(__NR_io_uring_register, fd, op, arg, nr_args);
+}
+
+/*
+ * Single issuer (6.0) is the newest thing we ask for, any kernel
+ * that takes it also has multishot recv and provided buffer rings.
+ */
+#define URING_SETUP_FLAGS \
+	(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | \
+	 IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE)
+
+/*
+ * The opcodes the server submits.
+ */
+static const uint8_t uring_ops[] = {
+	IORING_OP_ACCEPT,
+	IORING_OP_RECV,
+	IORING_OP_SENDMSG,
+	IORING_OP_SPLICE,
+	IORING_OP_ASYNC_CANCEL,
+};
+
+static int uring_probe_ops(Uring *ring)
+{
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (!probe)
+		return -1;
+
+	int ret = 0;
+	if (sys_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	for (size_t i = 0; i < sizeof(uring_ops) / sizeof(uring_ops[0]); i++) {
+		uint8_t op = uring_ops[i];
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			errno = EOPNOTSUPP;
+			ret = -1;
+			break;
+		}
+	}
+
+out:
+	free(probe);
+	return ret;
+}
+
+int uring_supported(void)
+{
+	Uring ring;
+	if (uring_init(&ring, 8, 8, 64) < 0)
+		return 0;
+
+	int ok = (uring_probe_ops(&ring) == 0);
+	uring_destroy(&ring);
+	return ok;
+}
+
+static int uring_map(Uring *ring, struct io_uring_params *p)
+{
+	size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+	/* Both rings live in one mapping on every kernel new enough for us */
+	if (!(p->features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	ring->rings_size = (sq_size > cq_size) ? sq_size : cq_size;
+	ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->rings == MAP_FAILED) {
+		ring->rings = NULL;
+		return -1;
+	}
+
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -1;
+	}
+
+	uint8_t *base = ring->rings;
+	ring->sq_head    = (unsigned *) (base + p->sq_off.head);
+	ring->sq_tail    = (unsigned *) (base + p->sq_off.tail);
+	ring->sq_mask    = *(unsigned *) (base + p->sq_off.ring_mask);
+	ring->sq_entries = p->sq_entries;
+
+	ring->cq_head = (unsigned *) (base + p->cq_off.head);
+	ring->cq_tail = (unsigned *) (base + p->cq_off.tail);
+	ring->cq_mask = *(unsigned *) (base + p->cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe *) (base + p->cq_off.cqes);
+
+	/* SQE i always sits in slot i, the index array never changes */
+	unsigned *array = (unsigned *) (base + p->sq_off.array);
+	for (unsigned i = 0; i < p->sq_entries; i++)
+		array[i] = i;
+
+	ring->sqe_tail = *ring->sq_tail;
+	return 0;
+}
+
+static int uring_map_bufs(Uring *ring, unsigned count, unsigned size)
+{
+	ring->br_size = count * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED) {
+		ring->br = NULL;
+		return -1;
+	}
+
+	ring->bufs = malloc((size_t) count * size);
+	if (!ring->bufs)
+		return -1;
+
+	ring->buf_count = count;
+	ring->buf_size  = size;
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr    = (uint64_t) (uintptr_t) ring->br,
+		.ring_entries = count,
+		.bgid         = URING_BUF_GROUP,
+	};
+	if (sys_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+
+	ring->br_tail = 0;
+	for (unsigned i = 0; i < count; i++)
+		uring_buf_put(ring, (uint16_t) i);
+	return 0;
+}
+
+int uring_init(Uring *ring, unsigned entries, unsigned buf_count, unsigned buf_size)
+{
+	(void) memset(ring, 0, sizeof(Uring));
+	ring->fd = -1;
+
+	if (buf_count == 0 || buf_count > (1u << 15) || (buf_count & (buf_count - 1))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Multishot requests post a lot more completions than submissions */
+	struct io_uring_params p;
+	(void) memset(&p, 0, sizeof(p));
+	p.flags = URING_SETUP_FLAGS;
+	p.cq_entries = entries * 4;
+
+	ring->fd = sys_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+
+	if (uring_map(ring, &p) < 0 || uring_map_bufs(ring, buf_count, buf_size) < 0)
+		goto fail;
+
+	return 0;
+
+fail: ;
+	int error = errno;
+	uring_destroy(ring);
+	errno = error;
+	return -1;
+}
+
+void uring_destroy(Uring *ring)
+{
+	if (ring->fd >= 0)
+		close(ring->fd);
+	if (ring->rings)
+		munmap(ring->rings, ring->rings_size);
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->br)
+		munmap(ring->br, ring->br_size);
+	free(ring->bufs);
+	(void) memset(ring, 0, sizeof(Uring));
+	ring->fd = -1;
+}
+
+/*
+ * Make the handed out SQEs visible to the kernel and enter.
+ */
+static int uring_enter(Uring *ring, unsigned min_complete, int timeout)
+{
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+	const void *argp = NULL;
+	size_t argsz = 0;
+
+	if (min_complete && timeout >= 0) {
+		ts.tv_sec  = timeout / 1000;
+		ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+
+		(void) memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+
+		flags |= IORING_ENTER_EXT_ARG;
+		argp = &arg;
+		argsz = sizeof(arg);
+	}
+
+	int ret = sys_uring_enter(ring->fd, ring->to_submit, min_complete, flags, argp, argsz);
+	if (ret >= 0) {
+		ring->to_submit -= ((unsigned) ret < ring->to_submit) ? (unsigned) ret : ring->to_submit;
+		return 0;
+	}
+
+	/*
+	 * ETIME is the timeout, EBUSY means the completion queue
+	 * is backed up: reap what's there and come back.
+	 */
+	if (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN)
+		return 0;
+	return -1;
+}
+
+int uring_reserve(Uring *ring, unsigned count)
+{
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_entries - (ring->sqe_tail - head) >= count)
+		return 0;
+
+	if (uring_enter(ring, 0, -1) < 0)
+		return -1;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	return (ring->sq_entries - (ring->sqe_tail - head) >= count) ? 0 : -1;
+}
+
+struct io_uring_sqe *uring_sqe(Uring *ring)
+{
+	if (uring_reserve(ring, 1) < 0)
+		return NULL;
+
+	struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+	ring->sqe_tail++;
+	ring->to_submit++;
+
+	(void) memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+int uring_wait(Uring *ring, int timeout)
+{
+	/* Something is already waiting, don't sleep */
+	if (uring_cqe(ring))
+		return ring->to_submit ? uring_enter(ring, 0, -1) : 0;
+	return uring_enter(ring, 1, timeout);
+}
+
+void uring_buf_put(Uring *ring, uint16_t bid)
+{
+	struct io_uring_buf *buf = &ring->br->bufs[ring->br_tail & (ring->buf_count - 1)];
+	buf->addr = (uint64_t) (uintptr_t) uring_buf(ring, bid);
+	buf->len  = ring->buf_size;
+	buf->bid  = bid;
+
+	ring->br_tail++;
+	__atomic_store_n(&ring->br->tail, ring->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif // WSERVER_HAVE_URING